@@ -0,0 +1,176 @@
+#include <pthread.h>
+
+#include "ai.h"
+#include "fleet.h"
+
+#define BOARD_MASK (((bitboard)1 << NUM_SQUARES) - 1)
+
+static bitboard checkerboard, first_col, last_col;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_masks(void)
+{
+    int sq;
+
+    for (sq = 0; sq < NUM_SQUARES; sq++)
+        if ((sq / BOARD_SIZE + sq % BOARD_SIZE) % 2 == 0)
+            checkerboard |= BB_BIT(sq);
+    first_col = boat_mask(0, BOARD_SIZE, 1);
+    last_col = boat_mask(BOARD_SIZE - 1, BOARD_SIZE, 1);
+}
+
+/* A random square of a non empty set. */
+static int random_square(struct ai *ai, bitboard set)
+{
+    int k = fleet_rand(&ai->rng) % bb_popcount(set);
+
+    while (k--)
+        set &= set - 1;
+    return bb_lowest(set);
+}
+
+/* Squares next to any square of set, on the board. */
+static bitboard neighbours(bitboard set)
+{
+    return ((set >> 1) & ~last_col) | ((set << 1) & ~first_col) |
+           (set >> BOARD_SIZE) | ((set << BOARD_SIZE) & BOARD_MASK);
+}
+
+void ai_init(struct ai *ai, int seat, int level, uint64_t seed)
+{
+    pthread_once(&tables_once, build_masks);
+
+    ai->level = level;
+    ai->seat = seat;
+    ai->rng = seed | 1;
+    ai->shots = 0;
+    ai->hits = 0;
+    ai->sunk = 0;
+    ai->afloat = (1 << NUM_BOATS) - 1;
+}
+
+void ai_place_fleet(struct ai *ai, uint8_t fleet[NUM_BOATS])
+{
+    fleet_random(fleet, &ai->rng);
+}
+
+/* Fires around unresolved hits, otherwise on one colour of the checkerboard. */
+static int medium_move(struct ai *ai, bitboard open)
+{
+    bitboard around = neighbours(ai->hits & ~ai->sunk) & open;
+
+    if (around)
+        return random_square(ai, around);
+    if (open & checkerboard)
+        return random_square(ai, open & checkerboard);
+    return random_square(ai, open);
+}
+
+/*
+ * Placement counts are bit sliced: plane k of a counter holds bit k of every
+ * square's count, so adding a placement is a ripple carry over a handful of
+ * bitboards and the best squares fall out of a scan from the top plane, with
+ * no per square loop anywhere.
+ */
+#define COUNT_PLANES 8
+
+static void count_add(bitboard *planes, bitboard mask, int plane)
+{
+    for (; mask && plane < COUNT_PLANES; plane++) {
+        bitboard carry = planes[plane] & mask;
+
+        planes[plane] ^= mask;
+        mask = carry;
+    }
+}
+
+/* The squares of candidates with the highest count. */
+static bitboard count_max(const bitboard *planes, bitboard candidates)
+{
+    int plane;
+
+    for (plane = COUNT_PLANES - 1; plane >= 0; plane--)
+        if (candidates & planes[plane])
+            candidates &= planes[plane];
+    return candidates;
+}
+
+/*
+ * Fires at the open square the most possible boat placements cover. While
+ * some hits are unresolved only placements through them count, and the
+ * ones explaining more hits take precedence.
+ */
+static int hard_move(struct ai *ai, bitboard open)
+{
+    bitboard planes[NUM_BOATS + 1][COUNT_PLANES] = { { 0 } };  /* By hits explained. */
+    int afloat[BOARD_SIZE + 1] = { 0 };     /* Boats afloat, by length. */
+    bitboard unresolved = ai->hits & ~ai->sunk;
+    bitboard blocked = (ai->shots & ~ai->hits) | ai->sunk;
+    int boat, i, len, n;
+
+    for (i = 0; i < NUM_BOATS; i++)
+        if (ai->afloat & (1 << i))
+            afloat[boat_length[i]]++;
+
+    /* Boats of a length share their placements: walk them once per length. */
+    for (boat = 0; boat < NUM_BOATS; boat++) {
+        len = boat_length[boat];
+        if (!afloat[len])
+            continue;
+
+        for (i = 0; i < fleet_nlegal[boat]; i++) {
+            bitboard mask = placement_table[boat][fleet_legal[boat][i]].mask;
+
+            if (mask & blocked)
+                continue;
+            n = unresolved ? bb_popcount(mask & unresolved) : 0;
+            if (unresolved && !n)
+                continue;
+            /* Two boats of a length count twice: add one plane up. */
+            count_add(planes[n], mask & open, afloat[len] - 1);
+        }
+        afloat[len] = 0;
+    }
+
+    for (n = NUM_BOATS; n >= 0; n--) {
+        bitboard covered = 0;
+
+        for (i = 0; i < COUNT_PLANES; i++)
+            covered |= planes[n][i];
+        if (covered & open)
+            return random_square(ai, count_max(planes[n], covered & open));
+    }
+    return random_square(ai, open);
+}
+
+int ai_move(struct ai *ai)
+{
+    bitboard open = BOARD_MASK & ~ai->shots;
+
+    switch (ai->level) {
+    case AI_MEDIUM: return medium_move(ai, open);
+    case AI_HARD: return hard_move(ai, open);
+    default: return random_square(ai, open);
+    }
+}
+
+void ai_observe(struct ai *ai, int sq, int result, const struct board *target)
+{
+    int i;
+
+    ai->shots |= BB_BIT(sq);
+    if (result == SHOT_MISS)
+        return;
+    ai->hits |= BB_BIT(sq);
+
+    if (result == SHOT_SUNK) {
+        for (i = 0; i < NUM_BOATS; i++) {
+            bitboard mask = board_boat(target, i);
+
+            if (mask & BB_BIT(sq)) {
+                ai->sunk |= mask;
+                ai->afloat &= ~(1 << i);
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef AI_H
+#define AI_H
+
+#include <stdint.h>
+
+#include "board.h"
+
+/*
+ * Server side opponent. It only knows what a player would: where it fired,
+ * what each shot hit, and which boat a sinking shot sank (it is announced).
+ *
+ * AI_EASY fires at random, AI_MEDIUM hunts on a checkerboard and then
+ * fires around its hits, AI_HARD fires where the most placements of the
+ * boats still afloat overlap: every placement is one bitboard, ruled out by
+ * a single AND against the misses and sunk boats, and while some hits are
+ * unresolved only placements through them count, weighted by how many they
+ * explain. A hard move is a few microseconds.
+ */
+
+enum ai_level {
+    AI_OFF,
+    AI_EASY,
+    AI_MEDIUM,
+    AI_HARD,
+    AI_LEVELS
+};
+
+struct ai {
+    int level;          /* AI_OFF: every seat is a client. */
+    int seat;           /* The player the server plays. */
+    uint64_t rng;
+    bitboard shots;     /* Fired at on the enemy board. */
+    bitboard hits;
+    bitboard sunk;      /* Squares of the boats sunk so far. */
+    uint8_t afloat;     /* Bit i: enemy boat i is still afloat. */
+};
+
+void ai_init(struct ai *ai, int seat, int level, uint64_t seed);
+
+/* A fleet for the AI's own board, uniformly among the valid ones. */
+void ai_place_fleet(struct ai *ai, uint8_t fleet[NUM_BOATS]);
+
+/* Square to fire at next, always a legal shot. */
+int ai_move(struct ai *ai);
+
+/* Learns the result of its shot. On SHOT_SUNK the sunk boat is read from target. */
+void ai_observe(struct ai *ai, int sq, int result, const struct board *target);
+
+#endif
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "board.h"
+#include "fleet.h"
+#include "game.h"
+#include "rating.h"
+
+/*
+ * Microbenchmarks for the rule kernels. Every kernel runs over a pool of
+ * randomized board states built before the clock starts, so the timed loops
+ * only index precomputed inputs. Allocations are counted by wrapping malloc
+ * at link time (see the Makefile). The rating kernels run against RATED
+ * named players. Output is CSV, or JSON with -j.
+ */
+
+#define POOL 4096   /* Power of two. */
+#define RATED 1000000       /* Players in the rating kernels. */
+#define RATED_GAMES 4000000 /* Played before the clock starts, to spread their ratings. */
+
+static long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) { allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t size) { allocs++; return __real_realloc(p, size); }
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 11);
+}
+
+/* Randomized inputs, built once. */
+static struct board boards[POOL];       /* Full fleets, 0-100% of the board fired at. */
+static struct board partial[POOL];      /* Fleets missing their last boats. */
+static int next_boat[POOL];
+static char placements[POOL][2];
+static uint8_t fleets[POOL][NUM_BOATS]; /* Random boat_pos bytes, about one in eighty valid. */
+static int moves[POOL];                 /* Mostly legal, some out of range. */
+static int free_moves[POOL];            /* Legal for boards[i]. */
+static int results[POOL];
+static struct ai bots[POOL];            /* What an AI knows after the shots on boards[i]. */
+static char names[POOL][PLAYER_NAME_LEN];  /* Some of the rated players. */
+
+static volatile long sink;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void random_fleet(struct board *b, int nboats)
+{
+    int i;
+
+    board_init(b);
+    for (i = 0; i < nboats; i++)
+        while (!board_place(b, i, rng() % NUM_SQUARES, rng() & 1))
+            ;
+}
+
+static void build_pool(void)
+{
+    int i, j;
+
+    for (i = 0; i < POOL; i++) {
+        int shots = rng() % NUM_SQUARES;
+
+        random_fleet(&boards[i], NUM_BOATS);
+        for (j = 0; j < shots; j++)
+            boards[i].shots |= BB_BIT(rng() % NUM_SQUARES);
+        if (boards[i].shots == ((bitboard)1 << NUM_SQUARES) - 1) /* Keep one square free. */
+            boards[i].shots &= ~BB_BIT(0);
+
+        next_boat[i] = rng() % NUM_BOATS;
+        random_fleet(&partial[i], next_boat[i]);
+        placements[i][0] = 'A' + rng() % BOARD_SIZE;
+        placements[i][1] = '0' + rng() % BOARD_SIZE;
+        for (j = 0; j < NUM_BOATS; j++)
+            fleets[i][j] = (rng() & 1 ? BOAT_VERTICAL : 0) | rng() % NUM_SQUARES;
+        if (i & 1) /* Half of them valid for sure. */
+            fleet_random(fleets[i], &rng_state);
+
+        moves[i] = (rng() % 16) ? (int)(rng() % NUM_SQUARES) : (int)(rng() % 256) - 128;
+        do {
+            free_moves[i] = rng() % NUM_SQUARES;
+        } while (boards[i].shots & BB_BIT(free_moves[i]));
+        results[i] = rng() % 3;
+
+        ai_init(&bots[i], 1, AI_HARD, rng());
+        bots[i].shots = boards[i].shots;
+        bots[i].hits = boards[i].shots & boards[i].ships;
+        for (j = 0; j < NUM_BOATS; j++) {
+            if (board_sunk(&boards[i], j)) {
+                bots[i].sunk |= board_boat(&boards[i], j);
+                bots[i].afloat &= ~(1 << j);
+            }
+        }
+    }
+
+    for (i = 0; i < RATED; i++) {
+        char name[PLAYER_NAME_LEN];
+
+        snprintf(name, sizeof(name), "player%d", i);
+        rating_id(name);
+    }
+    for (i = 0; i < RATED_GAMES; i++)
+        rating_game(rng() % RATED, rng() % RATED);
+    for (i = 0; i < POOL; i++)
+        snprintf(names[i], sizeof(names[i]), "player%u", rng() % RATED);
+}
+
+/*
+ * Kernels. Each returns something so the loop cannot be optimized away.
+ * The ones that write copy a pool board first, which is part of the cost.
+ */
+
+static long k_place_boat_on_board(long i)
+{
+    struct board b = partial[i & (POOL - 1)];
+    return place_boat_on_board(&b, placements[(i * 7) & (POOL - 1)], next_boat[i & (POOL - 1)]);
+}
+
+static long k_place_fleet_on_board(long i)
+{
+    struct board b;
+
+    board_init(&b);
+    return place_fleet_on_board(&b, fleets[i & (POOL - 1)]);
+}
+
+static long k_fleet_random(long i)
+{
+    static uint64_t state = 0x2545f4914f6cdd1dULL;
+    uint8_t fleet[NUM_BOATS];
+
+    fleet_random(fleet, &state);
+    return fleet[i % NUM_BOATS];
+}
+
+static long k_check_move(long i)
+{
+    return check_move(&boards[i & (POOL - 1)], moves[(i * 7) & (POOL - 1)]);
+}
+
+static long k_update_board(long i)
+{
+    struct board b = boards[i & (POOL - 1)];
+    return update_board(&b, free_moves[i & (POOL - 1)]);
+}
+
+static long k_check_board(long i)
+{
+    return check_board(&boards[i & (POOL - 1)]);
+}
+
+/* The client's get_update() minus its printf. */
+static long k_get_update(long i)
+{
+    struct board b = boards[i & (POOL - 1)];
+    return board_record_shot(&b, moves[(i * 7) & (POOL - 1)], results[i & (POOL - 1)]);
+}
+
+static long ai_kernel(long i, int level)
+{
+    struct ai ai = bots[i & (POOL - 1)];
+
+    ai.level = level;
+    return ai_move(&ai);
+}
+
+static long k_ai_easy(long i) { return ai_kernel(i, AI_EASY); }
+static long k_ai_medium(long i) { return ai_kernel(i, AI_MEDIUM); }
+static long k_ai_hard(long i) { return ai_kernel(i, AI_HARD); }
+
+static long k_board_copy(long i)
+{
+    struct board b = boards[i & (POOL - 1)];
+    return (long)b.boat_pos[0];
+}
+
+static long k_rating_id(long i)
+{
+    return rating_id(names[i & (POOL - 1)]);
+}
+
+static long k_rating_rank(long i)
+{
+    int rating;
+
+    return rating_rank((int)((i * 7919) % RATED), &rating) + rating;
+}
+
+static long k_rating_game(long i)
+{
+    return rating_game((int)((i * 7919) % RATED), (int)((i * 104729 + 1) % RATED));
+}
+
+static long k_rating_top10(long i)
+{
+    struct rating_record top[10];
+
+    (void)i;
+    return rating_top(top, 10) + top[0].rating;
+}
+
+struct bench {
+    const char *name;
+    long (*kernel)(long);
+};
+
+static const struct bench benches[] = {
+    { "place_boat_on_board", k_place_boat_on_board },
+    { "place_fleet_on_board", k_place_fleet_on_board },
+    { "fleet_random", k_fleet_random },
+    { "check_move", k_check_move },
+    { "update_board", k_update_board },
+    { "check_board", k_check_board },
+    { "get_update", k_get_update },
+    { "ai_move_easy", k_ai_easy },
+    { "ai_move_medium", k_ai_medium },
+    { "ai_move_hard", k_ai_hard },
+    { "board_copy", k_board_copy },  /* Baseline for the kernels that copy. */
+    { "rating_id", k_rating_id },    /* Name lookup among RATED players. */
+    { "rating_rank", k_rating_rank },
+    { "rating_game", k_rating_game },
+    { "rating_top10", k_rating_top10 },
+};
+
+int main(int argc, char *argv[])
+{
+    long iterations = 10000000;
+    int json = 0, opt;
+    size_t b;
+
+    while ((opt = getopt(argc, argv, "n:j")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        case 'j': json = 1; break;
+        default:
+            fprintf(stderr, "usage %s [-n iterations] [-j]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    build_pool();
+
+    if (json)
+        printf("[\n");
+    else
+        printf("name,iterations,ns_per_op,allocs_per_op\n");
+
+    for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+        long i, acc = 0, start, elapsed, alloc_start;
+
+        for (i = 0; i < iterations / 10; i++) /* Warm up. */
+            acc += benches[b].kernel(i);
+
+        alloc_start = allocs;
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            acc += benches[b].kernel(i);
+        elapsed = now_ns() - start;
+        sink = acc;
+
+        if (json)
+            printf("  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.3f, \"allocs_per_op\": %.3f}%s\n",
+                   benches[b].name, iterations, (double)elapsed / iterations,
+                   (double)(allocs - alloc_start) / iterations, b + 1 < sizeof(benches) / sizeof(benches[0]) ? "," : "");
+        else
+            printf("%s,%ld,%.3f,%.3f\n", benches[b].name, iterations, (double)elapsed / iterations,
+                   (double)(allocs - alloc_start) / iterations);
+    }
+
+    if (json)
+        printf("]\n");
+    return 0;
+}
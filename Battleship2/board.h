@@ -0,0 +1,189 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stdint.h>
+
+/*
+ * Bitboard game state, shared by client and server.
+ *
+ * Square sq = row * 10 + col is bit sq of a 128 bit word (bits 100-127 are
+ * never set). A player's board is the union of its boats, the shots fired
+ * at it and where each boat lies, 48 bytes in all: a hit is one AND, a sunk
+ * boat one mask compare, a destroyed fleet one compare.
+ */
+
+#define BOARD_SIZE 10
+#define NUM_SQUARES (BOARD_SIZE * BOARD_SIZE)
+#define NUM_BOATS 5
+#define FLEET_SQUARES 17
+
+#define BOAT_UNPLACED 0xff
+#define BOAT_VERTICAL 0x80   /* Flag in boat_pos, the low bits are the origin square. */
+
+/* Results of a shot, as sent in "UPD". */
+#define SHOT_MISS 0
+#define SHOT_HIT  1
+#define SHOT_SUNK 2
+
+typedef unsigned __int128 bitboard;
+
+struct board {
+    bitboard ships;                 /* Every square holding a boat. */
+    bitboard shots;                 /* Every square fired at. */
+    uint8_t boat_pos[NUM_BOATS];    /* Origin square | BOAT_VERTICAL, or BOAT_UNPLACED. */
+};
+
+/* Porte-avion, croiseur, contre-torpilleur, sous-marin, torpilleur. */
+static const int boat_length[NUM_BOATS] = { 5, 4, 3, 3, 2 };
+
+#define BB_BIT(sq) ((bitboard)1 << (sq))
+
+static inline int bb_popcount(bitboard b)
+{
+    return __builtin_popcountll((uint64_t)b) + __builtin_popcountll((uint64_t)(b >> 64));
+}
+
+/* Index of the lowest set bit. b must not be empty. */
+static inline int bb_lowest(bitboard b)
+{
+    uint64_t lo = (uint64_t)b;
+
+    return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((uint64_t)(b >> 64));
+}
+
+static inline void board_init(struct board *b)
+{
+    int i;
+
+    b->ships = 0;
+    b->shots = 0;
+    for (i = 0; i < NUM_BOATS; i++)
+        b->boat_pos[i] = BOAT_UNPLACED;
+}
+
+/* Squares covered by a boat of the given length, or 0 if it leaves the board. */
+static inline bitboard boat_mask(int sq, int length, int vertical)
+{
+    static const bitboard column[BOARD_SIZE + 1] = { /* length squares going down from bit 0 */
+        0, 1, 0x401, 0x100401, 0x40100401, (bitboard)0x40100401 | ((bitboard)1 << 40),
+        (bitboard)0x40100401 | ((bitboard)0x401 << 40), (bitboard)0x40100401 | ((bitboard)0x100401 << 40),
+        (bitboard)0x40100401 | ((bitboard)0x40100401 << 40),
+        (bitboard)0x40100401 | ((bitboard)0x40100401 << 40) | ((bitboard)1 << 80),
+        (bitboard)0x40100401 | ((bitboard)0x40100401 << 40) | ((bitboard)0x401 << 80),
+    };
+    int row = sq / BOARD_SIZE, col = sq % BOARD_SIZE;
+
+    if (sq < 0 || sq >= NUM_SQUARES || length < 1 || length > BOARD_SIZE)
+        return 0;
+    if (vertical)
+        return row + length > BOARD_SIZE ? 0 : column[length] << sq;
+    return col + length > BOARD_SIZE ? 0 : (((bitboard)1 << length) - 1) << sq;
+}
+
+/* Squares of a placed boat. */
+static inline bitboard board_boat(const struct board *b, int boat)
+{
+    uint8_t pos = b->boat_pos[boat];
+
+    if (pos == BOAT_UNPLACED)
+        return 0;
+    return boat_mask(pos & ~BOAT_VERTICAL, boat_length[boat], pos & BOAT_VERTICAL);
+}
+
+/* The squares of set and every square touching them, diagonals included. */
+static inline bitboard bb_halo(bitboard set)
+{
+    bitboard first_col = boat_mask(0, BOARD_SIZE, 1);
+    bitboard last_col = boat_mask(BOARD_SIZE - 1, BOARD_SIZE, 1);
+    bitboard board = BB_BIT(NUM_SQUARES) - 1;
+    bitboard row = (set | ((set >> 1) & ~last_col) | ((set << 1) & ~first_col)) & board; /* J9 + 1 is off the board, not A9. */
+
+    return (row | (row >> BOARD_SIZE) | (row << BOARD_SIZE)) & board;
+}
+
+/*
+ * Puts a boat down if it fits and neither overlaps nor touches another
+ * boat, even at a corner: the rule fleet_check() applies to whole fleets.
+ * Returns 1 on success.
+ */
+static inline int board_place(struct board *b, int boat, int sq, int vertical)
+{
+    bitboard mask = boat_mask(sq, boat_length[boat], vertical);
+
+    if (!mask || (bb_halo(mask) & b->ships) || b->boat_pos[boat] != BOAT_UNPLACED)
+        return 0;
+
+    b->ships |= mask;
+    b->boat_pos[boat] = (uint8_t)(sq | (vertical ? BOAT_VERTICAL : 0));
+    return 1;
+}
+
+/* A shot is legal if it is on the board and that square was never fired at. */
+static inline int board_can_fire(const struct board *b, int sq)
+{
+    return sq >= 0 && sq < NUM_SQUARES && !(b->shots & BB_BIT(sq));
+}
+
+static inline int board_sunk(const struct board *b, int boat)
+{
+    bitboard mask = board_boat(b, boat);
+
+    return mask && (b->shots & mask) == mask;
+}
+
+/* Fires at a square. Returns SHOT_MISS, SHOT_HIT or SHOT_SUNK. */
+static inline int board_fire(struct board *b, int sq)
+{
+    bitboard bit = BB_BIT(sq);
+    int i;
+
+    b->shots |= bit;
+    if (!(b->ships & bit))
+        return SHOT_MISS;
+
+    for (i = 0; i < NUM_BOATS; i++)
+        if (board_boat(b, i) & bit)
+            return board_sunk(b, i) ? SHOT_SUNK : SHOT_HIT;
+    return SHOT_HIT;
+}
+
+/* Records a shot reported by the server, as seen by a client. Returns 0 if the report makes no sense. */
+static inline int board_record_shot(struct board *b, int sq, int result)
+{
+    if (sq < 0 || sq >= NUM_SQUARES || result < SHOT_MISS || result > SHOT_SUNK)
+        return 0;
+
+    /* We only learn about enemy boats by hitting them. */
+    b->shots |= BB_BIT(sq);
+    if (result != SHOT_MISS)
+        b->ships |= BB_BIT(sq);
+    return 1;
+}
+
+/* Boats not sunk yet: a Salvo turn fires that many shots. */
+static inline int board_afloat(const struct board *b)
+{
+    int i, n = 0;
+
+    for (i = 0; i < NUM_BOATS; i++)
+        n += !board_sunk(b, i);
+    return n;
+}
+
+/* Every boat square has been hit. */
+static inline int board_defeated(const struct board *b)
+{
+    return b->ships && (b->shots & b->ships) == b->ships;
+}
+
+/* How a square looks: ' ' untouched, 'B' boat, 'X' hit, 'O' miss. */
+static inline char board_cell(const struct board *b, int sq)
+{
+    bitboard bit = BB_BIT(sq);
+
+    if (b->shots & bit)
+        return (b->ships & bit) ? 'X' : 'O';
+    return (b->ships & bit) ? 'B' : ' ';
+}
+
+#endif
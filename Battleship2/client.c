@@ -1,42 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 
 
+#include "board.h"
+#include "fleet.h"
+#include "protocol.h"
+#include "render.h"
+#include "trace.h"
+
+#define MAX_INTS (1 + 2 * NUM_BOATS)   /* The longest message, a VOL of a whole salvo. */
+#define RECONNECT_TRIES 30  /* One a second, as long as the server keeps a seat by default. */
+
+int proto = PROTO_FRAMED;   /* -l falls back to the legacy opcodes. */
+struct reader in;
+
+/* Where to reconnect and what to ask for, once the game has started (framed only). */
+char *server_host;
+int server_port;
+int resume_ints[3];         /* Game id, token high, token low, from SRT. */
+int can_resume;
+unsigned char snapshot[SNAPSHOT_LEN];
+unsigned char spec_snapshot[SPEC_SNAPSHOT_LEN];  /* Watching: both boards, sent when we fell behind. */
+const char *player_name;    /* -n: rated under this name. */
+
+/* Tracing (-T): our game and seat, when the last prompt came and when we answered it. */
+unsigned trace_game;
+int trace_player = -1;
+long prompt_ns, reply_ns;
+
+int event_nints;            /* Ints in the last message received. */
+
+int reconnect(void);
+
 /*
  * Socket Read Functions
  */
 
-/* Reads a message from the server socket. */
-void recv_msg(int sockfd, char * msg)
+/* Reads exactly len bytes from the server socket. */
+void recv_bytes(void *buf, size_t len)
 {
-    /* All messages are 3 bytes. */
-    memset(msg, 0, 4);
-    int n = recv(sockfd, msg, 3, 0);
-    
-    if (n < 0 || n != 3) /* Not what we were expecting. Server got killed or the other client disconnected. */ 
-        perror("ERROR reading message from server socket.");
-
-    #ifdef DEBUG
-    printf("[DEBUG] Received message: %s\n", msg);
-    #endif 
+    if (reader_read(&in, buf, len) < 0) { /* Server got killed or the other client disconnected. */
+        perror("ERROR reading from server socket");
+        exit(1);
+    }
 }
 
-/* Reads an int from the server socket. */
-int recv_int(int sockfd)
+/* Reads a raw int from the server socket (legacy protocol). */
+int recv_int(void)
 {
     int msg = 0;
-    int n = recv(sockfd, &msg, sizeof(int), 0);
-    
-    if (n < 0 || n != sizeof(int)) 
-        perror("ERROR reading int from server socket");
-    
+
+    recv_bytes(&msg, sizeof(int));
+
     #ifdef DEBUG
     printf("[DEBUG] Received int: %d\n", msg);
     #endif 
@@ -44,36 +69,141 @@ int recv_int(int sockfd)
     return msg;
 }
 
+/* Number of ints following a legacy opcode. */
+int legacy_nints(int type)
+{
+    switch (type) {
+    case MSG_UPD: return 3;
+    case MSG_PLT:
+    case MSG_CNT: return 1;
+    default: return 0;
+    }
+}
+
+/* Reads the next message from the server. Fills ints with its payload, event_nints with their count, and returns its type. */
+int recv_event(int *ints)
+{
+    int type, i, nints;
+
+    if (proto == PROTO_FRAMED) {
+        struct frame f;
+
+        if (reader_next_frame(&in, &f) < 0) {
+            if (can_resume) { /* Exits unless we got our seat back. */
+                reconnect();
+                return MSG_SNAP;
+            }
+            perror("ERROR reading message from server socket");
+            exit(1);
+        }
+        type = f.type;
+        nints = f.len / sizeof(int);
+        for (i = 0; i < nints && i < MAX_INTS; i++)
+            ints[i] = frame_int(&f, i);
+        if (type == MSG_SNAP && f.len == SPEC_SNAPSHOT_LEN)
+            memcpy(spec_snapshot, f.payload, SPEC_SNAPSHOT_LEN);
+    }
+    else {
+        char msg[3];
+
+        /* All messages are 3 bytes. */
+        recv_bytes(msg, 3);
+        type = legacy_type(msg);
+        nints = legacy_nints(type);
+        for (i = 0; i < nints; i++)
+            ints[i] = recv_int();
+    }
+
+    event_nints = nints < MAX_INTS ? nints : MAX_INTS;
+    if (reply_ns) { /* First message since our reply. */
+        TRACE(TR_WAIT, trace_game, trace_player, reply_ns);
+        reply_ns = 0;
+    }
+    if (type == MSG_PLT || type == MSG_TRN)
+        prompt_ns = TRACE_START();
+
+    #ifdef DEBUG
+    printf("[DEBUG] Received message: %d\n", type);
+    #endif 
+
+    return type;
+}
+
 /*
  * Socket Write Functions
  */
 
+/* Sends one message to the server socket in a single write. */
+void send_server(int sockfd, int type, const void *payload, size_t len)
+{
+    char buf[64];
+    size_t n = proto_encode_raw(proto, buf, sizeof(buf), type, payload, len);
+
+    if (send(sockfd, buf, n, MSG_NOSIGNAL) < 0) /* A dropped connection shows up on the next read. */
+        perror("ERROR writing to server socket");
+
+    if (type == MSG_PLACE || type == MSG_FLEET || type == MSG_MOVE || type == MSG_SALVO) {
+        if (prompt_ns) {
+            TRACE(TR_THINK, trace_game, trace_player, prompt_ns);
+            prompt_ns = 0;
+        }
+        reply_ns = TRACE_START();
+    }
+}
+
 /* Writes an int to the server socket. */
 void send_server_int(int sockfd, int msg)
 {
-    int n = send(sockfd, &msg, sizeof(int), 0);
-    if (n < 0)
-        perror("ERROR writing int to server socket");
+    if (proto == PROTO_FRAMED)
+        msg = htonl(msg);
+    send_server(sockfd, MSG_MOVE, &msg, sizeof(int));
     
     #ifdef DEBUG
     printf("[DEBUG] Wrote int to server: %d\n", msg);
     #endif 
 }
 
+/* Writes a 2 byte square ("A0".."J9") to the server socket. */
 void send_server_square(int sockfd, char square[2])
 {
-    int n = send(sockfd, square, strlen(square), 0);
-    if (n < 0)
-        perror("ERROR writing square to client socket");
+    send_server(sockfd, MSG_PLACE, square, 2);
 }
 
 /*
  * Connect Functions
  */
 
-/* Sets up the connection to the server. */
-int connect_to_server(char * hostname, int portno)
+/* Connects to a server on this host through its UNIX socket. Returns the socket, or -1. */
+int try_connect_unix(const char *path)
 {
+    struct sockaddr_un addr;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR, socket path too long\n");
+        exit(0);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("ERROR opening socket for server.");
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* Connects to the server, by host and port or by socket path. Returns the socket, or -1 if the server cannot be reached. */
+int try_connect(char * hostname, int portno)
+{
+    if (strchr(hostname, '/'))
+        return try_connect_unix(hostname);
+
     struct sockaddr_in serv_addr;
     struct hostent *server;
  
@@ -96,12 +226,14 @@ int connect_to_server(char * hostname, int portno)
 
 	/* Set up the server info. */
     serv_addr.sin_family = AF_INET;
-
+    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
     serv_addr.sin_port = htons(portno); 
 
 	/* Make the connection. */
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
-        perror("ERROR connecting to server");
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
 
     #ifdef DEBUG
     printf("[DEBUG] Connected to server.\n");
@@ -110,57 +242,124 @@ int connect_to_server(char * hostname, int portno)
     return sockfd;
 }
 
+/* Sets up the connection to the server. */
+int connect_to_server(char * hostname, int portno)
+{
+    int sockfd = try_connect(hostname, portno);
+
+    if (sockfd < 0) {
+        perror("ERROR connecting to server");
+        exit(1);
+    }
+    return sockfd;
+}
+
 /*
- * Game Functions
+ * The connection dropped mid game: connects again and asks for our seat
+ * back, a few times since the server may not have noticed the drop yet.
+ * Keeps the socket number so callers holding it need not know. Fills
+ * snapshot, or exits if the game is lost.
  */
+int reconnect(void)
+{
+    int req[3];
+    int tries, i;
+
+    for (i = 0; i < 3; i++)
+        req[i] = htonl(resume_ints[i]);
+
+    printf("Connexion perdue, reconnexion...\n");
+    for (tries = 0; tries < RECONNECT_TRIES; tries++) {
+        struct frame f;
+        int fd;
+
+        if (tries)
+            sleep(1);
+        if ((fd = try_connect(server_host, server_port)) < 0)
+            continue;
+        dup2(fd, in.fd);
+        close(fd);
+        reader_init(&in, in.fd);
+
+        send_server(in.fd, MSG_RESUME, req, sizeof(req));
+        if (reader_next_frame(&in, &f) == 0 && f.type == MSG_SNAP && f.len == SNAPSHOT_LEN) {
+            memcpy(snapshot, f.payload, SNAPSHOT_LEN);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "La partie ne peut pas être reprise.\n");
+    exit(1);
+}
 
-/* Draws the game board to stdout. */
-void draw_board(char board[][10])
+/*
+ * Connects and settles the protocol, then returns the id the server gives
+ * us. A full server tells framed clients when to come back: wait and try
+ * again, for as long as it takes.
+ */
+int join_server(void)
 {
-    printf("   A | B | C | D | E | F | G | H | I | J | \n");
-    printf("   -------------------------------------------\n");
-    printf("1 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[0][0], board[0][1], board[0][2], board[0][3], board[0][4], board[0][5], board[0][6], board[0][7], board[0][8], board[0][9]);
-    printf("   -------------------------------------------\n");
-    printf("2 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[1][0], board[1][1], board[1][2], board[1][3], board[1][4], board[1][5], board[1][6], board[1][7], board[1][8], board[1][9]);
-    printf("   -------------------------------------------\n");
-    printf("3 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[2][0], board[2][1], board[2][2], board[2][3], board[2][4], board[2][5], board[2][6], board[2][7], board[2][8], board[2][9]);
-    printf("   -------------------------------------------\n");
-    printf("4 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[3][0], board[3][1], board[3][2], board[3][3], board[3][4], board[3][5], board[3][6], board[3][7], board[3][8], board[3][9]);
-    printf("   -------------------------------------------\n");
-    printf("5 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[4][0], board[4][1], board[4][2], board[4][3], board[4][4], board[4][5], board[4][6], board[4][7], board[4][8], board[4][9]);
-    printf("   -------------------------------------------\n");
-    printf("6 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[5][0], board[5][1], board[5][2], board[5][3], board[5][4], board[5][5], board[5][6], board[5][7], board[5][8], board[5][9]);
-    printf("   -------------------------------------------\n");
-    printf("7 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[6][0], board[6][1], board[6][2], board[6][3], board[6][4], board[6][5], board[6][6], board[6][7], board[6][8], board[6][9]);
-    printf("   -------------------------------------------\n");
-    printf("8 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[7][0], board[7][1], board[7][2], board[7][3], board[7][4], board[7][5], board[7][6], board[7][7], board[7][8], board[7][9]);
-    printf("   -------------------------------------------\n");
-    printf("9 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[8][0], board[8][1], board[8][2], board[8][3], board[8][4], board[8][5], board[8][6], board[8][7], board[8][8], board[8][9]);
-    printf("   -------------------------------------------\n");
-    printf("10| %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[9][0], board[9][1], board[9][2], board[9][3], board[9][4], board[9][5], board[9][6], board[9][7], board[9][8], board[9][9]);
+    int ints[MAX_INTS];
+
+    while (1) {
+        int sockfd = connect_to_server(server_host, server_port);
+        int type;
+
+        reader_init(&in, sockfd);
+        if (proto != PROTO_FRAMED)
+            return recv_int();
+
+        proto_send_hello(sockfd, player_name);
+        if (recv_event(ints) != MSG_HELLO) {
+            fprintf(stderr, "ERROR server does not speak the framed protocol, try -l\n");
+            exit(1);
+        }
+        if ((type = recv_event(ints)) == MSG_ID)
+            return ints[0];
+        if (type != MSG_FUL)
+            exit(1);
+
+        printf("Serveur plein, nouvel essai dans %d ms...\n", ints[0]);
+        close(sockfd);
+        usleep(ints[0] * 1000);
+    }
 }
 
+/*
+ * Game Functions
+ */
+
+const char *boat_name[NUM_BOATS] = { "porte-avion", "croiseur", "contre-torpilleur", "sous-marin", "torpilleur" };
 
-void boat_placement(int sockfd)
+/* Reads a square from stdin. Returns 0 and fills col/row (0-9) if it is valid. */
+int read_square(int *col, int *row)
 {
-    char col, lig;
     char line[20];
     char line2[20];
-    
+
+    printf("Entrez une colonne (A-J): ");
+    if (!fgets(line, 20, stdin))
+        exit(0);
+    printf("Entrez une ligne (0-9) :");
+    if (!fgets(line2, 20, stdin))
+        exit(0);
+
+    *col = line[0] - 'A';
+    *row = line2[0] - '0';
+    return (*col >= 0 && *col <= 9 && *row >= 0 && *row <= 9) ? 0 : -1;
+}
+
+/* Asks for the origin of a boat and sends it to the server. The boat lies left to right. */
+void boat_placement(int sockfd, int boat, char square[2])
+{
+    int col, lig;
+
     while (1) { /* Ask until we receive. */ 
-        printf("Placez votre porte-avion (4 cases) : \n");
-	    printf("Entrez une colonne (A-I): ");
-	    fgets(line, 20, stdin);
-            printf("Entrez une ligne (0-9) :");
-            fgets(line2, 20, stdin);
-	    col = line[0];
-	    lig = line2[0];
-	    int moveLig = lig - '0';
-        if (col>='A' && col<='I' && moveLig>=0 && moveLig<=9){
+        printf("Placez votre %s (%d cases) : \n", boat_name[boat], boat_length[boat]);
+        if (!read_square(&col, &lig)) {
             printf("\n");
-            char square[2];
-            square[0]=col;
-            square[1]=lig;
+            square[0] = 'A' + col;
+            square[1] = '0' + lig;
             /* Send players move to the server. */
             send_server_square(sockfd, square);
             break;
@@ -170,21 +369,69 @@ void boat_placement(int sockfd)
     }
 }
 
+/*
+ * Framed: asks for every boat with its orientation, checking each against
+ * the ones before (on the board, not touching another), shows the fleet as
+ * it grows, and sends it all in one message. "auto" draws a random fleet.
+ */
+void fleet_placement(int sockfd, uint8_t fleet[NUM_BOATS], const struct board *target)
+{
+    static uint64_t rng;
+    struct board draft;
+    char line[20];
+    int boat = 0, col, lig;
+
+    printf("Placement automatique ? (o/n) : ");
+    if (!fgets(line, 20, stdin))
+        exit(0);
+    if (line[0] == 'o' || line[0] == 'O') {
+        if (!rng)
+            rng = ((uint64_t)time(NULL) << 20 ^ (uint64_t)getpid()) | 1;
+        fleet_random(fleet, &rng);
+        send_server(sockfd, MSG_FLEET, fleet, NUM_BOATS);
+        return;
+    }
+
+    board_init(&draft);
+    while (boat < NUM_BOATS) {
+        printf("Placez votre %s (%d cases) : \n", boat_name[boat], boat_length[boat]);
+        if (read_square(&col, &lig)) {
+            printf("\nInvalid input. Try again.\n");
+            continue;
+        }
+        printf("Vertical (o/n) : ");
+        if (!fgets(line, 20, stdin))
+            exit(0);
+
+        fleet[boat] = (lig * BOARD_SIZE + col) | (line[0] == 'o' || line[0] == 'O' ? BOAT_VERTICAL : 0);
+        if (!fleet_check(fleet, boat + 1)) {
+            printf("\nCe bateau sort de la grille ou touche un autre bateau. Try again.\n");
+            continue;
+        }
+        board_place(&draft, boat, fleet[boat] & ~BOAT_VERTICAL, fleet[boat] & BOAT_VERTICAL);
+        render(&draft, target);
+        boat++;
+    }
+    send_server(sockfd, MSG_FLEET, fleet, NUM_BOATS);
+}
+
+/* Puts a boat the server accepted on our own board. */
+void mark_boat(struct board *board, char square[2], int boat)
+{
+    board_place(board, boat, (square[1] - '0') * BOARD_SIZE + square[0] - 'A', 0);
+}
 
 /* Get's the players turn and sends it to the server. */
 void take_turn(int sockfd)
 {
-    char buffer[10];
+    int col, lig;
     
     while (1) { /* Ask until we receive. */ 
         printf("A vous de jouer ! \n");
-	printf("Entrez une colonne (A-I): ");
-	    fgets(buffer, 10, stdin);
-	    int move = buffer[0] - '0';
-        if (move <= 9 && move >= 0){
+        if (!read_square(&col, &lig)) {
             printf("\n");
             /* Send players move to the server. */
-            send_server_int(sockfd, move);   
+            send_server_int(sockfd, lig * 10 + col);   
             break;
         } 
         else
@@ -192,15 +439,123 @@ void take_turn(int sockfd)
     }
 }
 
-/* Gets a board update from the server. */
-void get_update(int sockfd, char board[][10])
+/*
+ * Salvo: asks for all the turn's shots on one line, checks them against our
+ * earlier shots and each other, and sends them in one message.
+ */
+void take_salvo(int sockfd, int shots, const struct board *target)
 {
-    /* Get the update. */
-    int player_id = recv_int(sockfd);
-    int move = recv_int(sockfd);
+    uint8_t salvo[NUM_BOATS];
+    char line[64];
+
+    while (1) {
+        bitboard aimed = 0;
+        char *s = line;
+        int n = 0;
+
+        printf("A vous de jouer ! Salve de %d tir%s, cases séparées par des espaces (ex. A0 C5) : ", shots, shots > 1 ? "s" : "");
+        if (!fgets(line, sizeof(line), stdin))
+            exit(0);
+        while (n < shots) {
+            int sq;
+
+            while (*s == ' ')
+                s++;
+            if (s[0] < 'A' || s[0] > 'J' || s[1] < '0' || s[1] > '9')
+                break;
+            sq = (s[1] - '0') * BOARD_SIZE + s[0] - 'A';
+            if (!board_can_fire(target, sq) || (aimed & BB_BIT(sq)))
+                break;
+            aimed |= BB_BIT(sq);
+            salvo[n++] = sq;
+            s += 2;
+        }
+        if (n == shots) {
+            printf("\n");
+            send_server(sockfd, MSG_SALVO, salvo, n);
+            return;
+        }
+        printf("\nIl faut %d cases différentes, jamais visées. Try again.\n", shots);
+    }
+}
+
+/* Applies a board update from the server. Returns the board that changed. */
+struct board *get_update(int *upd, int id, struct board *own, struct board *target)
+{
+    static const char *result[] = { "dans l'eau.", "touche !", "coule !" };
+    int player_id = upd[0];
+    int move = upd[1];
+    int hit = upd[2];
+    struct board *board = player_id == id ? target : own;
 
     /* Update the game board. */
-    board[move/10][move%10] = player_id ? 'X' : 'O';    
+    if (!board_record_shot(board, move, hit))
+        return board;
+    printf("%s %c%d: %s\n", player_id == id ? "Vous tirez en" : "L'adversaire tire en", 'A' + move%10, move/10, result[hit]);
+    return board;
+}
+
+/* Follows a game from the server's spectator port until it ends. */
+void watch(int sockfd, int game_id)
+{
+    static const char *result[] = { "dans l'eau.", "touche !", "coule !" };
+    struct board boards[2]; /* boards[p] holds the shots fired at player p. */
+    int ints[MAX_INTS];
+    int type;
+
+    board_init(&boards[0]);
+    board_init(&boards[1]);
+    render_init("Tirs sur le joueur 0", "Tirs sur le joueur 1");
+
+    proto_send_hello(sockfd, NULL);
+    game_id = htonl(game_id);
+    send_server(sockfd, MSG_WATCH, &game_id, sizeof(int));
+    if (recv_event(ints) != MSG_HELLO) {
+        fprintf(stderr, "ERROR not a spectator port\n");
+        exit(1);
+    }
+
+    while (1) {
+        type = recv_event(ints);
+
+        if (type == MSG_SRT) {
+            render(&boards[0], &boards[1]);
+            printf("Partie %d\n------------\n", ints[0]);
+        }
+        else if (type == MSG_UPD) {
+            struct board *board = &boards[(ints[0] + 1) % 2];
+
+            if (board_record_shot(board, ints[1], ints[2])) {
+                printf("Le joueur %d tire en %c%d: %s\n", ints[0], 'A' + ints[1]%10, ints[1]/10, result[ints[2]]);
+                render(&boards[0], &boards[1]);
+            }
+        }
+        else if (type == MSG_VOL && event_nints > 0) {
+            struct board *board = &boards[(ints[0] + 1) % 2];
+            int i;
+
+            for (i = 1; i + 1 < event_nints; i += 2)
+                if (board_record_shot(board, ints[i], ints[i + 1]))
+                    printf("Le joueur %d tire en %c%d: %s\n", ints[0], 'A' + ints[i]%10, ints[i]/10, result[ints[i + 1]]);
+            render(&boards[0], &boards[1]);
+        }
+        else if (type == MSG_SNAP && !spec_snapshot_decode(spec_snapshot, SPEC_SNAPSHOT_LEN, boards)) {
+            printf("Trop de retard, voici la partie en ce moment :\n");
+            render(&boards[0], &boards[1]);
+        }
+        else if (type == MSG_WIN) {
+            printf("Le joueur %d gagne.\n", ints[0]);
+            break;
+        }
+        else if (type == MSG_LSE) {
+            printf("Le joueur %d a quitte la partie.\n", ints[0]);
+            break;
+        }
+        else if (type == MSG_INV) {
+            printf("Cette partie n'est pas en cours.\n");
+            break;
+        }
+    }
 }
 
 /*
@@ -209,82 +564,160 @@ void get_update(int sockfd, char board[][10])
 
 int main(int argc, char *argv[])
 {
-    /* Make sure host and port are specified. */
-    if (argc < 3) {
-       fprintf(stderr,"usage %s hostname port\n", argv[0]);
+    int opt;
+    int watch_id = 0;
+
+    while ((opt = getopt(argc, argv, "lw:n:T:")) != -1) {
+        if (opt == 'l') /* Speak the legacy 3 byte opcodes. */
+            proto = PROTO_LEGACY;
+        else if (opt == 'n') { /* Play rated under this name. */
+            if (!*optarg || strlen(optarg) >= PLAYER_NAME_LEN) {
+                fprintf(stderr, "Le nom doit faire de 1 à %d caractères.\n", PLAYER_NAME_LEN - 1);
+                exit(1);
+            }
+            player_name = optarg;
+        }
+        else if (opt == 'w') /* Spectate a game, port is then the spectator port. */
+            watch_id = atoi(optarg);
+        else if (opt == 'T') { /* Trace where the time goes, Chrome trace-event JSON. */
+            if (trace_open(optarg, "client") < 0) {
+                perror("ERROR opening the trace file");
+                exit(1);
+            }
+            atexit(trace_close);
+        }
+    }
+
+    /* Make sure host and port, or a socket path, are specified. */
+    if (argc - optind < 1 || (argc - optind < 2 && !strchr(argv[optind], '/'))) {
+       fprintf(stderr,"usage %s [-l | -w game | -n name] [-T trace file] (hostname port | socket path)\n", argv[0]);
        exit(0);
     }
 
     /* Connect to the server. */
-    int sockfd = connect_to_server(argv[1], atoi(argv[2]));
+    server_host = argv[optind];
+    server_port = argc - optind > 1 ? atoi(argv[optind + 1]) : 0;
+    int ints[MAX_INTS];
+    int type;
+
+    if (watch_id) {
+        int sockfd = connect_to_server(server_host, server_port);
+
+        reader_init(&in, sockfd);
+        proto = PROTO_FRAMED;
+        watch(sockfd, watch_id);
+        close(sockfd);
+        return 0;
+    }
 
     /* The client ID is the first thing we receive after connecting. */
-    int id = recv_int(sockfd);
+    int id = join_server();
+    int sockfd = in.fd;
 
     #ifdef DEBUG
     printf("[DEBUG] Client ID: %d\n", id);
     #endif 
 
-    char msg[4];
-    char board[10][10] = { {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, /* Game Board */ 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-			   {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, };
+    struct board own;    /* Our fleet and the opponent's shots. */
+    struct board target; /* Our shots, and the enemy squares they hit. */
+    char square[2];
+    int boat = -1;       /* Boat waiting for the server to accept it. */
+    uint8_t fleet[NUM_BOATS];
+    int fleet_sent = 0;  /* Same, for a whole fleet. */
+
+    board_init(&own);
+    board_init(&target);
+    render_init("Votre flotte", "Vos tirs");
 
     printf("BattleShip\n------------\n");
 
     /* Wait for the game to start. */
     do {
-        recv_msg(sockfd, msg);
-        if (!strcmp(msg, "HLD"))
+        type = recv_event(ints);
+        if (type == MSG_HLD)
             printf("Waiting for a second player...\n");
-    } while ( strcmp(msg, "SRT") );
+    } while (type != MSG_SRT);
 
     /* The game has begun. */
     printf("Game on!\n");
-    printf("Your are %c's\n", id ? 'X' : 'O');
-
-    draw_board(board);
+    if (proto == PROTO_FRAMED) {
+        printf("Partie %d (spectateurs : -w %d)\n", ints[0], ints[0]);
+        memcpy(resume_ints, ints, sizeof(resume_ints));
+        trace_game = ints[0];
+        can_resume = 1;
+    }
+    printf("You are player %d\n", id);
+    trace_player = id;
+    render(&own, &target);
 
     while(1) {
-        recv_msg(sockfd, msg);
-
-	if(!strcmp(msg, "PLT")) {
-	    boat_placement(sockfd);
-	}
-	else if (!strcmp(msg, "TRN")) { /* Take a turn. */
-	    printf("Your move...\n");
-	    take_turn(sockfd);
+        type = recv_event(ints);
+
+        /* Anything but "INV" after a placement means the server took it. */
+        if (boat >= 0 && type != MSG_INV && type != MSG_SNAP)
+            mark_boat(&own, square, boat);
+        if (fleet_sent && type != MSG_INV && type != MSG_SNAP)
+            board_place_fleet(&own, fleet);
+        if (boat >= 0 || fleet_sent) /* Also drops the draft fleet after an INV. */
+            render(&own, &target);
+        boat = -1;
+        fleet_sent = 0;
+
+        if (type == MSG_PLT && proto == PROTO_FRAMED && ints[0] == 0) { /* The whole fleet at once. */
+            fleet_placement(sockfd, fleet, &target);
+            fleet_sent = 1;
+        }
+        else if (type == MSG_PLT) { /* Legacy, or a game resumed halfway through placing. */
+            boat_placement(sockfd, ints[0], square);
+            boat = ints[0];
+        }
+        else if (type == MSG_TRN && event_nints) { /* Salvo game: that many shots. */
+            take_salvo(sockfd, ints[0], &target);
+        }
+        else if (type == MSG_TRN) { /* Take a turn. */
+            printf("Your move...\n");
+            take_turn(sockfd);
+        }
+        else if (type == MSG_INV) { /* Move was invalid. Note that a "TRN" or "PLT" message will always follow an "INV" message, so we will end up at the above case in the next iteration. */
+            printf("That position is not allowed. Try again.\n"); 
         }
-        else if (!strcmp(msg, "INV")) { /* Move was invalid. Note that a "TRN" message will always follow an "INV" message, so we will end up at the above case in the next iteration. */
-            printf("That position has already been played. Try again.\n"); 
+        else if (type == MSG_SNAP) { /* Reconnected: the snapshot has everything we missed. */
+            snapshot_decode(snapshot, SNAPSHOT_LEN, &own, &target);
+            render(&own, &target);
+            printf("Partie reprise.\n");
         }
-        else if (!strcmp(msg, "CNT")) { /* Server is sending the number of active players. Note that a "TRN" message will always follow a "CNT" message. */
-            int num_players = recv_int(sockfd);
-            printf("There are currently %d active players.\n", num_players); 
+        else if (type == MSG_CNT) { /* Server is sending the number of active players. */
+            printf("There are currently %d active players.\n", ints[0]); 
         }
-        else if (!strcmp(msg, "UPD")) { /* Server is sending a game board update. */
-            get_update(sockfd, board);
-            draw_board(board);
+        else if (type == MSG_UPD) { /* Server is sending a game board update. */
+            get_update(ints, id, &own, &target);
+            render(&own, &target);
         }
-        else if (!strcmp(msg, "WAT")) { /* Wait for other player to take a turn. */
+        else if (type == MSG_VOL) { /* A whole salvo, one update per shot, drawn once. */
+            int i;
+
+            for (i = 1; i + 1 < event_nints; i += 2) {
+                int upd[3] = { ints[0], ints[i], ints[i + 1] };
+
+                get_update(upd, id, &own, &target);
+            }
+            render(&own, &target);
+        }
+        else if (type == MSG_WAT) { /* Wait for other player to take a turn. */
             printf("Waiting for other players move...\n");
         }
-        else if (!strcmp(msg, "WIN")) { /* Winner. */
+        else if (type == MSG_RANK) { /* Rated game: where we stand now, before the result. */
+            printf("Classement : %d points (%+d), %de sur %d.\n", ints[0], ints[1], ints[2], ints[3]);
+        }
+        else if (type == MSG_WIN) { /* Winner. */
             printf("You win!\n");
             break;
         }
-        else if (!strcmp(msg, "LSE")) { /* Loser. */
+        else if (type == MSG_LSE) { /* Loser. */
             printf("You lost.\n");
             break;
         }
-        else if (!strcmp(msg, "DRW")) { /* Game is a draw. */
+        else if (type == MSG_DRW) { /* Game is a draw. */
             printf("Draw.\n");
             break;
         }
@@ -0,0 +1,50 @@
+#include "fleet.h"
+
+struct placement placement_table[NUM_BOATS][FLEET_POS_COUNT];
+
+uint8_t fleet_legal[NUM_BOATS][FLEET_MAX_LEGAL];
+int fleet_nlegal[NUM_BOATS];
+
+static void build_tables(void) __attribute__((constructor));
+
+static void build_tables(void)
+{
+    int boat, pos;
+
+    for (boat = 0; boat < NUM_BOATS; boat++) {
+        for (pos = 0; pos < FLEET_POS_COUNT; pos++) {
+            bitboard mask = boat_mask(pos & ~BOAT_VERTICAL, boat_length[boat], pos & BOAT_VERTICAL);
+
+            if (!mask)
+                continue;
+            placement_table[boat][pos].mask = mask;
+            placement_table[boat][pos].halo = bb_halo(mask);
+            fleet_legal[boat][fleet_nlegal[boat]++] = (uint8_t)pos;
+        }
+    }
+}
+
+void fleet_random(uint8_t fleet[NUM_BOATS], uint64_t *rng)
+{
+    /*
+     * Every boat is drawn independently and the whole draw is thrown away
+     * at the first conflict: each valid fleet is then exactly as likely as
+     * any other, which retrying a single boat would not give.
+     */
+    while (1) {
+        bitboard taken = 0;
+        int boat;
+
+        for (boat = 0; boat < NUM_BOATS; boat++) {
+            uint8_t pos = fleet_legal[boat][((uint64_t)fleet_rand(rng) * fleet_nlegal[boat]) >> 32];
+            const struct placement *pl = &placement_table[boat][pos];
+
+            if (pl->mask & taken)
+                break;
+            taken |= pl->halo;
+            fleet[boat] = pos;
+        }
+        if (boat == NUM_BOATS)
+            return;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdint.h>
+
+#include "board.h"
+
+/*
+ * Whole fleet placement, shared by client and server.
+ *
+ * Every placement of every boat is computed once, before main(), and looked
+ * up by boat and boat_pos byte (origin square | BOAT_VERTICAL): the squares
+ * it covers, 0 if it leaves the board, and its halo, the squares no other
+ * boat may use. Checking a fleet is then one load, one AND and one OR per
+ * boat, with no decoding and no bounds checks.
+ */
+
+#define FLEET_POS_COUNT 256     /* Every boat_pos byte, valid or not. */
+#define FLEET_MAX_LEGAL (2 * NUM_SQUARES)
+
+struct placement {
+    bitboard mask;
+    bitboard halo;
+};
+
+extern struct placement placement_table[NUM_BOATS][FLEET_POS_COUNT];
+
+/* The boat_pos bytes that fit on the board, by boat: fleet_nlegal[i] of them for boat i. */
+extern uint8_t fleet_legal[NUM_BOATS][FLEET_MAX_LEGAL];
+extern int fleet_nlegal[NUM_BOATS];
+
+/* Next 32 bits of the xorshift state *rng (never 0), for everything drawing fleets or shots. */
+static inline uint32_t fleet_rand(uint64_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return (uint32_t)(*rng >> 32);
+}
+
+/*
+ * Checks the first n boats of a fleet, pos[i] as in boat_pos: each must
+ * fit on the board and neither overlap nor touch another, even at a corner.
+ * Returns their squares, or 0 if they break a rule.
+ */
+static inline bitboard fleet_check(const uint8_t *pos, int n)
+{
+    bitboard ships = 0, taken = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const struct placement *pl = &placement_table[i][pos[i]];
+
+        if (!pl->mask || (pl->mask & taken))
+            return 0;
+        ships |= pl->mask;
+        taken |= pl->halo;
+    }
+    return ships;
+}
+
+/* Puts down a whole fleet at once on an empty board. Returns 1 on success, leaves b untouched otherwise. */
+static inline int board_place_fleet(struct board *b, const uint8_t pos[NUM_BOATS])
+{
+    bitboard ships = fleet_check(pos, NUM_BOATS);
+    int i;
+
+    if (!ships || b->ships)
+        return 0;
+
+    b->ships = ships;
+    for (i = 0; i < NUM_BOATS; i++)
+        b->boat_pos[i] = pos[i];
+    return 1;
+}
+
+/*
+ * Draws a fleet uniformly among all valid ones, with the xorshift state
+ * *rng (never 0). Takes about 20 draws, most given up after a boat or two.
+ */
+void fleet_random(uint8_t fleet[NUM_BOATS], uint64_t *rng);
+
+#endif
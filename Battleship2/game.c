@@ -0,0 +1,591 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+
+#include "fleet.h"
+#include "game.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "rating.h"
+#include "trace.h"
+
+static _Atomic unsigned next_game_id = 1;
+static int place_timeout_ms, turn_timeout_ms;
+
+static void play_bot(struct game *g);
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Counts toward the metrics, unless the game is being rebuilt: the run that played it counted already. */
+static void count(const struct game *g, int metric, uint64_t n)
+{
+    if (!g->replaying)
+        metrics_add(metric, n);
+}
+
+/*
+ * Output Functions
+ */
+
+int game_send(struct game *g, int player_id, int type, const int *ints, int nints)
+{
+    struct outbuf *out = &g->out[player_id];
+    size_t n;
+
+    LOG(LOG_DEBUG, EV_MSG_QUEUED, g->id, player_id, type);
+
+    if (g->cli_sockfd[player_id] < 0) /* The AI reads the game itself, a dropped player gets a snapshot. */
+        return 0;
+
+    n = proto_encode_ints(g->proto[player_id], out->data + out->len, OUTBUF_SIZE - out->len, type, ints, nints);
+    if (n == 0) /* Client is not reading. */
+        return -1;
+    out->len += n;
+    return 0;
+}
+
+/* Queues a message without payload for a client. */
+static void queue_msg(struct game *g, int player_id, int type)
+{
+    game_send(g, player_id, type, NULL, 0);
+}
+
+/*
+ * Rule Functions
+ */
+
+/* Square of "A0".."J9", or -1. */
+int parse_square(const char *placement)
+{
+    int col = placement[0] - 'A';
+    int row = placement[1] - '0';
+
+    if (col < 0 || col >= BOARD_SIZE || row < 0 || row >= BOARD_SIZE)
+        return -1;
+    return row * BOARD_SIZE + col;
+}
+
+/* Places a boat at pos, its origin square | BOAT_VERTICAL. Returns 1 if the boat fits. */
+int place_boat(struct board *board, int pos, int boat)
+{
+    if (pos < 0)
+        return 0;
+    return board_place(board, boat, pos & ~BOAT_VERTICAL, pos & BOAT_VERTICAL);
+}
+
+/* Places a boat horizontally from "A0".."J9". Returns 1 if the boat fits. */
+int place_boat_on_board(struct board *board, const char *placement, int boat)
+{
+    return place_boat(board, parse_square(placement), boat);
+}
+
+/* Places all the boats at once, see board_place_fleet(). Returns 1 if the fleet is valid. */
+int place_fleet_on_board(struct board *board, const uint8_t *fleet)
+{
+    return board_place_fleet(board, fleet);
+}
+
+/* Checks that a players move is valid. */
+int check_move(const struct board *board, int move)
+{
+    return board_can_fire(board, move);
+}
+
+/* Fires a shot at the board. Returns SHOT_MISS, SHOT_HIT or SHOT_SUNK. */
+int update_board(struct board *board, int move)
+{
+    return board_fire(board, move);
+}
+
+/* Checks the board to determine if the whole fleet has been sunk. */
+int check_board(const struct board *board)
+{
+    return board_defeated(board);
+}
+
+/*
+ * State Machine
+ */
+
+void game_set_next_id(unsigned id)
+{
+    atomic_store(&next_game_id, id);
+}
+
+void game_init(struct game *g, int sockfd0, int proto0, int sockfd1, int proto1)
+{
+    memset(g, 0, offsetof(struct game, spec));
+    g->id = atomic_fetch_add_explicit(&next_game_id, 1, memory_order_relaxed);
+    board_init(&g->board[0]);
+    board_init(&g->board[1]);
+    g->cli_sockfd[0] = sockfd0;
+    g->cli_sockfd[1] = sockfd1;
+    g->proto[0] = proto0;
+    g->proto[1] = proto1;
+    g->prev_player_turn = 1;
+    g->rated[0] = g->rated[1] = -1;
+}
+
+void game_set_rated(struct game *g, int rated0, int rated1)
+{
+    g->rated[0] = rated0;
+    g->rated[1] = rated1;
+}
+
+void game_set_salvo(struct game *g)
+{
+    int p;
+
+    for (p = 0; p < 2; p++)
+        if (g->proto[p] == PROTO_LEGACY && !(g->bot.level && p == g->bot.seat))
+            return;
+    g->salvo = 1;
+}
+
+void game_set_bot(struct game *g, int player_id, int level)
+{
+    ai_init(&g->bot, player_id, level, (uint64_t)g->id * 0x9e3779b97f4a7c15ULL ^ (uint64_t)now_ns());
+}
+
+/* Scores a game between two different named players, and tells each where it stands now. */
+static void rate_game(struct game *g, int winner)
+{
+    int loser = (winner + 1) % 2;
+    int rank[4];
+    int gain, p;
+
+    if (g->rated[0] < 0 || g->rated[1] < 0 || g->rated[0] == g->rated[1])
+        return;
+
+    gain = rating_game(g->rated[winner], g->rated[loser]);
+    for (p = 0; p < 2; p++) {
+        rank[2] = rating_rank(g->rated[p], &rank[0]);
+        rank[1] = p == winner ? gain : -gain;
+        rank[3] = rating_count();
+        game_send(g, p, MSG_RANK, rank, 4);
+    }
+}
+
+/* Shots player p fires in its Salvo turn: one per boat afloat, while squares are left. */
+static int salvo_shots(const struct game *g, int p)
+{
+    int afloat = board_afloat(&g->board[p]);
+    int open = NUM_SQUARES - bb_popcount(g->board[(p + 1) % 2].shots);
+
+    return afloat < open ? afloat : open;
+}
+
+/* Prompts the turn player for its next input. */
+static void prompt(struct game *g)
+{
+    int player_turn = g->player_turn;
+
+    /* Tell other player to wait, if necessary. */
+    if (g->prev_player_turn != player_turn)
+        queue_msg(g, (player_turn + 1) % 2, MSG_WAT);
+    g->prev_player_turn = player_turn;
+
+    if (g->state == WAITING_PLT)
+        game_send(g, player_turn, MSG_PLT, &g->boats_placed[player_turn], 1);
+    else if (g->salvo) {
+        int shots = salvo_shots(g, player_turn);
+
+        game_send(g, player_turn, MSG_TRN, &shots, 1);
+    }
+    else
+        queue_msg(g, player_turn, MSG_TRN);
+    g->prompt_ns = now_ns();
+}
+
+void game_start(struct game *g)
+{
+    int srt[2][3];
+    int p;
+
+    if (!g->replaying) {
+        LOG(LOG_INFO, EV_GAME_START, g->id, 0, 0);
+        metrics_add(M_GAMES_STARTED, 1);
+    }
+    journal_append(g->id, J_START, g->salvo ? 1 : -1, g->proto[0], g->proto[1],
+                   g->bot.level ? (uint32_t)(g->bot.seat << 8 | g->bot.level) : 0);
+    spec_open(g);
+    spec_publish(g, MSG_SRT, (const int *)&g->id, 1);
+
+    /* A rebuilt game has its tokens back from the journal already. */
+    if (!g->replaying && getrandom(g->token, sizeof(g->token), 0) != sizeof(g->token)) { /* Guessable, but unique. */
+        g->token[0] = (uint64_t)now_ns() ^ ((uint64_t)g->id << 32);
+        g->token[1] = g->token[0] * 0x9e3779b97f4a7c15ULL;
+    }
+    for (p = 0; p < 2; p++) {
+        if (g->proto[p] != PROTO_FRAMED)
+            continue;
+        journal_append(g->id, J_TOKEN, p, 0, 0, (uint32_t)(g->token[p] >> 32));
+        journal_append(g->id, J_TOKEN, p, 1, 0, (uint32_t)g->token[p]);
+    }
+
+    /* Send the start message, framed clients learn the game id and their resume token with it. */
+    for (p = 0; p < 2; p++) {
+        srt[p][0] = (int)g->id;
+        srt[p][1] = (int)(uint32_t)(g->token[p] >> 32);
+        srt[p][2] = (int)(uint32_t)g->token[p];
+        game_send(g, p, MSG_SRT, srt[p], g->proto[p] == PROTO_FRAMED ? 3 : 0);
+    }
+
+    g->state = WAITING_PLT;
+    g->player_turn = 0;
+    prompt(g);
+    play_bot(g);
+}
+
+void game_replayed(struct game *g)
+{
+    g->replaying = 0;
+    play_bot(g); /* The crash came between its opponent's move and its own. */
+}
+
+ssize_t game_parse(const struct game *g, int player_id, const char *buf, size_t len, struct client_msg *msg)
+{
+    struct frame f;
+    ssize_t n;
+
+    if (g->proto[player_id] == PROTO_LEGACY) {
+        if (g->state == GAME_OVER || player_id != g->player_turn)
+            return 0;
+        if (g->state == WAITING_PLT) {
+            if (len < 2)
+                return 0;
+            msg->type = MSG_PLACE;
+            msg->square = parse_square(buf);
+            return 2;
+        }
+        if (len < sizeof(int))
+            return 0;
+        msg->type = MSG_MOVE;
+        memcpy(&msg->move, buf, sizeof(int));
+        return sizeof(int);
+    }
+
+    n = frame_parse(buf, len, &f);
+    if (n <= 0)
+        return n;
+
+    msg->type = f.type;
+    if (f.type == MSG_PLACE) {
+        if (f.len != 2)
+            return -1;
+        msg->square = parse_square((const char *)f.payload);
+    }
+    else if (f.type == MSG_FLEET) {
+        if (f.len != NUM_BOATS)
+            return -1;
+        memcpy(msg->fleet, f.payload, NUM_BOATS);
+    }
+    else if (f.type == MSG_MOVE) {
+        if (f.len != sizeof(uint32_t))
+            return -1;
+        msg->move = frame_int(&f, 0);
+    }
+    else if (f.type == MSG_SALVO) {
+        if (f.len < 1 || f.len > NUM_BOATS)
+            return -1;
+        msg->nshots = f.len;
+        memcpy(msg->shots, f.payload, f.len);
+    }
+    else {
+        return -1;
+    }
+    return n;
+}
+
+/* The turn player's fleet is complete: the other one places its own, or the shooting starts. */
+static void fleet_placed(struct game *g)
+{
+    if (g->player_turn == 0) { /* Second player places its fleet. */
+        g->player_turn = 1;
+    }
+    else { /* Both fleets are down, player 0 fires first. */
+        g->state = WAITING_TRN;
+        g->player_turn = 0;
+    }
+}
+
+static void handle_placement(struct game *g, int pos)
+{
+    int p = g->player_turn;
+
+    if (!place_boat(&g->board[p], pos, g->boats_placed[p])) {
+        queue_msg(g, p, MSG_INV);
+        prompt(g);
+        return;
+    }
+    journal_append(g->id, J_PLACE, p, pos, g->boats_placed[p], 0);
+
+    if (++g->boats_placed[p] == NUM_BOATS)
+        fleet_placed(g);
+    prompt(g);
+}
+
+/* The whole fleet in one message: all of it goes down, or none. */
+static void handle_fleet(struct game *g, const uint8_t *fleet)
+{
+    int p = g->player_turn;
+    int i;
+
+    if (g->boats_placed[p] || !place_fleet_on_board(&g->board[p], fleet)) {
+        queue_msg(g, p, MSG_INV);
+        prompt(g);
+        return;
+    }
+    for (i = 0; i < NUM_BOATS; i++) /* Recorded as single boats, so recovery and replay need nothing new. */
+        journal_append(g->id, J_PLACE, p, fleet[i], i, 0);
+
+    g->boats_placed[p] = NUM_BOATS;
+    fleet_placed(g);
+    prompt(g);
+}
+
+/* The turn player fired: it won, or the other one's turn begins. */
+static void end_turn(struct game *g)
+{
+    int p = g->player_turn;
+    int other = (p + 1) % 2;
+
+    /* Check for a winner/loser. */
+    if (check_board(&g->board[other])) {
+        rate_game(g, p);
+        queue_msg(g, p, MSG_WIN);
+        queue_msg(g, other, MSG_LSE);
+        LOG(LOG_INFO, EV_GAME_WON, g->id, p, 0);
+        count(g, M_GAMES_ENDED, 1);
+        journal_append(g->id, J_END, p, 0, 0, 0);
+        spec_publish(g, MSG_WIN, &p, 1);
+        g->state = GAME_OVER;
+        return;
+    }
+
+    /* Move to next player. */
+    g->player_turn = other;
+    prompt(g);
+}
+
+static void handle_move(struct game *g, int move)
+{
+    int p = g->player_turn;
+    int other = (p + 1) % 2;
+    int upd[3];
+    int valid = check_move(&g->board[other], move);
+
+    LOG(LOG_DEBUG, EV_MOVE_CHECKED, g->id, p, valid);
+    if (!valid) {
+        queue_msg(g, p, MSG_INV);
+        prompt(g);
+        return;
+    }
+
+    /* Update the board and send the update. */
+    upd[0] = p;
+    upd[1] = move;
+    upd[2] = update_board(&g->board[other], move);
+    if (g->bot.level && p == g->bot.seat)
+        ai_observe(&g->bot, move, upd[2], &g->board[other]);
+    game_send(g, 0, MSG_UPD, upd, 3);
+    game_send(g, 1, MSG_UPD, upd, 3);
+    spec_publish(g, MSG_UPD, upd, 3);
+    count(g, M_MOVES, 1);
+    journal_append(g->id, J_SHOT, p, move, upd[2], 0);
+
+    g->turn_count++;
+    LOG_BOARD(g->id, other, g->turn_count, &g->board[other]);
+    end_turn(g);
+}
+
+/*
+ * A Salvo turn: every shot must be legal and on a different square, or none
+ * is fired. Shots after the one sinking the last boat are dropped.
+ */
+static void handle_salvo(struct game *g, const uint8_t *shots, int n)
+{
+    int p = g->player_turn;
+    int other = (p + 1) % 2;
+    int vol[1 + 2 * NUM_BOATS];
+    bitboard aimed = 0;
+    int valid = n >= 1 && n <= salvo_shots(g, p);
+    int i;
+
+    for (i = 0; i < n && valid; i++) {
+        if ((valid = check_move(&g->board[other], shots[i]) && !(aimed & BB_BIT(shots[i]))))
+            aimed |= BB_BIT(shots[i]);
+    }
+    LOG(LOG_DEBUG, EV_MOVE_CHECKED, g->id, p, valid);
+    if (!valid) {
+        queue_msg(g, p, MSG_INV);
+        prompt(g);
+        return;
+    }
+
+    vol[0] = p;
+    for (i = 0; i < n && !check_board(&g->board[other]); i++) {
+        vol[1 + 2 * i] = shots[i];
+        vol[2 + 2 * i] = update_board(&g->board[other], shots[i]);
+        if (g->bot.level && p == g->bot.seat)
+            ai_observe(&g->bot, shots[i], vol[2 + 2 * i], &g->board[other]);
+        journal_append(g->id, J_SHOT, p, shots[i], vol[2 + 2 * i], 0);
+        g->turn_count++;
+        LOG_BOARD(g->id, other, g->turn_count, &g->board[other]);
+    }
+    game_send(g, 0, MSG_VOL, vol, 1 + 2 * i);
+    game_send(g, 1, MSG_VOL, vol, 1 + 2 * i);
+    spec_publish(g, MSG_VOL, vol, 1 + 2 * i);
+    count(g, M_MOVES, i);
+    end_turn(g);
+}
+
+/* The server's own player moves as soon as it is prompted. */
+static void play_bot(struct game *g)
+{
+    int p = g->bot.seat;
+
+    /* Replaying, it follows the moves it made then. */
+    while (g->bot.level && !g->replaying && g->player_turn == p && g->state != GAME_OVER) {
+        if (g->state == WAITING_PLT) {
+            uint8_t fleet[NUM_BOATS];
+
+            ai_place_fleet(&g->bot, fleet);
+            handle_fleet(g, fleet);
+        }
+        else if (g->salvo) { /* The results come after the whole salvo, like a player's. */
+            uint8_t shots[NUM_BOATS];
+            bitboard fired = g->bot.shots;
+            int i, n = salvo_shots(g, p);
+
+            for (i = 0; i < n; i++) {
+                shots[i] = ai_move(&g->bot);
+                g->bot.shots |= BB_BIT(shots[i]);
+            }
+            g->bot.shots = fired;
+            handle_salvo(g, shots, n);
+        }
+        else {
+            handle_move(g, ai_move(&g->bot));
+        }
+    }
+}
+
+void game_handle_input(struct game *g, int player_id, const struct client_msg *msg)
+{
+    long now;
+
+    if (player_id != g->player_turn || g->state == GAME_OVER)
+        return;
+
+    now = now_ns();
+    if (!g->replaying) {
+        metrics_reply(g->state == WAITING_PLT ? REPLY_PLT : REPLY_TRN, (now - g->prompt_ns) / 1000);
+        TRACE(g->state == WAITING_PLT ? TR_REPLY_PLT : TR_REPLY_TRN, g->id, player_id, g->prompt_ns);
+    }
+
+    if (g->state == WAITING_PLT && msg->type == MSG_PLACE)
+        handle_placement(g, msg->square);
+    else if (g->state == WAITING_PLT && msg->type == MSG_FLEET)
+        handle_fleet(g, msg->fleet);
+    else if (g->state == WAITING_TRN && msg->type == MSG_MOVE) /* In a Salvo game, a single shot salvo. */
+        handle_move(g, msg->move);
+    else if (g->state == WAITING_TRN && msg->type == MSG_SALVO && g->salvo)
+        handle_salvo(g, msg->shots, msg->nshots);
+    play_bot(g);
+    if (!g->replaying)
+        TRACE(TR_HANDLE, g->id, player_id, now);
+}
+
+void game_abort(struct game *g, int player_id)
+{
+    if (g->state != GAME_OVER) {
+        rate_game(g, (player_id + 1) % 2); /* Leaving loses. */
+        LOG(LOG_INFO, EV_PLAYER_LEFT, g->id, player_id, 0);
+        metrics_add(M_GAMES_ENDED, 1);
+        journal_append(g->id, J_END, -1, 0, 0, 0);
+        spec_publish(g, MSG_LSE, &player_id, 1);
+    }
+    g->state = GAME_OVER;
+}
+
+void game_detach(struct game *g, int player_id)
+{
+    LOG(LOG_INFO, EV_PLAYER_DROPPED, g->id, player_id, 0);
+    g->cli_sockfd[player_id] = -1;
+    g->out[player_id].len = 0;
+}
+
+int game_resume_seat(const struct game *g, uint64_t token)
+{
+    int p;
+
+    for (p = 0; p < 2; p++)
+        if (g->cli_sockfd[p] < 0 && !(g->bot.level && p == g->bot.seat) && g->token[p] == token)
+            return p;
+    return -1;
+}
+
+void game_attach(struct game *g, int player_id, int sockfd)
+{
+    struct outbuf *out = &g->out[player_id];
+    char snap[SNAPSHOT_LEN];
+
+    LOG(LOG_INFO, EV_PLAYER_RESUMED, g->id, player_id, 0);
+    metrics_add(M_RESUMED, 1);
+    g->cli_sockfd[player_id] = sockfd;
+    g->proto[player_id] = PROTO_FRAMED;
+
+    snapshot_encode(snap, player_id, &g->board[player_id], &g->board[(player_id + 1) % 2]);
+    out->len = proto_encode_raw(PROTO_FRAMED, out->data, OUTBUF_SIZE, MSG_SNAP, snap, SNAPSHOT_LEN);
+    if (player_id == g->player_turn) {
+        long since = g->prompt_ns;
+
+        prompt(g);
+        g->prompt_ns = since; /* Dropping does not buy more time. */
+    } else
+        queue_msg(g, player_id, MSG_WAT);
+}
+
+void game_set_timeouts(int place_ms, int turn_ms)
+{
+    place_timeout_ms = place_ms;
+    turn_timeout_ms = turn_ms;
+}
+
+long game_deadline_ns(const struct game *g)
+{
+    int ms = g->state == WAITING_PLT ? place_timeout_ms : turn_timeout_ms;
+
+    if (g->state == GAME_OVER || !ms)
+        return 0;
+    return g->prompt_ns + ms * 1000000L;
+}
+
+void game_timeout(struct game *g)
+{
+    int p = g->player_turn;
+    int other = (p + 1) % 2;
+
+    if (g->state == GAME_OVER)
+        return;
+
+    rate_game(g, other);
+    queue_msg(g, other, MSG_WIN);
+    queue_msg(g, p, MSG_LSE);
+    LOG(LOG_INFO, EV_TIMED_OUT, g->id, p, 0);
+    metrics_add(M_GAMES_ENDED, 1);
+    metrics_add(M_TIMEOUTS, 1);
+    journal_append(g->id, J_END, -1, 1, 0, 0);
+    spec_publish(g, MSG_WIN, &other, 1);
+    g->state = GAME_OVER;
+}
@@ -0,0 +1,133 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ai.h"
+#include "board.h"
+#include "protocol.h"
+#include "resume.h"
+#include "spectate.h"
+
+#define OUTBUF_SIZE 512
+
+/*
+ * A game is an explicit state machine. The server drivers (one thread per
+ * game, or the epoll reactor) only move bytes in and out; every rule lives
+ * behind game_start() / game_handle_input().
+ *
+ * In a Salvo game, each turn fires one shot per boat the player still has
+ * afloat, all in one MSG_SALVO message, checked together and answered with
+ * one MSG_VOL. Only framed players and the AI can play one.
+ */
+
+enum game_state {
+    WAITING_PLT,    /* Waiting for the turn player to place a boat, or its whole fleet. */
+    WAITING_TRN,    /* Waiting for the turn player to fire a shot, or a salvo. */
+    GAME_OVER
+};
+
+/* One decoded client message. */
+struct client_msg {
+    int type;           /* MSG_PLACE, MSG_FLEET, MSG_MOVE or MSG_SALVO. */
+    int move;
+    int square;         /* MSG_PLACE: origin | BOAT_VERTICAL, -1 if off the board. */
+    uint8_t fleet[NUM_BOATS];
+    int nshots;         /* MSG_SALVO: the squares in shots. */
+    uint8_t shots[NUM_BOATS];
+};
+
+/* Bytes queued for one client, flushed by the driver after each event. */
+struct outbuf {
+    size_t len;
+    char data[OUTBUF_SIZE];
+};
+
+struct game {
+    unsigned id;        /* Unique per server run, tags log records. */
+    int cli_sockfd[2];
+    int proto[2];       /* PROTO_LEGACY or PROTO_FRAMED, per client. */
+    enum game_state state;
+    int salvo;          /* Played by the Salvo rules. */
+    int player_turn;
+    int prev_player_turn;
+    int boats_placed[2];
+    int turn_count;
+    long prompt_ns;     /* When the turn player was last prompted. */
+    struct board board[2]; /* board[p] holds player p's fleet and the shots fired at it. */
+    struct outbuf out[2];
+    struct ai bot;              /* Plays seat bot.seat itself, unless level is AI_OFF. */
+    uint64_t token[2];          /* Resume tokens, sent to framed players with SRT. */
+    int rated[2];               /* Rating ids of named players, -1 for the others. */
+    int replaying;              /* Rebuilt from the journal: counts, times and draws nothing, the AI only follows. */
+    /* Last: game_init() leaves these to spec_open() and resume_open(). */
+    struct spec_stream spec;
+    struct resume_slot resume;
+};
+
+/* Ids of games started from now on begin at id. */
+void game_set_next_id(unsigned id);
+
+/* Resets a game between two connected clients. */
+void game_init(struct game *g, int sockfd0, int proto0, int sockfd1, int proto1);
+
+/* Has the server play player_id, whose socket is then unused. Call before game_start(). */
+void game_set_bot(struct game *g, int player_id, int level);
+
+/* Plays the game by the Salvo rules, unless a player speaks legacy. Call after game_set_bot(), before game_start(). */
+void game_set_salvo(struct game *g);
+
+/* Rates the game between two named players (rating ids, -1 if unnamed). */
+void game_set_rated(struct game *g, int rated0, int rated1);
+
+/* Queues the start message and the first prompt. */
+void game_start(struct game *g);
+
+/* The journal replay of a rebuilt game is over: it counts again, and the AI moves if it is its turn. */
+void game_replayed(struct game *g);
+
+/*
+ * Decodes one message sent by a client. Returns the bytes it used, 0 if more
+ * are needed, -1 if the client broke the protocol. Legacy messages carry no
+ * type, so they only decode while the game waits on that client.
+ */
+ssize_t game_parse(const struct game *g, int player_id, const char *buf, size_t len, struct client_msg *msg);
+
+/* Handles one decoded message. Messages from the player not on turn are ignored. */
+void game_handle_input(struct game *g, int player_id, const struct client_msg *msg);
+
+/* Ends the game because a client went away. */
+void game_abort(struct game *g, int player_id);
+
+/* Limits on answering a PLT and a TRN prompt, in milliseconds. 0 waits forever. */
+void game_set_timeouts(int place_ms, int turn_ms);
+
+/* When the turn player's time runs out (CLOCK_MONOTONIC ns), 0 if it never does. */
+long game_deadline_ns(const struct game *g);
+
+/* Ends the game because the turn player ran out of time: it forfeits. */
+void game_timeout(struct game *g);
+
+/* Player player_id lost its connection but keeps its seat. Its output is dropped until it is back. */
+void game_detach(struct game *g, int player_id);
+
+/* The seat whose resume token this is, if it has no connection, else -1. */
+int game_resume_seat(const struct game *g, uint64_t token);
+
+/* Puts a framed client back in its seat: queues the snapshot, then its prompt or WAT. */
+void game_attach(struct game *g, int player_id, int sockfd);
+
+/* Queues a message for a client in its protocol. Returns -1 if the buffer is full. */
+int game_send(struct game *g, int player_id, int type, const int *ints, int nints);
+
+/* Rule functions. */
+int parse_square(const char *placement);
+int place_boat(struct board *board, int pos, int boat);
+int place_boat_on_board(struct board *board, const char *placement, int boat);
+int place_fleet_on_board(struct board *board, const uint8_t *fleet);
+int check_move(const struct board *board, int move);
+int update_board(struct board *board, int move);
+int check_board(const struct board *board);
+
+#endif
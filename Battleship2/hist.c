@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "hist.h"
+
+static int hist_index(uint64_t v)
+{
+    int e;
+
+    if (v < HIST_SUB)
+        return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value that lands in bucket i. */
+static uint64_t hist_upper(int i)
+{
+    int e, sub;
+
+    if (i < HIST_SUB)
+        return i;
+    e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = i & (HIST_SUB - 1);
+    return (((uint64_t)(HIST_SUB + sub + 1)) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_init(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, uint64_t v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank)
+            return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+    }
+    return h->max;
+}
@@ -0,0 +1,31 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+/*
+ * HDR style latency histogram: values below 16 are exact, above that every
+ * power of two is split in 16 linear buckets, so any value is reported
+ * within about 6% and recording is a couple of shifts. Not thread safe:
+ * keep one per thread and merge.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h);
+void hist_record(struct hist *h, uint64_t v);
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/* Value at percentile p (0-100): the highest value of the bucket it falls in. */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+#endif
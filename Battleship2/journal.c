@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+
+#define SEGMENT_BYTES (JOURNAL_SEGMENT_RECORDS * sizeof(struct journal_rec))
+
+/*
+ * A mapped segment. Writers reserve a record with one fetch_add on used and
+ * bracket the copy with writers, so the sync thread knows when a full
+ * segment can be unmapped. The struct itself is never freed: a writer that
+ * loaded it just before it filled up may still bump its counters.
+ */
+struct segment {
+    _Alignas(64) _Atomic uint64_t used;     /* Records reserved, may run past the end. */
+    _Atomic int writers;
+    int fd;
+    unsigned seq;
+    struct journal_rec *recs;
+    uint64_t synced;                        /* Sync thread only. */
+    struct segment *next_retired;
+};
+
+static char journal_dir[PATH_MAX - 32];   /* Room for the file name. */
+static _Atomic(struct segment *) current;
+static pthread_mutex_t rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct segment *retired;             /* Full, not unmapped yet. Under rotate_lock. */
+static unsigned next_seq;
+static unsigned oldest_seq;                 /* No segment below this one is left. Sync thread only. */
+
+int journal_keep_segments = 64;
+
+static struct game **recovered;
+static int nrecovered;
+
+static uint32_t rec_check(const struct journal_rec *rec)
+{
+    const unsigned char *p = (const unsigned char *)rec;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct journal_rec, check); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h | 1;
+}
+
+int journal_rec_valid(const struct journal_rec *rec)
+{
+    return rec->check && rec->check == rec_check(rec) && rec->game_id;
+}
+
+static void segment_path(char *path, unsigned seq)
+{
+    snprintf(path, PATH_MAX, "%s/journal-%08u.seg", journal_dir, seq);
+}
+
+/* Where a segment goes once a restart has compacted it away. */
+static void archive_path(char *path, unsigned seq)
+{
+    snprintf(path, PATH_MAX, "%s/journal-%08u.old", journal_dir, seq);
+}
+
+/* Deletes the oldest segments, archived or full, until only the last journal_keep_segments are left. */
+static void prune(unsigned next)
+{
+    char path[PATH_MAX];
+
+    if (journal_keep_segments <= 0)
+        return;
+    while (next - oldest_seq > (unsigned)journal_keep_segments) {
+        segment_path(path, oldest_seq);
+        unlink(path);
+        archive_path(path, oldest_seq);
+        unlink(path);
+        oldest_seq++;
+    }
+}
+
+static struct segment *open_segment(unsigned seq)
+{
+    char path[PATH_MAX];
+    struct segment *s = (struct segment*)aligned_alloc(64, sizeof(struct segment));
+
+    if (!s)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    s->seq = seq;
+
+    segment_path(path, seq);
+    if ((s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(s->fd, SEGMENT_BYTES) < 0) {
+        perror("ERROR creating a journal segment");
+        if (s->fd >= 0)
+            close(s->fd);
+        free(s);
+        return NULL;
+    }
+
+    s->recs = (struct journal_rec*)mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->recs == MAP_FAILED) {
+        perror("ERROR mapping a journal segment");
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    atomic_init(&s->used, 0);
+    atomic_init(&s->writers, 0);
+    return s;
+}
+
+/* Called by the writer that found full the segment. */
+static void rotate(struct segment *full)
+{
+    struct segment *s;
+
+    pthread_mutex_lock(&rotate_lock);
+    if (atomic_load(&current) == full) {
+        if (!(s = open_segment(next_seq++)))
+            fprintf(stderr, "ERROR the journal stops here\n");
+        full->next_retired = retired;
+        retired = full;
+        atomic_store(&current, s);
+    }
+    pthread_mutex_unlock(&rotate_lock);
+}
+
+/* Copies a checked record into the current segment. */
+static void append(const struct journal_rec *rec)
+{
+    struct segment *s;
+    uint64_t off;
+
+    while ((s = atomic_load(&current))) {
+        atomic_fetch_add(&s->writers, 1);
+        off = atomic_fetch_add(&s->used, 1);
+        if (off < JOURNAL_SEGMENT_RECORDS) {
+            s->recs[off] = *rec;
+            atomic_fetch_sub(&s->writers, 1);
+            return;
+        }
+        atomic_fetch_sub(&s->writers, 1);
+        rotate(s);
+    }
+}
+
+void journal_append(uint32_t game_id, int type, int player, int arg0, int arg1, uint32_t bits)
+{
+    struct journal_rec rec;
+
+    if (!atomic_load_explicit(&current, memory_order_relaxed))
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.game_id = game_id;
+    rec.type = (uint8_t)type;
+    rec.player = (int8_t)player;
+    rec.arg[0] = (uint8_t)arg0;
+    rec.arg[1] = (uint8_t)arg1;
+    rec.bits = bits;
+    rec.check = rec_check(&rec);
+    append(&rec);
+}
+
+/*
+ * Sync Thread
+ */
+
+static void sync_range(struct segment *s, uint64_t from, uint64_t to)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start = (from * sizeof(struct journal_rec)) & ~(size_t)(page - 1);
+    size_t end = to * sizeof(struct journal_rec);
+
+    if (end > start && msync((char *)s->recs + start, end - start, MS_SYNC) < 0)
+        perror("ERROR syncing the journal");
+}
+
+static void *run_sync(void *arg)
+{
+    struct timespec nap = { 0, JOURNAL_SYNC_MS * 1000000L };
+
+    (void)arg;
+
+    while (1) {
+        struct segment *s, **link;
+        uint64_t used;
+        unsigned next;
+
+        nanosleep(&nap, NULL);
+
+        /* Group commit: everything written since the last pass in one msync. */
+        if ((s = atomic_load(&current))) {
+            used = atomic_load(&s->used);
+            if (used > JOURNAL_SEGMENT_RECORDS)
+                used = JOURNAL_SEGMENT_RECORDS;
+            if (used > s->synced) {
+                sync_range(s, s->synced, used);
+                s->synced = used;
+            }
+        }
+
+        pthread_mutex_lock(&rotate_lock);
+        for (link = &retired; (s = *link); ) {
+            if (atomic_load(&s->writers)) {
+                link = &s->next_retired;
+                continue;
+            }
+            sync_range(s, s->synced, JOURNAL_SEGMENT_RECORDS);
+            munmap(s->recs, SEGMENT_BYTES);
+            close(s->fd);
+            *link = s->next_retired;
+        }
+        next = next_seq;
+        pthread_mutex_unlock(&rotate_lock);
+        prune(next);
+    }
+    return NULL;
+}
+
+/*
+ * Recovery
+ */
+
+/* Records of one game from the previous run. */
+struct past_game {
+    uint32_t id;
+    int ended;
+    int n, cap;
+    struct journal_rec *recs;
+};
+
+static struct past_game *table;
+static size_t table_size, table_used;
+static uint32_t last_id;    /* From J_LAST_ID, in case no game since has a higher one. */
+
+static struct past_game *find_game(uint32_t id)
+{
+    size_t i;
+
+    if (table_used * 2 >= table_size) {
+        struct past_game *old = table;
+        size_t old_size = table_size;
+
+        table_size = table_size ? table_size * 2 : 1024;
+        table = (struct past_game*)calloc(table_size, sizeof(*table));
+        table_used = 0;
+        for (i = 0; i < old_size; i++)
+            if (old[i].id)
+                *find_game(old[i].id) = old[i];
+        free(old);
+    }
+
+    for (i = id & (table_size - 1); table[i].id && table[i].id != id; i = (i + 1) & (table_size - 1))
+        ;
+    if (!table[i].id) {
+        table[i].id = id;
+        table_used++;
+    }
+    return &table[i];
+}
+
+static void add_record(const struct journal_rec *rec)
+{
+    struct past_game *pg;
+
+    if (rec->type == J_LAST_ID) {
+        if (rec->game_id > last_id)
+            last_id = rec->game_id;
+        return;
+    }
+
+    pg = find_game(rec->game_id);
+    if (rec->type == J_START) /* Also a compacted copy superseding the original. */
+        pg->n = pg->ended = 0;
+    else if (!pg->n) /* Its start went with a segment we no longer have. */
+        return;
+
+    if (rec->type == J_END) {
+        pg->ended = 1;
+        free(pg->recs);
+        pg->recs = NULL;
+        pg->n = pg->cap = 0;
+        return;
+    }
+
+    if (pg->n == pg->cap) {
+        pg->cap = pg->cap ? pg->cap * 2 : 32;
+        pg->recs = (struct journal_rec*)realloc(pg->recs, pg->cap * sizeof(*pg->recs));
+    }
+    pg->recs[pg->n++] = *rec;
+}
+
+static void read_segment(unsigned seq)
+{
+    char path[PATH_MAX];
+    struct journal_rec *recs;
+    struct stat st;
+    size_t i, n;
+    int fd;
+
+    segment_path(path, seq);
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct journal_rec)) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    recs = (struct journal_rec*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (recs == MAP_FAILED)
+        return;
+
+    /* Writers interleave, a torn record can sit before good ones: skip it, don't stop. */
+    n = st.st_size / sizeof(struct journal_rec);
+    for (i = 0; i < n; i++)
+        if (journal_rec_valid(&recs[i]))
+            add_record(&recs[i]);
+    munmap(recs, st.st_size);
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Replays one game through the rules, as if its players had sent it all
+ * again, the AI included. Nothing is counted or journaled twice, and the
+ * players get back the tokens they were given.
+ */
+static struct game *rebuild(const struct past_game *pg)
+{
+    struct game *g = game_pool_get();
+    uint32_t ai = pg->recs[0].bits;
+    int i;
+
+    if (!g)
+        return NULL;
+
+    game_init(g, -1, pg->recs[0].arg[0], -1, pg->recs[0].arg[1]);
+    g->id = pg->id;
+    if (ai)
+        game_set_bot(g, (int)(ai >> 8), (int)(ai & 0xff));
+    g->salvo = pg->recs[0].player > 0;
+    g->replaying = 1;
+    for (i = 1; i < pg->n; i++) {
+        const struct journal_rec *rec = &pg->recs[i];
+
+        if (rec->type == J_TOKEN && (rec->player == 0 || rec->player == 1))
+            g->token[rec->player] |= (uint64_t)rec->bits << (rec->arg[0] ? 0 : 32);
+    }
+    game_start(g);
+
+    for (i = 1; i < pg->n; i++) {
+        const struct journal_rec *rec = &pg->recs[i];
+        struct client_msg msg;
+
+        if (rec->type == J_TOKEN)
+            continue;
+        memset(&msg, 0, sizeof(msg));
+        if (rec->type == J_PLACE) {
+            msg.type = MSG_PLACE;
+            msg.square = rec->arg[0];
+        }
+        else if (rec->type == J_SHOT && g->salvo) { /* A player's shots in a row are one salvo. */
+            msg.type = MSG_SALVO;
+            msg.shots[msg.nshots++] = rec->arg[0];
+            while (msg.nshots < NUM_BOATS && i + 1 < pg->n && pg->recs[i + 1].type == J_SHOT &&
+                   pg->recs[i + 1].player == rec->player)
+                msg.shots[msg.nshots++] = pg->recs[++i].arg[0];
+        }
+        else if (rec->type == J_SHOT) {
+            msg.type = MSG_MOVE;
+            msg.move = rec->arg[0];
+        }
+        game_handle_input(g, rec->player, &msg);
+    }
+
+    /* Nobody to send the replayed prompts to. */
+    g->out[0].len = 0;
+    g->out[1].len = 0;
+    return g;
+}
+
+int journal_open(const char *dir)
+{
+    unsigned *seqs = NULL, seq, max_seq = 0, min_seq = UINT_MAX;
+    uint32_t max_id;
+    int nseqs = 0, cap = 0, i, j;
+    char ext[4];
+    struct segment *s;
+    struct dirent *de;
+    pthread_t thread;
+    DIR *d;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(journal_dir, sizeof(journal_dir), "%s", dir);
+
+    if (!(d = opendir(dir)))
+        return -1;
+    while ((de = readdir(d))) {
+        if (sscanf(de->d_name, "journal-%8u.%3s", &seq, ext) != 2)
+            continue;
+        if (seq > max_seq)
+            max_seq = seq;
+        if (seq < min_seq)
+            min_seq = seq;
+        if (strcmp(ext, "seg")) /* Archived by an earlier start, its games are over or lost. */
+            continue;
+        if (nseqs == cap) {
+            cap = cap ? cap * 2 : 16;
+            seqs = (unsigned*)realloc(seqs, cap * sizeof(*seqs));
+        }
+        seqs[nseqs++] = seq;
+    }
+    closedir(d);
+    qsort(seqs, nseqs, sizeof(*seqs), cmp_unsigned);
+
+    for (i = 0; i < nseqs; i++)
+        read_segment(seqs[i]);
+
+    /* Rebuild what was still being played, before anything is journaled again. */
+    max_id = last_id;
+    for (i = 0; i < (int)table_size; i++) {
+        struct past_game *pg = &table[i];
+        struct game *g;
+
+        if (pg->id > max_id)
+            max_id = pg->id;
+        if (pg->ended || !pg->n)
+            continue;
+        if (!(g = rebuild(pg))) { /* Its records stay in the archived segments. */
+            fprintf(stderr, "ERROR no game slot left, game %u is not recovered\n", pg->id);
+            continue;
+        }
+        recovered = (struct game**)realloc(recovered, (nrecovered + 1) * sizeof(*recovered));
+        recovered[nrecovered++] = g;
+        metrics_add(M_GAMES_RECOVERED, 1);
+        LOG(LOG_INFO, EV_GAME_RECOVERED, g->id, g->turn_count, 0);
+    }
+    game_set_next_id(max_id + 1);
+
+    next_seq = min_seq != UINT_MAX ? max_seq + 1 : 0;
+    oldest_seq = min_seq != UINT_MAX ? min_seq : 0;
+    if (!(s = open_segment(next_seq++)))
+        return -1;
+    atomic_store(&current, s);
+    if (max_id)
+        journal_append(max_id, J_LAST_ID, -1, 0, 0, 0);
+
+    /* Compaction: the games still open start the new journal, then the old segments are archived. */
+    for (i = 0; i < (int)table_size; i++) {
+        struct past_game *pg = &table[i];
+
+        if (pg->ended || !pg->n)
+            continue;
+        for (j = 0; j < nrecovered && recovered[j]->id != pg->id; j++)
+            ;
+        if (j < nrecovered)
+            for (j = 0; j < pg->n; j++)
+                append(&pg->recs[j]);
+    }
+    for (i = 0; i < nrecovered; i++) /* Whatever the AI plays now follows the copies. */
+        game_replayed(recovered[i]);
+    sync_range(s, 0, atomic_load(&s->used));
+    s->synced = atomic_load(&s->used);
+
+    for (i = 0; i < nseqs; i++) {
+        char path[PATH_MAX], archive[PATH_MAX];
+
+        segment_path(path, seqs[i]);
+        archive_path(archive, seqs[i]);
+        if (rename(path, archive) < 0)
+            perror("ERROR archiving a journal segment");
+    }
+    prune(next_seq);
+
+    for (i = 0; i < (int)table_size; i++)
+        free(table[i].recs);
+    free(table);
+    free(seqs);
+    table = NULL;
+    table_size = table_used = 0;
+
+    if (pthread_create(&thread, NULL, run_sync, NULL))
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+int journal_recovered(struct game ***games)
+{
+    *games = recovered;
+    return nrecovered;
+}
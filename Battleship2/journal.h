@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * Game journal: every game start, placement, shot and end is a 16 byte
+ * record copied into a memory mapped segment file, which is all the move
+ * path pays. A sync thread msyncs what was written every few milliseconds
+ * (group commit) and unmaps full segments once their last writer is done.
+ * On startup the segments of the previous run are replayed, unfinished games
+ * are rebuilt into game slots and copied to a fresh segment, and the old
+ * segments are archived (journal-N.old) for replay to read. A rebuilt game
+ * keeps its resume tokens, so its players can come back to it as after a
+ * dropped connection. Only the last journal_keep_segments segments, archives
+ * included, stay on disk.
+ */
+
+#define JOURNAL_SEGMENT_RECORDS (1 << 18)  /* 4 MB segments. */
+#define JOURNAL_SYNC_MS 5
+
+extern int journal_keep_segments;   /* 0: keep them all. */
+
+enum journal_type {
+    J_START = 1,    /* proto0, proto1; player is 1 for a Salvo game, -1 otherwise; bits: AI seat << 8 | level, 0 without */
+    J_PLACE,        /* player, square (| BOAT_VERTICAL), boat */
+    J_SHOT,         /* player, square, result: one per shot of a salvo */
+    J_END,          /* winner, or -1 if a player left (0) or ran out of time (1) */
+    J_TOKEN,        /* player, half (0: high); bits: that half of the player's resume token */
+    J_LAST_ID       /* No game's: game_id is the last one given out, so archived ids are never reused */
+};
+
+struct journal_rec {
+    uint32_t game_id;
+    uint8_t type;
+    int8_t player;
+    uint8_t arg[2];
+    uint32_t bits;      /* See the types, 0 for most. */
+    uint32_t check;     /* Written with the rest, 0 or a mismatch means a torn or unwritten record. */
+};
+
+/* Recovers the games left in dir, then starts journaling there. Returns -1 on error. */
+int journal_open(const char *dir);
+
+/* Does nothing unless the journal is open. */
+void journal_append(uint32_t game_id, int type, int player, int arg0, int arg1, uint32_t bits);
+
+/* A record was completely written. */
+int journal_rec_valid(const struct journal_rec *rec);
+
+/*
+ * Games rebuilt by journal_open(), with neither player connected. The
+ * caller drives them from there: each seat waits resume_grace_ms for its
+ * player to come back, and the game gives its slot back once it is over.
+ */
+int journal_recovered(struct game ***games);
+
+#endif
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "board.h"
+#include "fleet.h"
+#include "hist.h"
+#include "protocol.h"
+
+/*
+ * Headless load generator: N bots in one process, one epoll loop, each
+ * playing whole games with random placements and shots, then reconnecting
+ * for the next game. Reports games/sec, the round trip from a bot's message
+ * to the server's next message (p50/p99/p999), the CPU time spent per
+ * message (ours, and the server's with -P) and connection errors. Bots a
+ * full server turns away come back when it says. In Salvo games (server -S)
+ * they fire every shot of a turn in one message. With -n every bot plays
+ * rated under its own name. The server is a host and port, or the path of
+ * its UNIX socket.
+ */
+
+#define MAX_EVENTS 1024
+
+enum bot_state { BOT_CONNECTING, BOT_PLAYING, BOT_BACKOFF, BOT_DONE };
+
+struct bot {
+    int fd;
+    enum bot_state state;
+    int id;
+    int have_id;            /* Legacy: the raw id comes first. */
+    long sent_ns;           /* When our last message left, 0 if none is outstanding. */
+    long retry_ns;          /* Backing off: when to connect again, as the full server asked. */
+    char name[PLAYER_NAME_LEN]; /* -n: rated under this name, empty otherwise. */
+    struct board own;
+    bitboard fired;
+    struct reader in;
+};
+
+static int epfd;
+static int proto = PROTO_FRAMED;
+static int boat_by_boat;     /* -b: framed bots place like legacy ones, one PLT round trip per boat. */
+static uint64_t fleet_rng;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static int server_tcp;      /* Not a UNIX socket. */
+static struct hist rtt;     /* Microseconds. */
+
+static long games_done, messages, connect_errors, disconnects, invalid, bots_active;
+static long turned_away, backing_off;
+static long rated_games;    /* Counted by both bots, like games_done. */
+static long seats_left;     /* Games still to join, shared: bots turned away fall behind, and the rest play for them. */
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void bot_connect(struct bot *b)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    b->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (b->fd < 0) {
+        perror("ERROR opening socket");
+        connect_errors++;
+        b->state = BOT_DONE;
+        bots_active--;
+        return;
+    }
+    if (server_tcp)
+        setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    b->state = BOT_CONNECTING;
+    b->have_id = 0;
+    b->sent_ns = 0;
+    b->fired = 0;
+    board_init(&b->own);
+    reader_init(&b->in, b->fd);
+
+    if (connect(b->fd, (struct sockaddr *)&server_addr, server_addrlen) < 0 && errno != EINPROGRESS) {
+        close(b->fd);
+        connect_errors++;
+        b->state = BOT_DONE;
+        bots_active--;
+        return;
+    }
+
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev);
+}
+
+/* Ends the bot's current game, and starts the next one if any is left. */
+static void bot_finish(struct bot *b, int completed)
+{
+    close(b->fd);
+    if (completed)
+        games_done++;
+
+    if (completed && seats_left > 0) {
+        seats_left--;
+        bot_connect(b);
+        return;
+    }
+    b->state = BOT_DONE;
+    bots_active--;
+}
+
+static void bot_send(struct bot *b, int type, const void *payload, size_t len)
+{
+    char buf[64];
+    size_t n = proto_encode_raw(proto, buf, sizeof(buf), type, payload, len);
+
+    if (send(b->fd, buf, n, MSG_NOSIGNAL) != (ssize_t)n) {
+        disconnects++;
+        bot_finish(b, 0);
+        return;
+    }
+    b->sent_ns = now_ns();
+}
+
+/* Picks a random spot where the boat fits. */
+static void bot_place(struct bot *b, int boat)
+{
+    char square[2];
+    int sq;
+
+    if (boat < 0 || boat >= NUM_BOATS)
+        return;
+
+    do {
+        sq = rand() % NUM_SQUARES;
+    } while (!board_place(&b->own, boat, sq, 0));
+
+    square[0] = 'A' + sq % BOARD_SIZE;
+    square[1] = '0' + sq / BOARD_SIZE;
+    bot_send(b, MSG_PLACE, square, 2);
+}
+
+/* Framed: a random fleet, sent in one message. */
+static void bot_place_fleet(struct bot *b)
+{
+    uint8_t fleet[NUM_BOATS];
+
+    fleet_random(fleet, &fleet_rng);
+    board_place_fleet(&b->own, fleet);
+    bot_send(b, MSG_FLEET, fleet, NUM_BOATS);
+}
+
+/* A random square it never fired at, -1 if none is left. */
+static int bot_aim(struct bot *b)
+{
+    int left = NUM_SQUARES - bb_popcount(b->fired);
+    int pick, sq;
+
+    if (left <= 0)
+        return -1;
+    pick = rand() % left;
+    for (sq = 0; sq < NUM_SQUARES; sq++)
+        if (!(b->fired & BB_BIT(sq)) && pick-- == 0)
+            break;
+
+    b->fired |= BB_BIT(sq);
+    return sq;
+}
+
+/* Salvo game: shots random squares in one message. */
+static void bot_fire_salvo(struct bot *b, int shots)
+{
+    uint8_t salvo[NUM_BOATS];
+    int n, sq;
+
+    for (n = 0; n < shots && n < NUM_BOATS && (sq = bot_aim(b)) >= 0; n++)
+        salvo[n] = sq;
+    if (n)
+        bot_send(b, MSG_SALVO, salvo, n);
+}
+
+/* Fires at a random square it never fired at. */
+static void bot_fire(struct bot *b)
+{
+    int sq = bot_aim(b);
+
+    if (sq < 0)
+        return;
+    if (proto == PROTO_FRAMED) {
+        uint32_t move = htonl(sq);
+        bot_send(b, MSG_MOVE, &move, sizeof(move));
+    }
+    else {
+        bot_send(b, MSG_MOVE, &sq, sizeof(int));
+    }
+}
+
+static int legacy_nints(int type)
+{
+    switch (type) {
+    case MSG_UPD: return 3;
+    case MSG_PLT:
+    case MSG_CNT: return 1;
+    default: return 0;
+    }
+}
+
+/* Decodes the next buffered message, its first 4 ints (0 past its payload). Returns 1 if there was one, 0 if more bytes are needed, -1 on garbage. */
+static int bot_next_msg(struct bot *b, int *type, int *ints)
+{
+    const char *buf = b->in.buf + b->in.start;
+    int i, nints;
+
+    memset(ints, 0, 4 * sizeof(int));
+
+    if (proto == PROTO_FRAMED) {
+        struct frame f;
+        ssize_t n = frame_parse(buf, b->in.len, &f);
+
+        if (n <= 0)
+            return n < 0 ? -1 : 0;
+        *type = f.type;
+        for (i = 0; i < 4 && (size_t)i * 4 < f.len; i++)
+            ints[i] = frame_int(&f, i);
+        reader_consume(&b->in, n);
+        return 1;
+    }
+
+    if (!b->have_id) {
+        if (b->in.len < sizeof(int))
+            return 0;
+        *type = MSG_ID;
+        memcpy(&ints[0], buf, sizeof(int));
+        reader_consume(&b->in, sizeof(int));
+        b->have_id = 1;
+        return 1;
+    }
+
+    if (b->in.len < 3)
+        return 0;
+    if ((*type = legacy_type(buf)) == MSG_NONE)
+        return -1;
+    nints = legacy_nints(*type);
+    if (b->in.len < 3 + nints * sizeof(int))
+        return 0;
+    memcpy(ints, buf + 3, nints * sizeof(int));
+    reader_consume(&b->in, 3 + nints * sizeof(int));
+    return 1;
+}
+
+static void bot_readable(struct bot *b)
+{
+    int type, ints[4];
+    int r;
+
+    if (reader_fill(&b->in) < 0) {
+        disconnects++;
+        bot_finish(b, 0);
+        return;
+    }
+
+    while ((r = bot_next_msg(b, &type, ints)) > 0) {
+        messages++;
+        if (b->sent_ns) { /* First answer to what we sent. */
+            hist_record(&rtt, (now_ns() - b->sent_ns) / 1000);
+            b->sent_ns = 0;
+        }
+
+        switch (type) {
+        case MSG_ID:
+            b->id = ints[0];
+            break;
+        case MSG_PLT:
+            if (proto == PROTO_FRAMED && !boat_by_boat && ints[0] == 0)
+                bot_place_fleet(b);
+            else
+                bot_place(b, ints[0]);
+            break;
+        case MSG_TRN:
+            if (ints[0] > 0)
+                bot_fire_salvo(b, ints[0]);
+            else
+                bot_fire(b);
+            break;
+        case MSG_INV:
+            invalid++;
+            break;
+        case MSG_FUL:
+            turned_away++;
+            backing_off++;
+            close(b->fd);
+            b->state = BOT_BACKOFF;
+            b->retry_ns = now_ns() + ints[0] * 1000000L;
+            return;
+        case MSG_RANK:
+            rated_games++;
+            break;
+        case MSG_WIN:
+        case MSG_LSE:
+        case MSG_DRW:
+            bot_finish(b, 1);
+            return;
+        default:
+            break;
+        }
+        if (b->state != BOT_PLAYING) /* bot_send() gave up on it. */
+            return;
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "ERROR bot got a message it does not understand\n");
+        disconnects++;
+        bot_finish(b, 0);
+    }
+}
+
+static void bot_connected(struct bot *b)
+{
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+        close(b->fd);
+        connect_errors++;
+        b->state = BOT_DONE;
+        bots_active--;
+        return;
+    }
+
+    b->state = BOT_PLAYING;
+    ev.events = EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, b->fd, &ev);
+
+    if (proto == PROTO_FRAMED && proto_send_hello(b->fd, b->name[0] ? b->name : NULL) < 0) {
+        disconnects++;
+        bot_finish(b, 0);
+    }
+}
+
+/* A host and port, or with port NULL the path of a UNIX socket. */
+static int resolve(const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+
+    if (!port) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&server_addr;
+
+        if (strlen(host) >= sizeof(addr->sun_path))
+            return -1;
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, host);
+        server_addrlen = sizeof(*addr);
+        return 0;
+    }
+
+    server_tcp = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res)
+        return -1;
+
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* CPU time used so far, in microseconds, by this process or by pid. -1 if it cannot be read. */
+static long cpu_us(int pid)
+{
+    unsigned long utime, stime;
+    char path[64];
+    FILE *f;
+
+    if (!pid) {
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (!(f = fopen(path, "r")))
+        return -1;
+    /* utime and stime are fields 14 and 15, after a command name in parentheses. */
+    if (fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return (long)((utime + stime) * (1000000.0 / sysconf(_SC_CLK_TCK)));
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage %s [-c connections] [-g games per connection] [-d max seconds] [-s seed] [-l] [-b] [-n] [-P server pid] (hostname port | socket path)\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit rl;
+    struct bot *bots;
+    int nbots = 100, games = 1, duration = 0, opt, i;
+    unsigned seed = (unsigned)time(NULL);
+    long start, end, cpu_start, server_cpu_start = 0;
+    int server_pid = 0;
+    int named = 0;
+    double secs;
+
+    while ((opt = getopt(argc, argv, "c:g:d:s:lbnP:")) != -1) {
+        switch (opt) {
+        case 'c': nbots = atoi(optarg); break;
+        case 'g': games = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 's': seed = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'l': proto = PROTO_LEGACY; break;
+        case 'b': boat_by_boat = 1; break;
+        case 'n': named = 1; break;
+        case 'P': server_pid = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1 || nbots < 1 || games < 1)
+        usage(argv[0]);
+    /* Like the client: a socket path has a '/', anything else is a host and needs a port. */
+    if ((strchr(argv[optind], '/') != NULL) != (argc - optind == 1))
+        usage(argv[0]);
+
+    if (resolve(argv[optind], argc - optind > 1 ? argv[optind + 1] : NULL) < 0) {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(1);
+    }
+
+    /* One socket per bot. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    srand(seed);
+    fleet_rng = ((uint64_t)seed << 32 | seed) ^ 0x9e3779b97f4a7c15ULL;
+    hist_init(&rtt);
+    epfd = epoll_create1(0);
+    bots = (struct bot*)calloc(nbots, sizeof(struct bot));
+
+    start = now_ns();
+    cpu_start = cpu_us(0);
+    if (server_pid)
+        server_cpu_start = cpu_us(server_pid);
+    bots_active = nbots;
+    seats_left = (long)nbots * (games - 1);
+    for (i = 0; i < nbots; i++) {
+        if (named)
+            snprintf(bots[i].name, sizeof(bots[i].name), "bot%d", i);
+        bot_connect(&bots[i]);
+    }
+
+    while (bots_active > 0) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, backing_off ? 10 : 1000);
+
+        if (n < 0 && errno != EINTR) {
+            perror("ERROR in epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct bot *b = (struct bot*)events[i].data.ptr;
+
+            if (b->state == BOT_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                bot_connected(b);
+            else if (b->state == BOT_PLAYING && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                bot_readable(b);
+        }
+        if (backing_off) {
+            long now = now_ns();
+
+            for (i = 0; i < nbots; i++) {
+                if (bots[i].state == BOT_BACKOFF && now >= bots[i].retry_ns) {
+                    backing_off--;
+                    bot_connect(&bots[i]);
+                }
+            }
+        }
+        if (duration && now_ns() - start > duration * 1000000000L)
+            break;
+    }
+    end = now_ns();
+    secs = (end - start) / 1e9;
+
+    /* Both bots of a game count it. */
+    printf("connections   %d (%d games each, %s protocol)\n", nbots, games, proto == PROTO_FRAMED ? "framed" : "legacy");
+    printf("games         %ld in %.3f s, %.1f games/s\n", games_done / 2, secs, games_done / 2 / secs);
+    if (named)
+        printf("rated         %ld games\n", rated_games / 2);
+    printf("messages      %ld, %.0f msg/s, %ld invalid moves\n", messages, messages / secs, invalid);
+    printf("rtt (us)      p50 %lu  p99 %lu  p999 %lu  max %lu  (%lu samples)\n",
+           hist_percentile(&rtt, 50), hist_percentile(&rtt, 99), hist_percentile(&rtt, 99.9), rtt.max, rtt.count);
+    if (messages) {
+        printf("cpu (us/msg)  loadgen %.2f", (double)(cpu_us(0) - cpu_start) / messages);
+        if (server_pid && server_cpu_start >= 0)
+            printf("  server %.2f", (double)(cpu_us(server_pid) - server_cpu_start) / messages);
+        printf("\n");
+    }
+    printf("errors        %ld connect, %ld disconnects, %ld bots unfinished, %ld turned away\n",
+           connect_errors, disconnects, bots_active, turned_away);
+
+    return connect_errors || disconnects || bots_active ? 1 : 0;
+}
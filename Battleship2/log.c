@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE 256   /* Records per thread, power of two. */
+#define LOG_IDLE_NS 5000000 /* Flusher nap when every ring is empty. */
+
+/*
+ * One ring per producing thread. Rings are never freed: a thread that exits
+ * gives its ring back and the next new thread takes it over, so a server
+ * that creates a thread per game keeps a bounded set.
+ */
+struct log_ring {
+    _Alignas(64) _Atomic unsigned head;     /* Next record the flusher reads. */
+    _Alignas(64) _Atomic unsigned tail;     /* Next record the owner writes. */
+    _Atomic int owned;
+    struct log_ring *next;                  /* Registry link, set once. */
+    struct log_record rec[LOG_RING_SIZE];
+};
+
+int log_threshold = LOG_INFO;
+int log_board_sample = 0;
+
+static _Atomic(struct log_ring *) rings;
+static _Atomic uint64_t dropped;
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static int started;
+static uint64_t start_ns;
+
+static const char *const level_name[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+/* Indexed by enum log_event, formatted with the record's two ints. */
+static const char *const event_fmt[EV_COUNT] = {
+    [EV_GAME_START] = "Game on!",
+    [EV_GAME_WON] = "Player %d won.",
+    [EV_PLAYER_LEFT] = "Player %d disconnected.",
+    [EV_GAME_OVER] = "Game over.",
+    [EV_PLAYER_COUNT] = "Number of players is now %d.",
+    [EV_BOARD] = "Board of player %d after %d moves:",
+    [EV_MSG_QUEUED] = "Queued message %2$d for player %1$d.",
+    [EV_MOVE_CHECKED] = "Player %d's move was %s.",
+    [EV_REACTOR_START] = "Reactor mode, waiting for players.",
+    [EV_POOL_FULL] = "No game slot left, a pair of players was turned away.",
+    [EV_SHARD_START] = "Shard %d pinned to cpu %d.",
+    [EV_GAME_RECOVERED] = "Recovered from the journal after %d moves.",
+    [EV_SPECTATOR_JOINED] = "A spectator is watching.",
+    [EV_TIMED_OUT] = "Player %d ran out of time and forfeits.",
+    [EV_IDLE_CLOSED] = "A player waited too long for an opponent.",
+    [EV_PLAYER_DROPPED] = "Player %d dropped, its seat is kept for a while.",
+    [EV_PLAYER_RESUMED] = "Player %d is back.",
+    [EV_TURNED_AWAY] = "Server full with %d players, a player was told to come back later.",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Thread exit: the ring goes back to the pool, records and all. */
+static void release_ring(void *arg)
+{
+    struct log_ring *r = (struct log_ring*)arg;
+
+    atomic_store_explicit(&r->owned, 0, memory_order_release);
+}
+
+static struct log_ring *claim_ring(void)
+{
+    struct log_ring *r;
+    int free_ring;
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+        free_ring = 0;
+        if (atomic_compare_exchange_strong(&r->owned, &free_ring, 1))
+            break;
+    }
+
+    if (!r) {
+        if (!(r = (struct log_ring*)calloc(1, sizeof(*r))))
+            return NULL;
+        atomic_init(&r->owned, 1);
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void log_write(int level, int event, uint32_t game_id, int a0, int a1, const struct board *board)
+{
+    struct log_ring *r = my_ring;
+    struct log_record *rec;
+    unsigned tail, head;
+
+    if (!started)
+        return;
+    if (!r && !(r = my_ring = claim_ring())) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SIZE) { /* Flusher is behind, never wait for it. */
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &r->rec[tail & (LOG_RING_SIZE - 1)];
+    rec->ts_ns = now_ns();
+    rec->level = (uint8_t)level;
+    rec->event = (uint8_t)event;
+    rec->game_id = game_id;
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    if (board)
+        rec->board = *board;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+uint64_t log_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+/*
+ * Flusher Thread
+ */
+
+static void print_board(const struct board *board)
+{
+    int i, j;
+
+    fputs("   A | B | C | D | E | F | G | H | I | J | \n", stdout);
+    for (i = 0; i < BOARD_SIZE; i++) {
+        fputs("   -------------------------------------------\n", stdout);
+        printf("%d |", i);
+        for (j = 0; j < BOARD_SIZE; j++)
+            printf(" %c |", board_cell(board, i * BOARD_SIZE + j));
+        fputs(" \n", stdout);
+    }
+}
+
+static void print_record(const struct log_record *rec)
+{
+    uint64_t t = rec->ts_ns - start_ns;
+
+    printf("[%5lu.%06lu] %s ", (unsigned long)(t / 1000000000), (unsigned long)(t % 1000000000 / 1000),
+           level_name[rec->level]);
+    if (rec->game_id)
+        printf("game %u: ", rec->game_id);
+
+    if (rec->event == EV_MOVE_CHECKED)
+        printf(event_fmt[rec->event], rec->args[0], rec->args[1] ? "valid" : "invalid");
+    else if (rec->event < EV_COUNT)
+        printf(event_fmt[rec->event], rec->args[0], rec->args[1]);
+    else
+        printf("unknown event %d", rec->event);
+    putchar('\n');
+
+    if (rec->event == EV_BOARD)
+        print_board(&rec->board);
+}
+
+static void *run_flusher(void *arg)
+{
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    uint64_t reported = 0;
+
+    (void)arg;
+
+    while (1) {
+        struct log_ring *r;
+        uint64_t lost;
+        int drained = 0;
+
+        for (r = atomic_load(&rings); r; r = r->next) {
+            unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+            for (; head != tail; head++, drained++)
+                print_record(&r->rec[head & (LOG_RING_SIZE - 1)]);
+            atomic_store_explicit(&r->head, head, memory_order_release);
+        }
+
+        if ((lost = log_dropped()) != reported) {
+            printf("Log: %lu records dropped.\n", (unsigned long)(lost - reported));
+            reported = lost;
+        }
+
+        if (!drained) {
+            fflush(stdout);
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_init(int level, int board_sample)
+{
+    pthread_t thread;
+
+    log_threshold = level;
+    log_board_sample = board_sample;
+    start_ns = now_ns();
+
+    if (pthread_key_create(&ring_key, release_ring))
+        return -1;
+    started = 1;
+    if (pthread_create(&thread, NULL, run_flusher, NULL)) {
+        started = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
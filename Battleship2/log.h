@@ -0,0 +1,74 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#include "board.h"
+
+/*
+ * Asynchronous logger. Every thread appends fixed size binary records to
+ * its own single producer ring; one flusher thread drains the rings and
+ * does all the formatting and writing to stdout. Logging never takes a
+ * lock and never blocks: when a ring is full the record is dropped and
+ * counted.
+ */
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+};
+
+enum log_event {
+    EV_GAME_START,      /* game */
+    EV_GAME_WON,        /* game, player */
+    EV_PLAYER_LEFT,     /* game, player */
+    EV_GAME_OVER,       /* game */
+    EV_PLAYER_COUNT,    /* count */
+    EV_BOARD,           /* game, player, turn + board */
+    EV_MSG_QUEUED,      /* game, player, message type */
+    EV_MOVE_CHECKED,    /* game, player, valid */
+    EV_REACTOR_START,
+    EV_POOL_FULL,       /* Two players turned away, no game slot left. */
+    EV_SHARD_START,     /* shard, cpu */
+    EV_GAME_RECOVERED,  /* game, moves */
+    EV_SPECTATOR_JOINED, /* game */
+    EV_TIMED_OUT,       /* game, player */
+    EV_IDLE_CLOSED,     /* A player waited too long for an opponent. */
+    EV_PLAYER_DROPPED,  /* game, player */
+    EV_PLAYER_RESUMED,  /* game, player */
+    EV_TURNED_AWAY,     /* count */
+    EV_COUNT
+};
+
+struct log_record {
+    uint64_t ts_ns;
+    uint8_t level;
+    uint8_t event;
+    uint16_t pad;
+    uint32_t game_id;
+    int32_t args[2];
+    struct board board; /* EV_BOARD only. */
+};
+
+extern int log_threshold;
+extern int log_board_sample;   /* Dump 1 board in N moves, 0 for none. */
+
+/* Starts the flusher thread. Until then every record is thrown away. */
+int log_init(int level, int board_sample);
+
+void log_write(int level, int event, uint32_t game_id, int a0, int a1, const struct board *board);
+
+/* Records dropped because a ring was full. */
+uint64_t log_dropped(void);
+
+#define LOG(level, event, game_id, a0, a1) \
+    do { if ((level) >= log_threshold) log_write((level), (event), (game_id), (a0), (a1), 0); } while (0)
+
+/* Sampled, opt-in board dump. */
+#define LOG_BOARD(game_id, player, turn, board) \
+    do { if (log_board_sample && (turn) % log_board_sample == 0) log_write(LOG_INFO, EV_BOARD, (game_id), (player), (turn), (board)); } while (0)
+
+#endif
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE /* POLLRDHUP */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "rating.h"
+#include "resume.h"
+#include "server.h"
+
+/* A queued client, owned by the matcher thread. */
+struct pending {
+    int fd;
+    int proto;
+    int full;                /* See mm_entry. */
+    int rated;               /* Rating id if the player gave a name, -1 otherwise. */
+    int rating;              /* Its rating when admitted, pairing by rating only. */
+    long enqueued_ns;
+    long deadline_ns;        /* Hello deadline, then legacy. */
+};
+
+static _Atomic long st_depth, st_max_depth, st_enqueued, st_paired, st_dropped, st_wait_total, st_wait_max;
+
+static struct mm_queue *queue;
+static mm_start_fn start_game;
+
+static struct pending *pending;  /* Still negotiating. */
+static int npending, cap_pending;
+static struct pending *waiting;  /* Admitted, no opponent yet: one at most unless pairing by rating. */
+static int nwaiting, cap_waiting;
+
+long mm_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Counters
+ */
+
+void mm_note_queued(void)
+{
+    long depth = atomic_fetch_add(&st_depth, 1) + 1;
+    long max = atomic_load(&st_max_depth);
+
+    atomic_fetch_add(&st_enqueued, 1);
+    while (depth > max && !atomic_compare_exchange_weak(&st_max_depth, &max, depth))
+        ;
+}
+
+void mm_note_dropped(void)
+{
+    atomic_fetch_sub(&st_depth, 1);
+    atomic_fetch_add(&st_dropped, 1);
+}
+
+void mm_note_paired(long enqueued_ns)
+{
+    long wait = mm_now_ns() - enqueued_ns;
+    long max = atomic_load(&st_wait_max);
+
+    atomic_fetch_sub(&st_depth, 1);
+    atomic_fetch_add(&st_paired, 1);
+    atomic_fetch_add(&st_wait_total, wait);
+    while (wait > max && !atomic_compare_exchange_weak(&st_wait_max, &max, wait))
+        ;
+}
+
+void mm_stats_get(struct mm_stats *st)
+{
+    st->depth = atomic_load(&st_depth);
+    st->max_depth = atomic_load(&st_max_depth);
+    st->enqueued = atomic_load(&st_enqueued);
+    st->paired = atomic_load(&st_paired);
+    st->dropped = atomic_load(&st_dropped);
+    st->wait_ns_total = atomic_load(&st_wait_total);
+    st->wait_ns_max = atomic_load(&st_wait_max);
+}
+
+void mm_stats_print(void)
+{
+    struct mm_stats st;
+
+    mm_stats_get(&st);
+    printf("Matchmaking: depth %ld (max %ld), enqueued %ld, paired %ld, dropped %ld, wait avg %.3f ms max %.3f ms\n",
+           st.depth, st.max_depth, st.enqueued, st.paired, st.dropped,
+           st.paired ? st.wait_ns_total / 1e6 / st.paired : 0.0, st.wait_ns_max / 1e6);
+    fflush(stdout);
+}
+
+/*
+ * Queue
+ */
+
+int mm_queue_init(struct mm_queue *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->efd = eventfd(0, EFD_NONBLOCK);
+    return q->efd < 0 ? -1 : 0;
+}
+
+int mm_push(struct mm_queue *q, int fd, int full)
+{
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+    uint64_t one = 1;
+
+    if (tail - head == MM_QUEUE_SIZE)
+        return -1;
+
+    q->ring[tail & (MM_QUEUE_SIZE - 1)].fd = fd;
+    q->ring[tail & (MM_QUEUE_SIZE - 1)].full = full;
+    q->ring[tail & (MM_QUEUE_SIZE - 1)].enqueued_ns = mm_now_ns();
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    mm_note_queued();
+    if (write(q->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("ERROR waking the matcher");
+    return 0;
+}
+
+int mm_pop(struct mm_queue *q, struct mm_entry *e)
+{
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head == tail)
+        return -1;
+
+    *e = q->ring[head & (MM_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
+
+/*
+ * Matcher Thread
+ */
+
+static void drop(int fd)
+{
+    close(fd);
+    mm_note_dropped();
+
+    metrics_add(M_PLAYERS_LEFT, 1);
+}
+
+long mm_gap_allowed(long waited_ns)
+{
+    return pair_gap * (1 + waited_ns / (PAIR_WIDEN_MS * 1000000L));
+}
+
+/* Starts a game, p0 being the one that waited longer. */
+static void pair(const struct pending *p0, const struct pending *p1)
+{
+    int id = 0;
+
+    /* In arrival order, player 0 learned its id when it began to wait. */
+    if (pair_gap)
+        send_client(p0->fd, p0->proto, MSG_ID, &id, 1);
+    id = 1;
+    send_client(p1->fd, p1->proto, MSG_ID, &id, 1);
+
+    mm_note_paired(p0->enqueued_ns);
+    mm_note_paired(p1->enqueued_ns);
+    start_game(p0->fd, p0->proto, p0->rated, p1->fd, p1->proto, p1->rated);
+}
+
+static void unwait(int i)
+{
+    memmove(&waiting[i], &waiting[i + 1], (nwaiting - i - 1) * sizeof(*waiting));
+    nwaiting--;
+}
+
+/* The waiting player after i (-1 for all of them) closest in rating to p, if within reach. -1 if none. */
+static int best_fit(const struct pending *p, int i, long now)
+{
+    long best_gap = LONG_MAX;
+    int best = -1;
+
+    if (!pair_gap)
+        return nwaiting > i + 1 ? i + 1 : -1;
+
+    for (i++; i < nwaiting; i++) {
+        long gap = labs((long)waiting[i].rating - p->rating);
+        long since = waiting[i].enqueued_ns < p->enqueued_ns ? waiting[i].enqueued_ns : p->enqueued_ns;
+
+        if (gap <= mm_gap_allowed(now - since) && gap < best_gap) {
+            best = i;
+            best_gap = gap;
+        }
+    }
+    return best;
+}
+
+/* Pairs the waiting players whose allowed gap has grown enough, oldest first. */
+static void pair_waiting(long now)
+{
+    int i, j;
+
+    for (i = 0; i < nwaiting; i++) {
+        if ((j = best_fit(&waiting[i], i, now)) >= 0) {
+            pair(&waiting[i], &waiting[j]);
+            unwait(j);
+            unwait(i--);
+        }
+    }
+}
+
+/* The protocol is known: hand the client its id and pair it. */
+static void admit(struct pending *p, long now)
+{
+    int id = 0;
+    int i;
+
+    if (p->full) {
+        turn_away(p->fd, p->proto);
+        drop(p->fd);
+        return;
+    }
+
+    if (bot_level) { /* Nobody waits, the server takes the other seat. */
+        send_client(p->fd, p->proto, MSG_ID, &id, 1);
+        mm_note_paired(p->enqueued_ns);
+        start_game(p->fd, p->proto, p->rated, -1, PROTO_LEGACY, -1);
+        return;
+    }
+
+    if (pair_gap && p->rated >= 0)
+        rating_rank(p->rated, &p->rating);
+    else
+        p->rating = RATING_START;
+
+    if ((i = best_fit(p, -1, now)) >= 0) {
+        struct pending p0 = waiting[i];
+
+        unwait(i);
+        pair(&p0, p);
+        return;
+    }
+
+    /* By rating, a waiting player may end up either seat: it learns its id once paired. */
+    if (!pair_gap) {
+        send_client(p->fd, p->proto, MSG_ID, &id, 1);
+        /* Let the user know the server is waiting on a second client. */
+        send_client(p->fd, p->proto, MSG_HLD, NULL, 0);
+    }
+    if (nwaiting == cap_waiting) {
+        cap_waiting = cap_waiting ? cap_waiting * 2 : 16;
+        waiting = realloc(waiting, cap_waiting * sizeof(*waiting));
+    }
+    waiting[nwaiting++] = *p;
+}
+
+/*
+ * Looks for a hello, or a resume request in its place. Returns 1 once the
+ * protocol is settled, 2 if the client went back to its game, 0 to keep
+ * waiting, -1 if the client left or cannot resume.
+ */
+static int check_hello(struct pending *p, long now)
+{
+    char hello[HELLO_LEN + FRAME_HDR_LEN + PLAYER_NAME_LEN];   /* Also fits a resume request. */
+    unsigned game_id;
+    uint64_t token;
+    int version;
+    ssize_t r, n = recv(p->fd, hello, sizeof(hello), MSG_PEEK | MSG_DONTWAIT);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return -1;
+
+    if (n >= HELLO_LEN && (r = resume_parse(hello, n, &game_id, &token)) >= 0) {
+        if (r == 0) /* The rest is on its way. */
+            return now >= p->deadline_ns ? -1 : 0;
+        recv(p->fd, hello, r, 0);    /* Only the request: what follows is still in the socket. */
+        if (resume_request(game_id, token, p->fd, NULL, 0) < 0) {
+            send_client(p->fd, PROTO_FRAMED, MSG_INV, NULL, 0);
+            return -1;
+        }
+        mm_note_paired(p->enqueued_ns);
+        return 2;
+    }
+
+    if (n >= HELLO_LEN) {
+        if ((version = proto_check_hello(hello))) {
+            char name[PLAYER_NAME_LEN];
+            ssize_t named = proto_parse_name(hello + HELLO_LEN, n - HELLO_LEN, name);
+
+            if (named == 0) /* Its name is on its way. */
+                return now >= p->deadline_ns ? -1 : 0;
+            recv(p->fd, hello, HELLO_LEN + (named > 0 ? named : 0), 0);
+            p->proto = PROTO_FRAMED;
+            p->rated = named > 0 ? rating_id(name) : -1;
+            send_client(p->fd, PROTO_FRAMED, MSG_HELLO, &version, 1);
+        }
+        return 1;
+    }
+
+    /* Legacy clients never speak first. */
+    return now >= p->deadline_ns ? 1 : 0;
+}
+
+static void take_queued(long now)
+{
+    struct mm_entry e;
+    uint64_t count;
+
+    if (read(queue->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("ERROR reading matcher eventfd");
+
+    while (!mm_pop(queue, &e)) {
+        if (npending == cap_pending) {
+            cap_pending = cap_pending ? cap_pending * 2 : 64;
+            pending = realloc(pending, cap_pending * sizeof(*pending));
+        }
+        pending[npending].fd = e.fd;
+        pending[npending].proto = PROTO_LEGACY;
+        pending[npending].full = e.full;
+        pending[npending].rated = -1;
+        pending[npending].enqueued_ns = e.enqueued_ns;
+        pending[npending].deadline_ns = now + HELLO_WAIT_MS * 1000000L;
+        npending++;
+    }
+}
+
+static void *run_matcher(void *arg)
+{
+    struct pollfd *pfds = NULL;
+    int cap_pfds = 0;
+
+    (void)arg;
+
+    while (1) {
+        long now = mm_now_ns();
+        int i, j, n, w, timeout = 1000;   /* Pairing by rating, the gaps are widened at least every second. */
+
+        /* Slot 0 wakes us for new clients, then the waiting players, then every negotiation. */
+        if (cap_pfds < 1 + nwaiting + npending) {
+            cap_pfds = (1 + nwaiting + npending) * 2;
+            pfds = realloc(pfds, cap_pfds * sizeof(*pfds));
+        }
+        pfds[0].fd = queue->efd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nwaiting; i++) {
+            pfds[1 + i].fd = waiting[i].fd;
+            pfds[1 + i].events = POLLRDHUP;
+            if (idle_ms) {
+                long left = (waiting[i].enqueued_ns - now) / 1000000 + idle_ms;
+
+                if (left < timeout)
+                    timeout = left < 0 ? 0 : (int)left;
+            }
+        }
+        w = nwaiting;
+        for (i = 0; i < npending; i++) {
+            long left = (pending[i].deadline_ns - now + 999999) / 1000000;
+
+            pfds[1 + w + i].fd = pending[i].fd;
+            pfds[1 + w + i].events = POLLIN;
+            if (left < timeout)
+                timeout = left < 0 ? 0 : (int)left;
+        }
+
+        n = poll(pfds, 1 + w + npending, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("ERROR in matcher poll");
+            return NULL;
+        }
+
+        if (dump_stats) {
+            dump_stats = 0;
+            mm_stats_print();
+        }
+
+        now = mm_now_ns();
+
+        for (i = 0, j = 0; i < w; i++) {
+            if (n > 0 && (pfds[1 + i].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                drop(waiting[j].fd);
+                unwait(j);
+            }
+            else if (idle_ms && now >= waiting[j].enqueued_ns + idle_ms * 1000000L) { /* Nobody came. */
+                LOG(LOG_INFO, EV_IDLE_CLOSED, 0, 0, 0);
+                metrics_add(M_IDLE_CLOSED, 1);
+                drop(waiting[j].fd);
+                unwait(j);
+            }
+            else
+                j++;
+        }
+        if (pair_gap)
+            pair_waiting(now);
+
+        /* Settle negotiations in arrival order, keeping the ones still undecided. */
+        for (i = 0, j = 0; i < npending; i++) {
+            int r = (n > 0 && pfds[1 + w + i].revents) || now >= pending[i].deadline_ns ? check_hello(&pending[i], now) : 0;
+
+            if (r < 0)
+                drop(pending[i].fd);
+            else if (r == 1)
+                admit(&pending[i], now);
+            else if (r == 2) /* Its game's driver has it now. */
+                ;
+            else
+                pending[j++] = pending[i];
+        }
+        npending = j;
+
+        if (n > 0 && pfds[0].revents)
+            take_queued(now);
+    }
+}
+
+int matchmaker_start(struct mm_queue *q, mm_start_fn start)
+{
+    pthread_t thread;
+
+    queue = q;
+    start_game = start;
+    if (pthread_create(&thread, NULL, run_matcher, NULL))
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
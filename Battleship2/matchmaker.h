@@ -0,0 +1,69 @@
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include <stdatomic.h>
+
+/*
+ * Matchmaking, decoupled from accept(): the acceptor only pushes sockets on
+ * a single producer / single consumer ring, the matcher thread negotiates the
+ * protocol of every queued client at once (poll, no blocking per client) and
+ * pairs them in arrival order as soon as two are ready, or with the closest
+ * rated waiting player when pairing by rating (-E).
+ */
+
+#define MM_QUEUE_SIZE 4096   /* Power of two. */
+
+struct mm_entry {
+    int fd;
+    int full;                /* Accepted over capacity, turned away once its protocol is known. */
+    long enqueued_ns;
+};
+
+struct mm_queue {
+    _Atomic unsigned head;   /* Next slot the consumer reads. */
+    _Atomic unsigned tail;   /* Next slot the producer writes. */
+    int efd;                 /* eventfd, wakes the matcher. */
+    struct mm_entry ring[MM_QUEUE_SIZE];
+};
+
+/* Counters, readable from any thread. */
+struct mm_stats {
+    long depth;              /* Accepted, not in a game yet. */
+    long max_depth;
+    long enqueued;
+    long paired;
+    long dropped;            /* Left, or turned away on a full queue, before a game. */
+    long wait_ns_total;      /* Accept to game start, summed over paired players. */
+    long wait_ns_max;
+};
+
+#define PAIR_WIDEN_MS 5000   /* Pairing by rating, the allowed gap grows by itself at every such wait. */
+
+/* Starts a game thread for two ready clients, with their rating ids (-1 if unrated). Provided by the server. */
+typedef void (*mm_start_fn)(int sockfd0, int proto0, int rated0, int sockfd1, int proto1, int rated1);
+
+long mm_now_ns(void);
+
+/* Rating gap allowed between two players once the longer of them has waited waited_ns. */
+long mm_gap_allowed(long waited_ns);
+
+int mm_queue_init(struct mm_queue *q);
+
+/* Producer side. Returns -1 if the queue is full. */
+int mm_push(struct mm_queue *q, int fd, int full);
+
+/* Consumer side. Returns 0 and fills e, or -1 if the queue is empty. */
+int mm_pop(struct mm_queue *q, struct mm_entry *e);
+
+/* Runs the matcher on a new thread. */
+int matchmaker_start(struct mm_queue *q, mm_start_fn start);
+
+/* Counter updates, also used by the reactor which pairs on its own loop. */
+void mm_note_queued(void);
+void mm_note_dropped(void);
+void mm_note_paired(long enqueued_ns);
+
+void mm_stats_get(struct mm_stats *st);
+void mm_stats_print(void);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+
+/*
+ * A thread's counters. Only the owner writes them, so an update is a plain
+ * load and store; the atomics only keep a concurrent snapshot from reading
+ * torn values. Histogram buckets are read without any ordering, a snapshot
+ * taken during a game may be off by the few samples in flight. Shards are
+ * never freed: an exiting thread hands its shard, totals included, to the
+ * next new thread.
+ */
+struct shard {
+    _Alignas(64) _Atomic uint64_t count[M_COUNT];
+    struct hist reply_us[REPLY_COUNT];
+    _Atomic int owned;
+    struct shard *next;     /* Registry link, set once. */
+};
+
+static _Atomic(struct shard *) shards;
+static __thread struct shard *my_shard;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static void release_shard(void *arg)
+{
+    struct shard *s = (struct shard*)arg;
+
+    atomic_store_explicit(&s->owned, 0, memory_order_release);
+}
+
+static void make_shard_key(void)
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static struct shard *claim_shard(void)
+{
+    struct shard *s;
+    int free_shard;
+    int i;
+
+    pthread_once(&shard_key_once, make_shard_key);
+
+    for (s = atomic_load(&shards); s; s = s->next) {
+        free_shard = 0;
+        if (atomic_compare_exchange_strong(&s->owned, &free_shard, 1))
+            break;
+    }
+
+    if (!s) {
+        if (!(s = (struct shard*)aligned_alloc(64, sizeof(*s))))
+            abort();
+        for (i = 0; i < M_COUNT; i++)
+            atomic_init(&s->count[i], 0);
+        for (i = 0; i < REPLY_COUNT; i++)
+            hist_init(&s->reply_us[i]);
+        atomic_init(&s->owned, 1);
+        s->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &s->next, s))
+            ;
+    }
+
+    pthread_setspecific(shard_key, s);
+    return s;
+}
+
+void metrics_add(int metric, uint64_t n)
+{
+    struct shard *s = my_shard ? my_shard : (my_shard = claim_shard());
+    uint64_t v = atomic_load_explicit(&s->count[metric], memory_order_relaxed);
+
+    atomic_store_explicit(&s->count[metric], v + n, memory_order_relaxed);
+}
+
+void metrics_reply(int kind, uint64_t us)
+{
+    struct shard *s = my_shard ? my_shard : (my_shard = claim_shard());
+
+    hist_record(&s->reply_us[kind], us);
+}
+
+void metrics_snapshot(struct metrics *m)
+{
+    struct shard *s;
+    int i;
+
+    for (i = 0; i < M_COUNT; i++)
+        m->count[i] = 0;
+    for (i = 0; i < REPLY_COUNT; i++)
+        hist_init(&m->reply_us[i]);
+
+    for (s = atomic_load(&shards); s; s = s->next) {
+        for (i = 0; i < M_COUNT; i++)
+            m->count[i] += atomic_load_explicit(&s->count[i], memory_order_relaxed);
+        for (i = 0; i < REPLY_COUNT; i++)
+            hist_merge(&m->reply_us[i], &s->reply_us[i]);
+    }
+}
+
+long metrics_players(void)
+{
+    struct shard *s;
+    long players = 0;
+
+    for (s = atomic_load(&shards); s; s = s->next)
+        players += (long)(atomic_load_explicit(&s->count[M_PLAYERS_JOINED], memory_order_relaxed) -
+                          atomic_load_explicit(&s->count[M_PLAYERS_LEFT], memory_order_relaxed));
+    return players;
+}
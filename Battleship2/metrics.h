@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "hist.h"
+
+/*
+ * Runtime counters. Every thread updates its own shard, with no locked
+ * instruction and no shared cache line; readers sum the shards. See stats.c
+ * for the report served on the metrics port.
+ */
+
+enum metric {
+    M_GAMES_STARTED,
+    M_GAMES_ENDED,
+    M_GAMES_RECOVERED,  /* Rebuilt from the journal, started by the previous run. */
+    M_MOVES,            /* Valid shots. */
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_PLAYERS_JOINED,
+    M_PLAYERS_LEFT,     /* Joined - left is the player count. */
+    M_SPECTATORS_JOINED,
+    M_SPECTATORS_LEFT,
+    M_TIMEOUTS,         /* Games forfeited on a turn or placement deadline. */
+    M_IDLE_CLOSED,      /* Players dropped after waiting too long for an opponent. */
+    M_RESUMED,          /* Players back in their game after a dropped connection. */
+    M_TURNED_AWAY,      /* Players told to come back later, the server being full. */
+    M_COUNT
+};
+
+/* Which prompt a reply answers. */
+enum reply_kind {
+    REPLY_PLT,
+    REPLY_TRN,
+    REPLY_COUNT
+};
+
+void metrics_add(int metric, uint64_t n);
+
+/* Time from a PLT/TRN prompt to the player's reply. */
+void metrics_reply(int kind, uint64_t us);
+
+/* Sum of every shard so far. */
+struct metrics {
+    uint64_t count[M_COUNT];
+    struct hist reply_us[REPLY_COUNT];
+};
+
+void metrics_snapshot(struct metrics *m);
+
+/* Connected players, summed over the shards without a lock. */
+long metrics_players(void);
+
+#endif
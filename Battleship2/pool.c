@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+/* One game per cache line boundary, no two games share a line. */
+struct game_slot {
+    _Alignas(64) struct game game;
+    _Atomic uint32_t next;  /* Free list link: index + 1, 0 ends the list. */
+};
+
+static struct game_slot *slots;
+static int pool_capacity;
+
+/*
+ * Free list head: index + 1 of the first free slot in the low 32 bits, a
+ * counter bumped by every pop in the high 32 bits. The counter keeps a pop
+ * that read a stale link from succeeding after the slot went out and came
+ * back (ABA).
+ */
+static _Atomic uint64_t free_head;
+
+int game_pool_init(int capacity)
+{
+    int i;
+
+    if (capacity < 1)
+        return -1;
+
+    slots = (struct game_slot*)aligned_alloc(64, sizeof(struct game_slot) * capacity);
+    if (!slots)
+        return -1;
+    memset(slots, 0, sizeof(struct game_slot) * capacity);  /* Fault every page in now. */
+
+    for (i = 0; i < capacity; i++)
+        atomic_init(&slots[i].next, i + 1 < capacity ? i + 2 : 0);
+    atomic_init(&free_head, 1);
+    pool_capacity = capacity;
+    return 0;
+}
+
+int game_pool_capacity(void)
+{
+    return pool_capacity;
+}
+
+struct game *game_pool_get(void)
+{
+    uint64_t head = atomic_load_explicit(&free_head, memory_order_acquire);
+    uint64_t next;
+    uint32_t idx;
+
+    do {
+        if (!(idx = (uint32_t)head))
+            return NULL;
+        next = ((head >> 32) + 1) << 32 | atomic_load_explicit(&slots[idx - 1].next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&free_head, &head, next,
+                                                    memory_order_acquire, memory_order_acquire));
+
+    return &slots[idx - 1].game;
+}
+
+int game_pool_index(const struct game *g)
+{
+    return (int)((const struct game_slot*)((const char *)g - offsetof(struct game_slot, game)) - slots);
+}
+
+struct game *game_pool_slot(int i)
+{
+    return &slots[i].game;
+}
+
+void game_pool_put(struct game *g)
+{
+    struct game_slot *s = (struct game_slot*)((char *)g - offsetof(struct game_slot, game));
+    uint32_t idx = (uint32_t)(s - slots) + 1;
+    uint64_t head = atomic_load_explicit(&free_head, memory_order_relaxed);
+
+    do {
+        atomic_store_explicit(&s->next, (uint32_t)head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&free_head, &head, (head & ~(uint64_t)UINT32_MAX) | idx,
+                                                    memory_order_release, memory_order_relaxed));
+}
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "game.h"
+
+/*
+ * Game slots, all allocated and touched once at startup. Taking and giving
+ * back a slot is a compare and swap on a tagged free list head, so the
+ * matcher can take slots while game threads give theirs back, and starting
+ * or ending a game never calls malloc.
+ */
+
+/* Allocates room for capacity games. Returns -1 if memory is short. */
+int game_pool_init(int capacity);
+
+int game_pool_capacity(void);
+
+/* Returns a free slot, or NULL if every game is in use. */
+struct game *game_pool_get(void);
+
+void game_pool_put(struct game *g);
+
+/* Which slot g is, 0 to capacity - 1: lets callers keep per game data in arrays of their own. */
+int game_pool_index(const struct game *g);
+
+/* Slot i, in use or not, for lookups that only read atomic fields. */
+struct game *game_pool_slot(int i);
+
+#endif
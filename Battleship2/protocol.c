@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+static const char *opcodes[MSG_COUNT] = {
+    [MSG_HLD] = "HLD", [MSG_SRT] = "SRT", [MSG_PLT] = "PLT", [MSG_TRN] = "TRN",
+    [MSG_INV] = "INV", [MSG_WAT] = "WAT", [MSG_UPD] = "UPD", [MSG_WIN] = "WIN",
+    [MSG_LSE] = "LSE", [MSG_DRW] = "DRW", [MSG_CNT] = "CNT",
+};
+
+const char *legacy_opcode(int type)
+{
+    return (type > MSG_NONE && type < MSG_COUNT) ? opcodes[type] : NULL;
+}
+
+int legacy_type(const char *opcode)
+{
+    int type;
+
+    for (type = MSG_NONE + 1; type < MSG_COUNT; type++)
+        if (opcodes[type] && !memcmp(opcodes[type], opcode, 3))
+            return type;
+    return MSG_NONE;
+}
+
+/*
+ * Encoding
+ */
+
+static void put_header(char *buf, int type, size_t len)
+{
+    uint16_t n = htons((uint16_t)len);
+
+    buf[0] = (char)type;
+    buf[1] = 0; /* Flags, none yet. */
+    memcpy(buf + 2, &n, 2);
+}
+
+size_t proto_encode_raw(int proto, char *buf, size_t cap, int type, const void *payload, size_t len)
+{
+    const char *op;
+
+    if (proto == PROTO_FRAMED) {
+        if (len > FRAME_MAX_PAYLOAD || cap < FRAME_HDR_LEN + len)
+            return 0;
+        put_header(buf, type, len);
+        memcpy(buf + FRAME_HDR_LEN, payload, len);
+        return FRAME_HDR_LEN + len;
+    }
+
+    /* Legacy: opcode (if the message has one) then the payload as is. */
+    op = legacy_opcode(type);
+    if (cap < (op ? 3 : 0) + len)
+        return 0;
+    if (op)
+        memcpy(buf, op, 3);
+    memcpy(buf + (op ? 3 : 0), payload, len);
+    return (op ? 3 : 0) + len;
+}
+
+size_t proto_encode_ints(int proto, char *buf, size_t cap, int type, const int *ints, int nints)
+{
+    uint32_t payload[FRAME_MAX_PAYLOAD / sizeof(uint32_t)];
+    int i;
+
+    if (proto != PROTO_FRAMED)
+        return proto_encode_raw(proto, buf, cap, type, ints, nints * sizeof(int));
+
+    for (i = 0; i < nints; i++)
+        payload[i] = htonl((uint32_t)ints[i]);
+    return proto_encode_raw(proto, buf, cap, type, payload, nints * sizeof(uint32_t));
+}
+
+static void put_bitboard(char *buf, bitboard b)
+{
+    int i;
+
+    for (i = 0; i < BB_BYTES; i++)
+        buf[i] = (char)(uint8_t)(b >> (8 * i));
+}
+
+static bitboard get_bitboard(const unsigned char *buf)
+{
+    bitboard b = 0;
+    int i;
+
+    for (i = 0; i < BB_BYTES; i++)
+        b |= (bitboard)buf[i] << (8 * i);
+    return b & (BB_BIT(NUM_SQUARES) - 1);
+}
+
+size_t snapshot_encode(char *buf, int player_id, const struct board *own, const struct board *enemy)
+{
+    buf[0] = (char)player_id;
+    memcpy(buf + 1, own->boat_pos, NUM_BOATS);
+    put_bitboard(buf + 1 + NUM_BOATS, own->shots);
+    put_bitboard(buf + 1 + NUM_BOATS + BB_BYTES, enemy->shots);
+    put_bitboard(buf + 1 + NUM_BOATS + 2 * BB_BYTES, enemy->shots & enemy->ships);
+    return SNAPSHOT_LEN;
+}
+
+int snapshot_decode(const unsigned char *buf, size_t len, struct board *own, struct board *target)
+{
+    int i;
+
+    if (len != SNAPSHOT_LEN || buf[0] > 1)
+        return -1;
+
+    board_init(own);
+    for (i = 0; i < NUM_BOATS; i++) {
+        uint8_t pos = buf[1 + i];
+
+        if (pos != BOAT_UNPLACED && !board_place(own, i, pos & ~BOAT_VERTICAL, pos & BOAT_VERTICAL))
+            return -1;
+    }
+    own->shots = get_bitboard(buf + 1 + NUM_BOATS);
+
+    board_init(target);
+    target->shots = get_bitboard(buf + 1 + NUM_BOATS + BB_BYTES);
+    target->ships = get_bitboard(buf + 1 + NUM_BOATS + 2 * BB_BYTES) & target->shots;
+    return buf[0];
+}
+
+size_t spec_snapshot_encode(char *buf, const struct board boards[2])
+{
+    int p;
+
+    for (p = 0; p < 2; p++) {
+        put_bitboard(buf + 2 * p * BB_BYTES, boards[p].shots);
+        put_bitboard(buf + (2 * p + 1) * BB_BYTES, boards[p].shots & boards[p].ships);
+    }
+    return SPEC_SNAPSHOT_LEN;
+}
+
+int spec_snapshot_decode(const unsigned char *buf, size_t len, struct board boards[2])
+{
+    int p;
+
+    if (len != SPEC_SNAPSHOT_LEN)
+        return -1;
+
+    for (p = 0; p < 2; p++) {
+        board_init(&boards[p]);
+        boards[p].shots = get_bitboard(buf + 2 * p * BB_BYTES);
+        boards[p].ships = get_bitboard(buf + (2 * p + 1) * BB_BYTES) & boards[p].shots;
+    }
+    return 0;
+}
+
+/*
+ * Decoding
+ */
+
+ssize_t frame_parse(const char *buf, size_t len, struct frame *f)
+{
+    uint16_t n;
+
+    if (len < FRAME_HDR_LEN)
+        return 0;
+
+    memcpy(&n, buf + 2, 2);
+    n = ntohs(n);
+    if (n > FRAME_MAX_PAYLOAD || (unsigned char)buf[0] <= MSG_NONE || (unsigned char)buf[0] >= MSG_COUNT)
+        return -1;
+    if (len < (size_t)FRAME_HDR_LEN + n)
+        return 0;
+
+    f->type = (unsigned char)buf[0];
+    f->len = n;
+    f->payload = (const unsigned char *)buf + FRAME_HDR_LEN;
+    return FRAME_HDR_LEN + n;
+}
+
+int frame_int(const struct frame *f, int i)
+{
+    uint32_t v;
+
+    if ((size_t)(i + 1) * sizeof(uint32_t) > f->len)
+        return -1;
+    memcpy(&v, f->payload + i * sizeof(uint32_t), sizeof(uint32_t));
+    return (int)ntohl(v);
+}
+
+/*
+ * Negotiation
+ */
+
+int proto_send_hello(int fd, const char *name)
+{
+    char hello[HELLO_LEN + FRAME_HDR_LEN + PLAYER_NAME_LEN] = { HELLO_MAGIC[0], HELLO_MAGIC[1], HELLO_MAGIC[2], PROTO_VERSION };
+    size_t len = HELLO_LEN;
+
+    /* One write: the server takes a hello with nothing behind it for an anonymous player. */
+    if (name)
+        len += proto_encode_raw(PROTO_FRAMED, hello + HELLO_LEN, sizeof(hello) - HELLO_LEN, MSG_NAME,
+                                name, strnlen(name, PLAYER_NAME_LEN - 1));
+    return send(fd, hello, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+int proto_check_hello(const char *buf)
+{
+    if (memcmp(buf, HELLO_MAGIC, 3) || buf[3] < 1)
+        return 0;
+    return buf[3] > PROTO_VERSION ? PROTO_VERSION : buf[3];
+}
+
+ssize_t proto_parse_name(const char *buf, size_t len, char name[PLAYER_NAME_LEN])
+{
+    struct frame f;
+    ssize_t n;
+
+    name[0] = '\0';
+    if (len == 0 || (unsigned char)buf[0] != MSG_NAME)
+        return -1;
+    if ((n = frame_parse(buf, len, &f)) <= 0)
+        return n;
+    if (f.len < PLAYER_NAME_LEN) {
+        memcpy(name, f.payload, f.len);
+        name[f.len] = '\0';
+    }
+    return n;
+}
+
+/*
+ * Buffered Reader
+ */
+
+void reader_init(struct reader *r, int fd)
+{
+    r->fd = fd;
+    r->start = 0;
+    r->len = 0;
+}
+
+ssize_t reader_fill(struct reader *r)
+{
+    ssize_t n;
+
+    if (r->start + r->len == READER_SIZE) { /* Make room at the end. */
+        if (r->len == READER_SIZE)
+            return -1; /* Peer sent more than we will ever buffer. */
+        memmove(r->buf, r->buf + r->start, r->len);
+        r->start = 0;
+    }
+
+    do {
+        n = recv(r->fd, r->buf + r->start + r->len, READER_SIZE - r->start - r->len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n <= 0)
+        return -1;
+
+    r->len += n;
+    return n;
+}
+
+void reader_consume(struct reader *r, size_t n)
+{
+    r->start += n;
+    r->len -= n;
+    if (r->len == 0)
+        r->start = 0;
+}
+
+int reader_read(struct reader *r, void *dst, size_t len)
+{
+    while (r->len < len)
+        if (reader_fill(r) <= 0)
+            return -1;
+
+    memcpy(dst, r->buf + r->start, len);
+    reader_consume(r, len);
+    return 0;
+}
+
+int reader_next_frame(struct reader *r, struct frame *f)
+{
+    while (1) {
+        ssize_t n = frame_parse(r->buf + r->start, r->len, f);
+
+        if (n < 0)
+            return -1;
+        if (n > 0) {
+            reader_consume(r, n);
+            return 0;
+        }
+        if (reader_fill(r) <= 0)
+            return -1;
+    }
+}
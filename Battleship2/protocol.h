@@ -0,0 +1,148 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "board.h"
+
+/*
+ * Wire protocol, shared by client and server.
+ *
+ * Legacy: 3 byte ASCII opcodes ("UPD", "TRN", ...) followed by raw host
+ * order ints, placements as 2 raw bytes.
+ *
+ * Framed (version 1): every message is a 4 byte header (type, flags, payload
+ * length as big endian u16) followed by the payload. Ints are big endian
+ * u32. A client asks for it by sending HELLO_MAGIC + version right after
+ * connecting; the server answers with a MSG_HELLO frame. A client that
+ * stays silent for HELLO_WAIT_MS is served the legacy protocol.
+ */
+
+#define PROTO_LEGACY 0
+#define PROTO_FRAMED 1
+
+#define PROTO_VERSION 1
+#define HELLO_MAGIC "BSF"
+#define HELLO_LEN 4
+#define HELLO_WAIT_MS 50
+#define PLAYER_NAME_LEN 16  /* 1 to 15 printable characters, NUL included. */
+
+#define FRAME_HDR_LEN 4
+#define FRAME_MAX_PAYLOAD 1024
+#define READER_SIZE 2048
+
+enum msg_type {
+    MSG_NONE = 0,
+    /* Server to client. */
+    MSG_HELLO,      /* version */
+    MSG_ID,         /* player id */
+    MSG_HLD,
+    MSG_SRT,        /* game id, resume token high and low (framed only) */
+    MSG_PLT,        /* boat index */
+    MSG_TRN,        /* Salvo games only: shots allowed this turn (framed only) */
+    MSG_INV,
+    MSG_WAT,
+    MSG_UPD,        /* player id, move, hit */
+    MSG_WIN,
+    MSG_LSE,
+    MSG_DRW,
+    MSG_CNT,        /* number of players */
+    /* Client to server. */
+    MSG_PLACE,      /* 2 byte square, "A0".."J9" */
+    MSG_MOVE,       /* row * 10 + col */
+    MSG_WATCH,      /* game id, spectators only */
+    MSG_RESUME,     /* game id, token high, token low: first message of a reconnecting player */
+    MSG_SNAP,       /* Server to client: snapshot of a resumed game, see snapshot_encode() */
+    MSG_FLEET,      /* NUM_BOATS bytes, boat i's origin | BOAT_VERTICAL: the whole fleet, answers PLT 0 */
+    MSG_FUL,        /* Server to client, instead of the id: full, retry after this many ms (framed only) */
+    MSG_NAME,       /* Client to server, right behind the hello: the player's name, to be rated */
+    MSG_RANK,       /* Server to client, before WIN/LSE: rating, change, rank, rated players */
+    MSG_SALVO,      /* Client to server, answers TRN in a Salvo game: 1 to NUM_BOATS bytes, one square each */
+    MSG_VOL,        /* Server to client: player id, then square and result of each shot of its salvo */
+    MSG_COUNT
+};
+
+struct frame {
+    int type;
+    size_t len;
+    const unsigned char *payload;
+};
+
+/* Buffered socket reader: keeps partial messages across reads. */
+struct reader {
+    int fd;
+    size_t start;
+    size_t len;
+    char buf[READER_SIZE];
+};
+
+/* A bitboard on the wire: bits 0-99, little endian. */
+#define BB_BYTES 13
+#define SNAPSHOT_LEN (1 + NUM_BOATS + 3 * BB_BYTES)
+
+/*
+ * What a resuming player needs to go on, instead of the game's history:
+ * its id, where its boats lie, the shots fired at it, its own shots and
+ * which of them hit.
+ */
+size_t snapshot_encode(char *buf, int player_id, const struct board *own, const struct board *enemy);
+
+/* Rebuilds the player's two boards. Returns its id, or -1 if the snapshot is malformed. */
+int snapshot_decode(const unsigned char *buf, size_t len, struct board *own, struct board *target);
+
+#define SPEC_SNAPSHOT_LEN (4 * BB_BYTES)
+
+/*
+ * What a spectator that fell too far behind gets instead of the events it
+ * missed, as MSG_SNAP: for each player, the shots fired at it and which of
+ * them hit.
+ */
+size_t spec_snapshot_encode(char *buf, const struct board boards[2]);
+
+/* Rebuilds boards[p], the shots fired at player p. Returns -1 if the snapshot is malformed. */
+int spec_snapshot_decode(const unsigned char *buf, size_t len, struct board boards[2]);
+
+/* Encodes a message whose payload is a list of ints. Returns the bytes written, 0 if cap is too small. */
+size_t proto_encode_ints(int proto, char *buf, size_t cap, int type, const int *ints, int nints);
+
+/* Encodes a message with a raw byte payload. */
+size_t proto_encode_raw(int proto, char *buf, size_t cap, int type, const void *payload, size_t len);
+
+/* Parses one frame. Returns the bytes it used, 0 if incomplete, -1 if malformed. */
+ssize_t frame_parse(const char *buf, size_t len, struct frame *f);
+
+/* Reads the i-th big endian int of a frame payload. */
+int frame_int(const struct frame *f, int i);
+
+/* Legacy opcode for a message type, NULL if it has none. */
+const char *legacy_opcode(int type);
+
+/* Message type for a legacy opcode, MSG_NONE if unknown. */
+int legacy_type(const char *opcode);
+
+/* Writes the client hello, with the player's name if not NULL. */
+int proto_send_hello(int fd, const char *name);
+
+/* Checks a received hello. Returns the version, or 0 if it is not one. */
+int proto_check_hello(const char *buf);
+
+/* Reads the name frame that may follow a hello. Returns its length, 0 if it is incomplete, -1 if there is none. */
+ssize_t proto_parse_name(const char *buf, size_t len, char name[PLAYER_NAME_LEN]);
+
+void reader_init(struct reader *r, int fd);
+
+/* One recv() into the reader. Returns bytes read, 0 if it would block, -1 on EOF or error. */
+ssize_t reader_fill(struct reader *r);
+
+/* Drops n consumed bytes from the front. */
+void reader_consume(struct reader *r, size_t n);
+
+/* Blocking: reads exactly len bytes. Returns -1 if the peer went away. */
+int reader_read(struct reader *r, void *dst, size_t len);
+
+/* Blocking: reads the next whole frame. Valid until the next reader call. */
+int reader_next_frame(struct reader *r, struct frame *f);
+
+#endif
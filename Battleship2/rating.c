@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rating.h"
+
+#define RATING_K 32
+#define ELO_SPAN 800            /* Gains stop changing past this rating gap. */
+#define ELO_STEP 1.0057730630017383     /* 10^(1/400) */
+#define BUCKETS (RATING_MAX + 1)
+#define SNAPSHOT_MAGIC "BSR1"
+#define SNAPSHOT_CHUNK 16384    /* Records copied per lock hold. */
+
+struct snapshot_header {
+    char magic[4];
+    uint32_t count;
+    uint64_t pad;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rating_record *records;
+static int *next_same, *prev_same;     /* Players sharing a rating, by id. */
+static int count, capacity;
+static int *index_slots;               /* Ids by name hash, -1 if free. */
+static unsigned index_mask;
+static int fenwick[BUCKETS + 1];       /* 1-based: players per rating point. */
+static int bucket_head[BUCKETS];
+static int gain[2 * ELO_SPAN + 1];     /* Winner's gain by loser - winner rating, clamped. */
+static const char *snapshot_path;
+static _Atomic int dirty;
+
+static void build_tables(void) __attribute__((constructor));
+
+static void build_tables(void)
+{
+    double p = 1.0;
+    int d;
+
+    for (d = 0; d < ELO_SPAN; d++)
+        p /= ELO_STEP;
+    /* Beating someone rated d above us earns K * (1 - 1 / (1 + 10^(d/400))). */
+    for (d = -ELO_SPAN; d <= ELO_SPAN; d++, p *= ELO_STEP)
+        gain[d + ELO_SPAN] = (int)(RATING_K * p / (1 + p) + 0.5);
+    for (d = 0; d < BUCKETS; d++)
+        bucket_head[d] = -1;
+}
+
+/*
+ * Rank Index
+ */
+
+static void fw_add(int rating, int n)
+{
+    int i;
+
+    for (i = rating + 1; i <= BUCKETS; i += i & -i)
+        fenwick[i] += n;
+}
+
+/* Players rated rating or less. */
+static int fw_prefix(int rating)
+{
+    int i, n = 0;
+
+    for (i = rating + 1; i > 0; i -= i & -i)
+        n += fenwick[i];
+    return n;
+}
+
+/* Lowest rating with at least k players rated that or less, k >= 1. */
+static int fw_find(int k)
+{
+    int pos = 0, step;
+
+    for (step = BUCKETS; step; step >>= 1) {
+        if (pos + step <= BUCKETS && fenwick[pos + step] < k) {
+            pos += step;
+            k -= fenwick[pos];
+        }
+    }
+    return pos;
+}
+
+static void bucket_insert(int id)
+{
+    int r = records[id].rating;
+
+    prev_same[id] = -1;
+    next_same[id] = bucket_head[r];
+    if (bucket_head[r] >= 0)
+        prev_same[bucket_head[r]] = id;
+    bucket_head[r] = id;
+    fw_add(r, 1);
+}
+
+static void bucket_remove(int id)
+{
+    int r = records[id].rating;
+
+    if (prev_same[id] >= 0)
+        next_same[prev_same[id]] = next_same[id];
+    else
+        bucket_head[r] = next_same[id];
+    if (next_same[id] >= 0)
+        prev_same[next_same[id]] = prev_same[id];
+    fw_add(r, -1);
+}
+
+/*
+ * Name Index
+ */
+
+static unsigned hash_name(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+/* Slot holding name, or the free slot where it belongs. */
+static unsigned find_slot(const char *name)
+{
+    unsigned i = hash_name(name) & index_mask;
+
+    while (index_slots[i] >= 0 && strcmp(records[index_slots[i]].name, name))
+        i = (i + 1) & index_mask;
+    return i;
+}
+
+/* Keeps the index at most half full. */
+static int grow_index(void)
+{
+    unsigned size = index_slots ? (index_mask + 1) * 2 : 2048;
+    int *old = index_slots;
+    int i;
+
+    if (!(index_slots = (int*)malloc(size * sizeof(int)))) {
+        index_slots = old;
+        return -1;
+    }
+    memset(index_slots, -1, size * sizeof(int));
+    index_mask = size - 1;
+    for (i = 0; i < count; i++)
+        index_slots[find_slot(records[i].name)] = i;
+    free(old);
+    return 0;
+}
+
+static int grow_records(void)
+{
+    int cap = capacity ? capacity * 2 : 1024;
+    struct rating_record *r = (struct rating_record*)realloc(records, cap * sizeof(*r));
+    int *n, *p;
+
+    if (r)
+        records = r;
+    n = (int*)realloc(next_same, cap * sizeof(int));
+    if (n)
+        next_same = n;
+    p = (int*)realloc(prev_same, cap * sizeof(int));
+    if (p)
+        prev_same = p;
+    if (!r || !n || !p)
+        return -1;
+    capacity = cap;
+    return 0;
+}
+
+static int valid_name(const char *name)
+{
+    size_t i;
+
+    for (i = 0; name[i]; i++)
+        if (i == PLAYER_NAME_LEN - 1 || name[i] <= ' ' || name[i] > '~')
+            return 0;
+    return i > 0;
+}
+
+/* Finds or adds a player, with the lock held. */
+static int lookup(const char *name, int add)
+{
+    unsigned slot;
+    int id;
+
+    if (!index_slots && grow_index() < 0)
+        return -1;
+    slot = find_slot(name);
+    if (index_slots[slot] >= 0 || !add)
+        return index_slots[slot];
+
+    if ((count == capacity && grow_records() < 0) ||
+        ((unsigned)(count + 1) * 2 > index_mask + 1 && grow_index() < 0))
+        return -1;
+    slot = find_slot(name); /* The index may have moved. */
+
+    id = count++;
+    memset(&records[id], 0, sizeof(records[id]));
+    strcpy(records[id].name, name);
+    records[id].rating = RATING_START;
+    bucket_insert(id);
+    index_slots[slot] = id;
+    atomic_store(&dirty, 1);
+    return id;
+}
+
+int rating_id(const char *name)
+{
+    int id;
+
+    if (!valid_name(name))
+        return -1;
+    pthread_mutex_lock(&lock);
+    id = lookup(name, 1);
+    pthread_mutex_unlock(&lock);
+    return id;
+}
+
+static void set_rating(int id, int rating)
+{
+    bucket_remove(id);
+    records[id].rating = rating < 0 ? 0 : rating > RATING_MAX ? RATING_MAX : rating;
+    bucket_insert(id);
+}
+
+int rating_game(int winner, int loser)
+{
+    int d, g;
+
+    pthread_mutex_lock(&lock);
+    d = records[loser].rating - records[winner].rating;
+    g = gain[(d < -ELO_SPAN ? -ELO_SPAN : d > ELO_SPAN ? ELO_SPAN : d) + ELO_SPAN];
+    set_rating(winner, records[winner].rating + g);
+    set_rating(loser, records[loser].rating - g);
+    records[winner].games++;
+    records[winner].wins++;
+    records[loser].games++;
+    pthread_mutex_unlock(&lock);
+
+    atomic_store(&dirty, 1);
+    return g;
+}
+
+int rating_rank(int id, int *rating)
+{
+    int rank;
+
+    pthread_mutex_lock(&lock);
+    *rating = records[id].rating;
+    rank = count - fw_prefix(*rating) + 1;
+    pthread_mutex_unlock(&lock);
+    return rank;
+}
+
+int rating_count(void)
+{
+    int n;
+
+    pthread_mutex_lock(&lock);
+    n = count;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+int rating_top(struct rating_record *top, int k)
+{
+    int n = 0, below;
+
+    pthread_mutex_lock(&lock);
+    below = count;
+    while (n < k && below > 0) {
+        int r = fw_find(below); /* Best rating left. */
+        int id;
+
+        for (id = bucket_head[r]; id >= 0 && n < k; id = next_same[id])
+            top[n++] = records[id];
+        below = r > 0 ? fw_prefix(r - 1) : 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/*
+ * Snapshots
+ */
+
+static int write_snapshot(void)
+{
+    struct snapshot_header *hdr;
+    char tmp[PATH_MAX];
+    size_t size;
+    char *map;
+    int fd, n, i;
+
+    pthread_mutex_lock(&lock);
+    n = count;
+    pthread_mutex_unlock(&lock);
+
+    size = sizeof(*hdr) + (size_t)n * sizeof(struct rating_record);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot_path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, size) < 0) {
+        perror("ERROR creating the ratings snapshot");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("ERROR mapping the ratings snapshot");
+        return -1;
+    }
+
+    /* Players only ever get added, the first n are still there. */
+    for (i = 0; i < n; i += SNAPSHOT_CHUNK) {
+        int chunk = n - i < SNAPSHOT_CHUNK ? n - i : SNAPSHOT_CHUNK;
+
+        pthread_mutex_lock(&lock);
+        memcpy(map + sizeof(*hdr) + (size_t)i * sizeof(struct rating_record), &records[i], chunk * sizeof(struct rating_record));
+        pthread_mutex_unlock(&lock);
+    }
+    hdr = (struct snapshot_header*)map;
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, 4);
+    hdr->count = n;
+
+    if (msync(map, size, MS_SYNC) < 0) {
+        perror("ERROR syncing the ratings snapshot");
+        munmap(map, size);
+        return -1;
+    }
+    munmap(map, size);
+    if (rename(tmp, snapshot_path) < 0) {
+        perror("ERROR replacing the ratings snapshot");
+        return -1;
+    }
+    return 0;
+}
+
+static void *run_snapshots(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        sleep(RATING_SNAPSHOT_S);
+        if (atomic_exchange(&dirty, 0) && write_snapshot() < 0)
+            atomic_store(&dirty, 1);
+    }
+    return NULL;
+}
+
+static int load_snapshot(const char *path)
+{
+    const struct snapshot_header *hdr;
+    const struct rating_record *rec;
+    struct stat st;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = (const struct snapshot_header*)map;
+    rec = (const struct rating_record*)(hdr + 1);
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, 4) ||
+        (off_t)(sizeof(*hdr) + (size_t)hdr->count * sizeof(*rec)) > st.st_size) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < hdr->count; i++) {
+        char name[PLAYER_NAME_LEN];
+        int id;
+
+        memcpy(name, rec[i].name, PLAYER_NAME_LEN);
+        name[PLAYER_NAME_LEN - 1] = '\0';
+        if (!valid_name(name) || lookup(name, 0) >= 0 || (id = lookup(name, 1)) < 0)
+            continue;
+        set_rating(id, rec[i].rating);
+        records[id].games = rec[i].games;
+        records[id].wins = rec[i].wins;
+    }
+    pthread_mutex_unlock(&lock);
+    munmap(map, st.st_size);
+    atomic_store(&dirty, 0);
+    return 0;
+}
+
+int rating_open(const char *path)
+{
+    pthread_t thread;
+
+    if (!path)
+        return 0;
+    if (load_snapshot(path) < 0)
+        return -1;
+    snapshot_path = path;
+    if (pthread_create(&thread, NULL, run_snapshots, NULL))
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef RATING_H
+#define RATING_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Player ratings (Elo), kept for the whole run and snapshotted to disk.
+ *
+ * Players are found by name through an open addressing hash index. Ranks
+ * come from a Fenwick tree counting players per rating point, with each
+ * rating point's players on a list for the leaderboard: a rank is one
+ * lookup and a dozen adds whatever the number of players, and the top K
+ * costs a tree descent per distinct rating. Everything sits behind one
+ * lock, taken once per game and per lookup.
+ *
+ * With a snapshot file, a background thread writes the records to a fresh
+ * memory mapped file every few seconds, a chunk at a time so that games
+ * ending meanwhile never wait for the whole copy, then renames it over the
+ * previous snapshot. The next run starts from it.
+ */
+
+#define RATING_START 1500
+#define RATING_MAX 4095         /* Ratings are kept in 0..RATING_MAX. */
+#define RATING_SNAPSHOT_S 10
+
+struct rating_record {
+    char name[PLAYER_NAME_LEN];
+    int32_t rating;
+    uint32_t games;
+    uint32_t wins;
+    uint32_t pad;
+};
+
+/* Loads the snapshot at path, if any, and starts the snapshot thread. Without a path, ratings only live in memory. */
+int rating_open(const char *path);
+
+/* Player id for a name, added at RATING_START if new. -1 if the name is not valid or memory is short. */
+int rating_id(const char *name);
+
+/* Scores a game. Returns the winner's gain, which is the loser's loss. */
+int rating_game(int winner, int loser);
+
+/* Rating and 1-based rank of a player, ties sharing the best rank. */
+int rating_rank(int id, int *rating);
+
+/* Rated players so far. */
+int rating_count(void);
+
+/* Copies up to k records, best first. Returns how many. */
+int rating_top(struct rating_record *top, int k);
+
+#endif
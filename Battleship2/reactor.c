@@ -0,0 +1,1118 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "game.h"
+#include "journal.h"
+#include "log.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "pool.h"
+#include "rating.h"
+#include "resume.h"
+#include "server.h"
+#include "timer.h"
+#include "trace.h"
+
+/*
+ * Event driven mode: one thread, one epoll set, every game a state machine.
+ * Sockets are non-blocking; input is accumulated per connection until the
+ * game has a whole message, output is queued by the game and flushed once
+ * per event. Sharded, every core runs this loop on its own listener; the
+ * loop state below is per thread so shards share nothing but the slot pool.
+ *
+ * Deadlines live on a timer wheel, one timer per connection: the prompt
+ * deadline of the player on turn, or how long a lone player has been waiting
+ * for an opponent. The loop sleeps until the earliest and then reaps
+ * whatever is due. A player whose connection dropped keeps its conn, without
+ * socket, and its timer polls for the player's return until the grace period
+ * is over.
+ */
+
+#define MAX_EVENTS 256
+#define LOBBY_MS 20         /* A shard's lone waiting player is offered to the other shards after this. */
+#define POOL_SWEEP_MS 1000  /* Pairing by rating, the pool is checked again for pairs within the widened gaps this often. */
+
+struct conn {
+    int fd;
+    int player_id;
+    int proto;
+    int closed;
+    int want_out;           /* EPOLLOUT is armed. */
+    int handshake;          /* Still waiting to learn the protocol. */
+    int full;               /* Accepted over capacity, turned away once its protocol is known. */
+    long hello_deadline;
+    long enqueued_ns;
+    struct conn *hs_prev;   /* Handshake queue, in accept order. */
+    struct conn *hs_next;
+    int rated;              /* Rating id if the player gave a name, -1 otherwise. */
+    int rating;             /* Its rating when admitted, pairing by rating only. */
+    int pooled;             /* In the rating pool. */
+    struct conn *pool_prev; /* Rating pool, in admission order. */
+    struct conn *pool_next;
+    struct game *game;      /* NULL while waiting for an opponent. */
+    struct conn *peer;
+    struct conn *next_dead; /* Deferred free list. */
+    struct timer timer;     /* Prompt deadline while on turn, idle deadline while waiting. */
+    long grace_deadline;    /* Dropped: the seat is kept until then. 0 otherwise. */
+    struct conn *grace_prev; /* Dropped players of the shard, see take_resumes(). */
+    struct conn *grace_next;
+    int ai;                 /* The server's AI: one of bot_seats, never freed. */
+    struct reader in;
+};
+
+static __thread int epfd;
+static __thread int listeners[2];      /* TCP, then UNIX if there is one. */
+static __thread int nlisteners;
+static __thread struct conn *waiting;   /* Player 0 of the next game. */
+static __thread struct conn *dead;      /* Closed during this batch, freed after it. */
+static __thread struct conn *hs_head, *hs_tail;
+static __thread int wake_efd;               /* A dropped player of the shard is back, or a spectator joined. */
+static __thread struct conn *grace_head;
+static __thread struct conn *pool_head, *pool_tail; /* Waiting players when pairing by rating, unsharded only. */
+static __thread long pool_swept;
+static __thread long waiting_since;
+static __thread int sharded;
+static __thread struct timer_wheel wheel;
+
+/*
+ * Shards pair their own players. A player left alone on its shard is parked
+ * here, out of every epoll set, for whichever shard admits a player next:
+ * without it two players hashed to different shards would never meet.
+ */
+static _Atomic(struct conn *) lobby;
+
+/* The AI's seat of every game slot, allocated once: a game against it allocates nothing. */
+static struct conn *bot_seats;
+static pthread_once_t bot_seats_once = PTHREAD_ONCE_INIT;
+static _Atomic int recovered_taken;     /* The games rebuilt from the journal have a shard. */
+static _Atomic long lobby_deadline;     /* Idle deadline of the parked player, it is on no wheel. */
+
+/* Pairing by rating needs every waiting player in one place: shards keep pairing in arrival order. */
+static int pool_gap(void)
+{
+    return pair_gap && !sharded;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void update_events(struct conn *c)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (c->want_out ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void hs_remove(struct conn *c)
+{
+    if (!c->handshake)
+        return;
+
+    if (c->hs_prev)
+        c->hs_prev->hs_next = c->hs_next;
+    else
+        hs_head = c->hs_next;
+    if (c->hs_next)
+        c->hs_next->hs_prev = c->hs_prev;
+    else
+        hs_tail = c->hs_prev;
+    c->handshake = 0;
+}
+
+static void grace_remove(struct conn *c)
+{
+    if (!c->grace_deadline)
+        return;
+
+    if (c->grace_prev)
+        c->grace_prev->grace_next = c->grace_next;
+    else
+        grace_head = c->grace_next;
+    if (c->grace_next)
+        c->grace_next->grace_prev = c->grace_prev;
+    c->grace_deadline = 0;
+}
+
+static void close_conn(struct conn *c)
+{
+    if (c->closed)
+        return;
+
+    hs_remove(c);
+    grace_remove(c);
+    timer_cancel(&wheel, &c->timer);
+    if (c->fd >= 0) /* The AI's seat has no socket. */
+        close(c->fd);
+    c->closed = 1;
+    if (c->ai) /* Its slot's, for the next game there. */
+        return;
+    c->next_dead = dead;
+    dead = c;
+}
+
+/* Tears a game down once it is over and both sides have been flushed. */
+static void end_game(struct conn *c)
+{
+    struct game *g = c->game;
+    int players = (c->fd >= 0) + (c->peer->fd >= 0); /* Neither the AI nor a dropped player. */
+
+    LOG(LOG_INFO, EV_GAME_OVER, g->id, 0, 0);
+
+    spec_close(g);
+    resume_close(g);
+    close_conn(c);
+    close_conn(c->peer);
+    game_pool_put(g);
+
+    metrics_add(M_PLAYERS_LEFT, players);
+    LOG(LOG_INFO, EV_PLAYER_COUNT, 0, metrics_players(), 0);
+}
+
+/* Writes as much queued output as the socket takes. Returns -1 on error. */
+static int flush_conn(struct conn *c)
+{
+    struct outbuf *out = &c->game->out[c->player_id];
+    size_t sent = 0;
+    int want_out;
+
+    while (sent < out->len) {
+        ssize_t n = send(c->fd, out->data + sent, out->len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += n;
+    }
+
+    metrics_add(M_BYTES_OUT, sent);
+    memmove(out->data, out->data + sent, out->len - sent);
+    out->len -= sent;
+
+    want_out = out->len > 0;
+    if (want_out != c->want_out) {
+        c->want_out = want_out;
+        update_events(c);
+    }
+    return 0;
+}
+
+static void flush_game(struct conn *c);
+
+/* A dropped player's timer: the end of its grace period, or its prompt deadline if that comes first. */
+static void arm_grace(struct conn *c)
+{
+    long deadline = c->game->player_turn == c->player_id ? game_deadline_ns(c->game) / 1000000 : 0;
+
+    timer_add(&wheel, &c->timer, deadline && deadline < c->grace_deadline ? deadline : c->grace_deadline);
+}
+
+/* Keeps the seat of a player without a connection for resume_grace_ms. */
+static void start_grace(struct conn *c)
+{
+    c->grace_deadline = now_ms() + resume_grace_ms;
+    c->grace_prev = NULL;
+    c->grace_next = grace_head;
+    if (grace_head)
+        grace_head->grace_prev = c;
+    grace_head = c;
+    arm_grace(c);
+}
+
+/* The player's connection dropped: keeps its seat open for a while. */
+static void detach(struct conn *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->want_out = 0;
+    reader_init(&c->in, -1);
+    game_detach(c->game, c->player_id);
+    metrics_add(M_PLAYERS_LEFT, 1);
+    resume_open(c->game, wake_efd);
+    start_grace(c);
+}
+
+/* A player's connection failed: it may come back, or it loses. */
+static void drop_player(struct conn *c)
+{
+    if (resume_possible(c->game, c->player_id)) {
+        detach(c);
+        return;
+    }
+    game_abort(c->game, c->player_id);
+    end_game(c);
+}
+
+/* Puts a resumed player's new socket in its seat, reading on from in. */
+static void attach(struct conn *c, int fd, const struct reader *in)
+{
+    struct epoll_event ev;
+
+    timer_cancel(&wheel, &c->timer);
+    grace_remove(c);
+    c->fd = fd;
+    memcpy(&c->in, in, offsetof(struct reader, buf) + in->len);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    game_attach(c->game, c->player_id, fd);
+}
+
+static void pump_game(struct conn *c);
+
+/* The timer of a dropped player went off: its game ends, by forfeit or on time. */
+static void grace_expired(struct conn *c)
+{
+    struct game *g = c->game;
+    long deadline = game_deadline_ns(g);
+    long now = now_ms();
+
+    if (now >= c->grace_deadline)
+        game_abort(g, c->player_id);
+    else if (g->player_turn == c->player_id && deadline && now >= deadline / 1000000)
+        game_timeout(g);
+    else { /* Moved by a turn change since it was armed. */
+        arm_grace(c);
+        return;
+    }
+    flush_game(c);
+    if (!c->closed)
+        end_game(c);
+}
+
+/* Puts every returning player of the shard back in its seat. */
+static void take_resumes(void)
+{
+    struct reader in;
+    struct conn *c;
+    int fd, p;
+
+    c = grace_head;
+    while (c) {
+        struct game *g = c->game;
+
+        if ((fd = resume_take(g, &p, &in)) < 0) {
+            c = c->grace_next;
+            continue;
+        }
+        attach(p == c->player_id ? c : c->peer, fd, &in);
+        if (!c->grace_deadline && !c->peer->grace_deadline)
+            resume_close(g);
+        pump_game(c);
+        c = grace_head; /* The game may have ended and taken the other seat off the list. */
+    }
+}
+
+/* Flushes both players, and ends the game once there is nothing left to say. */
+static void flush_game(struct conn *c)
+{
+    struct game *g = c->game;
+    struct conn *p[2];
+
+    p[c->player_id] = c;
+    p[c->peer->player_id] = c->peer;
+
+    long start = TRACE_START();
+    int err0 = flush_conn(p[0]);
+    int err1 = flush_conn(p[1]);
+
+    spec_flush(g);
+    TRACE(TR_FLUSH, g->id, c->player_id, start);
+
+    if (err0 < 0 || err1 < 0) {
+        drop_player(p[err0 < 0 ? 0 : 1]);
+        return;
+    }
+
+    if (g->state == GAME_OVER && g->out[0].len == 0 && g->out[1].len == 0)
+        end_game(c);
+}
+
+/* Moves the game's deadline to the player on turn, or drops it once the game is over. */
+static void arm_deadline(struct game *g, struct conn *p[2])
+{
+    long deadline = game_deadline_ns(g);
+    struct conn *on = p[g->player_turn];
+    struct conn *off = p[(g->player_turn + 1) % 2];
+
+    /* A dropped player's timer also keeps its grace period, see arm_grace(). */
+    if (off->grace_deadline)
+        arm_grace(off);
+    else
+        timer_cancel(&wheel, &off->timer);
+    if (on->grace_deadline)
+        arm_grace(on);
+    else if (deadline)
+        timer_add(&wheel, &on->timer, deadline / 1000000);
+    else
+        timer_cancel(&wheel, &on->timer);
+}
+
+/* Feeds buffered input to the game for as long as the turn player has a whole message. */
+static void pump_game(struct conn *c)
+{
+    struct game *g = c->game;
+    struct conn *p[2];
+
+    p[c->player_id] = c;
+    p[c->peer->player_id] = c->peer;
+
+    /* Whoever is on turn may already have a message buffered, so keep going until nobody does. */
+    while (g->state != GAME_OVER) {
+        struct client_msg msg;
+        int progress = 0;
+        int i;
+
+        for (i = 0; i < 2 && g->state != GAME_OVER; i++) {
+            struct reader *in = &p[i]->in;
+            ssize_t n = game_parse(g, i, in->buf + in->start, in->len, &msg);
+
+            if (n < 0) { /* Protocol error, the client is out. */
+                game_abort(g, i);
+                break;
+            }
+            if (n > 0) {
+                reader_consume(in, n);
+                game_handle_input(g, i, &msg);
+                progress = 1;
+            }
+        }
+        if (!progress)
+            break;
+    }
+
+    arm_deadline(g, p);
+    flush_game(c);
+}
+
+/* The slot's AI seat, reset for a new game. */
+static struct conn *bot_seat(struct game *g)
+{
+    struct conn *bot = &bot_seats[game_pool_index(g)];
+
+    memset(bot, 0, offsetof(struct conn, in));
+    bot->fd = -1;
+    bot->proto = PROTO_LEGACY;
+    bot->player_id = 1;
+    bot->rated = -1;
+    bot->ai = 1;
+    reader_init(&bot->in, -1);
+    return bot;
+}
+
+/* c1 NULL: against the server's AI. */
+static void start_game(struct conn *c0, struct conn *c1)
+{
+    struct game *g = game_pool_get();
+
+    if (!g) {
+        LOG(LOG_WARN, EV_POOL_FULL, 0, 0, 0);
+        close_conn(c0);
+        if (c1)
+            close_conn(c1);
+        metrics_add(M_PLAYERS_LEFT, c1 ? 2 : 1);
+        return;
+    }
+    if (!c1)
+        c1 = bot_seat(g);
+    game_init(g, c0->fd, c0->proto, c1->fd, c1->proto);
+    if (c1->fd < 0)
+        game_set_bot(g, 1, bot_level);
+    else
+        game_set_rated(g, c0->rated, c1->rated);
+    if (salvo_games)
+        game_set_salvo(g);
+    c0->game = c1->game = g;
+    c0->peer = c1;
+    c1->peer = c0;
+
+    game_start(g);
+    spec_wake_on(g, wake_efd);
+    pump_game(c0);
+}
+
+/* Takes the player parked by some shard, if any, into this shard's epoll set. */
+static struct conn *adopt_parked(void)
+{
+    struct conn *c = atomic_exchange(&lobby, NULL);
+    struct epoll_event ev;
+
+    if (!c)
+        return NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return c;
+}
+
+static void send_id(struct conn *c, int player_id)
+{
+    c->player_id = player_id;
+
+    /* Send the client it's ID. A fresh socket always has room for it. */
+    send_client(c->fd, c->proto, MSG_ID, &c->player_id, 1);
+}
+
+static void pair(struct conn *c0, struct conn *c1)
+{
+    if (sharded || pool_gap()) /* Held back until now, see admit(). */
+        send_id(c0, 0);
+    send_id(c1, 1);
+    mm_note_paired(c0->enqueued_ns);
+    mm_note_paired(c1->enqueued_ns);
+    start_game(c0, c1);
+}
+
+static void alloc_bot_seats(void)
+{
+    if (!(bot_seats = (struct conn*)calloc(game_pool_capacity(), sizeof(struct conn)))) {
+        perror("ERROR allocating the AI's seats");
+        exit(1);
+    }
+}
+
+/* Seats the games rebuilt from the journal: their players have the grace period to come back, as if just dropped. */
+static void adopt_recovered(void)
+{
+    struct game **games;
+    int i, p, n = journal_recovered(&games);
+
+    for (i = 0; i < n; i++) {
+        struct game *g = games[i];
+        struct conn *c[2];
+
+        for (p = 0; p < 2; p++) {
+            if (g->bot.level && p == g->bot.seat) {
+                pthread_once(&bot_seats_once, alloc_bot_seats);
+                c[p] = bot_seat(g);
+            }
+            else if (!(c[p] = (struct conn*)calloc(1, sizeof(struct conn)))) {
+                perror("ERROR allocating a recovered player");
+                exit(1);
+            }
+            c[p]->fd = -1;
+            c[p]->proto = g->proto[p];
+            c[p]->player_id = p;
+            c[p]->rated = -1;
+            c[p]->game = g;
+            reader_init(&c[p]->in, -1);
+        }
+        c[0]->peer = c[1];
+        c[1]->peer = c[0];
+
+        resume_open(g, wake_efd);
+        spec_wake_on(g, wake_efd);
+        for (p = 0; p < 2; p++) {
+            if (c[p]->ai)
+                continue;
+            if (resume_possible(g, p))
+                start_grace(c[p]);
+            else /* A legacy player cannot come back. */
+                game_abort(g, p);
+        }
+        if (g->state == GAME_OVER)
+            end_game(c[0]);
+    }
+}
+
+/* Seats the server's AI, a conn without socket, in front of the client. */
+static void start_bot_game(struct conn *c)
+{
+    send_id(c, 0);
+    mm_note_paired(c->enqueued_ns);
+    start_game(c, NULL);
+}
+
+static void pool_remove(struct conn *c)
+{
+    if (c->pool_prev)
+        c->pool_prev->pool_next = c->pool_next;
+    else
+        pool_head = c->pool_next;
+    if (c->pool_next)
+        c->pool_next->pool_prev = c->pool_prev;
+    else
+        pool_tail = c->pool_prev;
+    c->pooled = 0;
+    timer_cancel(&wheel, &c->timer);
+}
+
+/* Forgets a player that stops waiting for an opponent, whichever way it waited. */
+static void unwait(struct conn *c)
+{
+    if (waiting == c)
+        waiting = NULL;
+    else if (c->pooled)
+        pool_remove(c);
+}
+
+/* The pooled player after c (the whole pool if NULL) closest in rating to p, if within reach. */
+static struct conn *best_fit(struct conn *p, struct conn *c, long now)
+{
+    struct conn *best = NULL;
+    long best_gap = LONG_MAX;
+
+    for (c = c ? c->pool_next : pool_head; c; c = c->pool_next) {
+        long gap = labs((long)c->rating - p->rating);
+        long since = c->enqueued_ns < p->enqueued_ns ? c->enqueued_ns : p->enqueued_ns;
+
+        if (gap <= mm_gap_allowed(now - since) && gap < best_gap) {
+            best = c;
+            best_gap = gap;
+        }
+    }
+    return best;
+}
+
+/* Pairs the pooled players whose allowed gap has grown enough, oldest first. */
+static void sweep_pool(long now)
+{
+    struct conn *c = pool_head;
+
+    pool_swept = now_ms();
+    while (c) {
+        struct conn *c1 = best_fit(c, c, now);
+        struct conn *next = c->pool_next;
+
+        if (c1) {
+            if (next == c1)
+                next = c1->pool_next;
+            pool_remove(c);
+            pool_remove(c1);
+            pair(c, c1);
+        }
+        c = next;
+    }
+}
+
+/* The protocol is known: pair the client, or keep it waiting for an opponent. */
+static void admit(struct conn *c)
+{
+    struct conn *c0 = waiting;
+
+    hs_remove(c);
+
+    if (c->full) {
+        turn_away(c->fd, c->proto);
+        close_conn(c);
+        mm_note_dropped();
+        metrics_add(M_PLAYERS_LEFT, 1);
+        return;
+    }
+
+    if (bot_level) {
+        start_bot_game(c);
+        return;
+    }
+
+    if (pool_gap()) {
+        struct conn *c1;
+
+        if (c->rated >= 0)
+            rating_rank(c->rated, &c->rating);
+        else
+            c->rating = RATING_START;
+        if ((c1 = best_fit(c, NULL, mm_now_ns()))) {
+            pool_remove(c1);
+            pair(c1, c);
+            return;
+        }
+
+        /* It may end up either seat: it learns its id once paired. */
+        c->pooled = 1;
+        c->pool_prev = pool_tail;
+        c->pool_next = NULL;
+        if (pool_tail)
+            pool_tail->pool_next = c;
+        else
+            pool_head = c;
+        pool_tail = c;
+        if (idle_ms)
+            timer_add(&wheel, &c->timer, c->enqueued_ns / 1000000 + idle_ms);
+        return;
+    }
+
+    if (!c0 && sharded)
+        c0 = adopt_parked();
+    if (c0) {
+        if (c0 == waiting)
+            waiting = NULL;
+        pair(c0, c);
+        return;
+    }
+
+    waiting = c;
+    waiting_since = now_ms();
+    if (idle_ms)
+        timer_add(&wheel, &c->timer, c->enqueued_ns / 1000000 + idle_ms);
+
+    /*
+     * Sharded, a lone player may still become player 1 of one parked by
+     * another shard, so it learns its id only once paired.
+     */
+    if (!sharded) {
+        send_id(c, 0);
+        /* Let the user know the server is waiting on a second client. */
+        send_client(c->fd, c->proto, MSG_HLD, NULL, 0);
+    }
+}
+
+/* Moves our lone waiting player to the lobby, or pairs it with the one already there. */
+static void park_waiting(void)
+{
+    struct conn *expected = NULL;
+    struct conn *c0, *c1 = waiting;
+    struct epoll_event ev;
+
+    /* Out of our set and wheel first: once in the lobby it belongs to whoever takes it. */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c1->fd, NULL);
+    timer_cancel(&wheel, &c1->timer);
+    if (atomic_compare_exchange_strong(&lobby, &expected, c1)) {
+        /*
+         * Only once parked: a failed attempt must not move the deadline of
+         * the player already there. reap_parked rechecks the adopted
+         * player's own deadline, so a stale one only delays or hurries a look.
+         */
+        atomic_store(&lobby_deadline, c1->enqueued_ns / 1000000 + idle_ms);
+        waiting = NULL;
+        return;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c1->fd, &ev);
+
+    if ((c0 = adopt_parked())) { /* It waited longer, it plays first. */
+        waiting = NULL;
+        pair(c0, c1);
+    }
+    else { /* Taken meanwhile, try again later. */
+        waiting_since = now_ms();
+        if (idle_ms)
+            timer_add(&wheel, &c1->timer, c1->enqueued_ns / 1000000 + idle_ms);
+    }
+}
+
+/* Hands a reconnecting client over to its game, wherever that game is driven. */
+static void resume(struct conn *c, unsigned game_id, uint64_t token)
+{
+    hs_remove(c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+
+    /* Whatever followed the request, its next move say, goes along with the socket. */
+    if (resume_request(game_id, token, c->fd, c->in.buf + c->in.start, c->in.len) < 0) {
+        send_client(c->fd, PROTO_FRAMED, MSG_INV, NULL, 0);
+        close_conn(c);
+        mm_note_dropped();
+        metrics_add(M_PLAYERS_LEFT, 1);
+        return;
+    }
+    mm_note_paired(c->enqueued_ns);
+    c->fd = -1; /* The game's now. */
+    close_conn(c);
+}
+
+/* Reads the hello of a framed client, if this is one, or its resume request. */
+static void handshake(struct conn *c)
+{
+    unsigned game_id;
+    uint64_t token;
+    ssize_t r;
+    int version;
+
+    if (c->in.len < HELLO_LEN)
+        return;
+
+    if ((r = resume_parse(c->in.buf + c->in.start, c->in.len, &game_id, &token)) >= 0) {
+        if (r > 0) {
+            reader_consume(&c->in, r);
+            resume(c, game_id, token);
+        }
+        return;
+    }
+
+    if ((version = proto_check_hello(c->in.buf + c->in.start))) {
+        char name[PLAYER_NAME_LEN];
+        ssize_t named = proto_parse_name(c->in.buf + c->in.start + HELLO_LEN, c->in.len - HELLO_LEN, name);
+
+        if (named == 0) /* Its name is on its way. */
+            return;
+        reader_consume(&c->in, HELLO_LEN + (named > 0 ? named : 0));
+        c->rated = named > 0 ? rating_id(name) : -1;
+        c->proto = PROTO_FRAMED;
+        send_client(c->fd, PROTO_FRAMED, MSG_HELLO, &version, 1);
+    }
+    admit(c);
+}
+
+/* Legacy clients never speak first: whoever stayed silent long enough gets the legacy protocol. */
+static void expire_handshakes(long now)
+{
+    while (hs_head && hs_head->hello_deadline <= now) {
+        struct conn *c = hs_head;
+
+        if (c->in.len >= HELLO_LEN) { /* A resume request, or a name, that never got whole. */
+            close_conn(c);
+            mm_note_dropped();
+            metrics_add(M_PLAYERS_LEFT, 1);
+        }
+        else
+            admit(c);
+    }
+}
+
+/* A deadline passed: the player on turn forfeits, or the lone waiting player is dropped. */
+static void expire(struct conn *c)
+{
+    if (c->grace_deadline) {
+        grace_expired(c);
+        return;
+    }
+    if (c->game) {
+        game_timeout(c->game);
+        flush_game(c);
+        if (!c->closed) /* Whoever does not read the result does not keep the game. */
+            end_game(c);
+        return;
+    }
+
+    LOG(LOG_INFO, EV_IDLE_CLOSED, 0, 0, 0);
+    metrics_add(M_IDLE_CLOSED, 1);
+    unwait(c);
+    close_conn(c);
+    mm_note_dropped();
+    metrics_add(M_PLAYERS_LEFT, 1);
+}
+
+/* Drops the parked player once it has waited too long, whichever shard gets to it first. */
+static void reap_parked(long now)
+{
+    struct conn *c;
+
+    if (!idle_ms || !atomic_load(&lobby) || now < atomic_load(&lobby_deadline) || !(c = adopt_parked()))
+        return;
+
+    if (now >= c->enqueued_ns / 1000000 + idle_ms) {
+        expire(c);
+    }
+    else if (waiting) { /* Parked since the deadline was read: it waited longer, it plays first. */
+        struct conn *c1 = waiting;
+
+        waiting = NULL;
+        pair(c, c1);
+    }
+    else {
+        waiting = c;
+        waiting_since = now;
+        timer_add(&wheel, &c->timer, c->enqueued_ns / 1000000 + idle_ms);
+    }
+}
+
+static void accept_clients(int lis_sockfd, int tcp)
+{
+    while (1) {
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(cli_addr);
+        struct epoll_event ev;
+        struct conn *c;
+        int one = 1;
+        int fd = accept(lis_sockfd, (struct sockaddr *) &cli_addr, &clilen);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("ERROR accepting a connection from a client.");
+            return;
+        }
+
+        set_nonblocking(fd);
+        if (tcp)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (!(c = (struct conn*)calloc(1, sizeof(struct conn)))) { /* Refused, like on a full queue. */
+            perror("ERROR allocating a connection");
+            close(fd);
+            mm_note_queued();
+            mm_note_dropped();
+            continue;
+        }
+        c->fd = fd;
+        c->proto = PROTO_LEGACY;
+        c->full = server_full();
+        c->rated = -1;
+        reader_init(&c->in, fd);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+        metrics_add(M_PLAYERS_JOINED, 1);
+
+        mm_note_queued();
+        c->enqueued_ns = mm_now_ns();
+        c->handshake = 1;
+        c->hello_deadline = now_ms() + HELLO_WAIT_MS;
+        c->hs_prev = hs_tail;
+        c->hs_next = NULL;
+        if (hs_tail)
+            hs_tail->hs_next = c;
+        else
+            hs_head = c;
+        hs_tail = c;
+    }
+}
+
+static void handle_readable(struct conn *c)
+{
+    ssize_t n = reader_fill(&c->in);
+
+    if (n == 0)
+        return;
+
+    if (n < 0) { /* Client disconnected, or filled its buffer talking out of turn. */
+        if (!c->game) {
+            unwait(c);
+            close_conn(c);
+            mm_note_dropped();
+            metrics_add(M_PLAYERS_LEFT, 1);
+            return;
+        }
+        drop_player(c);
+        return;
+    }
+    metrics_add(M_BYTES_IN, n);
+
+    if (c->handshake)
+        handshake(c);
+    else if (c->game)
+        pump_game(c);
+}
+
+int run_reactor(int lis_sockfd, int unix_sockfd)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    int l;
+
+    if (bot_level)
+        pthread_once(&bot_seats_once, alloc_bot_seats);
+
+    listeners[0] = lis_sockfd;
+    listeners[1] = unix_sockfd;
+    nlisteners = unix_sockfd >= 0 ? 2 : 1;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("ERROR creating epoll instance");
+        return -1;
+    }
+
+    for (l = 0; l < nlisteners; l++) {
+        if (listen(listeners[l], SOMAXCONN) < 0)
+            perror("ERROR: listen");
+        set_nonblocking(listeners[l]);
+
+        /* Listeners and wake_efd are the only fds without a conn. Every shard waits on the shared UNIX one, only one wakes up. */
+        ev.events = EPOLLIN | (l == 1 && sharded ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[l], &ev);
+    }
+
+    if ((wake_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("ERROR creating wake eventfd");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_efd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_efd, &ev);
+
+    wheel_init(&wheel, now_ms());
+    if (!atomic_exchange(&recovered_taken, 1)) /* The first shard up drives the rebuilt games. */
+        adopt_recovered();
+    LOG(LOG_INFO, EV_REACTOR_START, 0, 0, 0);
+
+    while (1) {
+        int i, n, timeout = -1;
+        long now, next;
+        struct timer *t;
+
+        if (hs_head) {
+            timeout = (int)(hs_head->hello_deadline - now_ms());
+            if (timeout < 0)
+                timeout = 0;
+        }
+        if (sharded && waiting) {
+            int left = (int)(waiting_since + LOBBY_MS - now_ms());
+
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : left;
+        }
+        if (pool_head) { /* The allowed gaps widen as the pool waits. */
+            int left = (int)(pool_swept + POOL_SWEEP_MS - now_ms());
+
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : left;
+        }
+        if (sharded && idle_ms && atomic_load(&lobby)) {
+            long left = atomic_load(&lobby_deadline) - now_ms();
+
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : (int)left;
+        }
+        if ((next = wheel_next_ms(&wheel)) >= 0) {
+            long left = next - now_ms();
+
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : (int)left;
+        }
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+        if (dump_stats) {
+            dump_stats = 0;
+            mm_stats_print();
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("ERROR in epoll_wait");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct conn *c = (struct conn*)events[i].data.ptr;
+
+            if (!c) { /* Either listener: accepting on both costs one EAGAIN. */
+                for (l = 0; l < nlisteners; l++)
+                    accept_clients(listeners[l], l == 0);
+                continue;
+            }
+            if (events[i].data.ptr == &wake_efd) {
+                uint64_t count;
+
+                if (read(wake_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("ERROR reading wake eventfd");
+                take_resumes();
+                spec_flush_woken(wake_efd);
+                continue;
+            }
+            if (c->closed || c->grace_deadline) /* Its socket went away earlier in this batch. */
+                continue;
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                handle_readable(c);
+            if (!c->closed && c->game && (events[i].events & EPOLLOUT))
+                flush_game(c);
+        }
+
+        now = now_ms();
+        expire_handshakes(now);
+        if (sharded && waiting && now >= waiting_since + LOBBY_MS)
+            park_waiting();
+        if (pool_head && now >= pool_swept + POOL_SWEEP_MS)
+            sweep_pool(mm_now_ns());
+        while ((t = timer_expired(&wheel, now)))
+            expire(timer_entry(t, struct conn, timer));
+        if (sharded)
+            reap_parked(now);
+
+        /* Nothing in this batch can reference a closed conn any more. */
+        while (dead) {
+            struct conn *c = dead;
+            dead = c->next_dead;
+            free(c);
+        }
+    }
+}
+
+struct shard {
+    int index;
+    int cpu;
+    int portno;
+    int unix_sockfd;
+};
+
+static void *run_shard(void *arg)
+{
+    struct shard *sh = (struct shard*)arg;
+    cpu_set_t set;
+    int lis_sockfd;
+
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        perror("ERROR pinning a shard");
+    LOG(LOG_INFO, EV_SHARD_START, 0, sh->index, sh->cpu);
+    sharded = 1;
+
+    if ((lis_sockfd = open_listener(sh->portno, 1)) >= 0) {
+        run_reactor(lis_sockfd, sh->unix_sockfd);
+        close(lis_sockfd);
+    }
+    return NULL;
+}
+
+int run_shards(int portno, int nshards, int unix_sockfd)
+{
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct shard *shards;
+    pthread_t *threads;
+    int i;
+
+    if (ncpu < 1)
+        ncpu = 1;
+    if (nshards <= 0)
+        nshards = ncpu;
+
+    shards = (struct shard*)calloc(nshards, sizeof(struct shard));
+    threads = (pthread_t*)calloc(nshards, sizeof(pthread_t));
+    if (!shards || !threads) {
+        perror("ERROR allocating the shards");
+        exit(1);
+    }
+    for (i = 0; i < nshards; i++) {
+        shards[i].index = i;
+        shards[i].cpu = i % ncpu;
+        shards[i].portno = portno;
+        shards[i].unix_sockfd = unix_sockfd;
+        if (pthread_create(&threads[i], NULL, run_shard, &shards[i])) {
+            perror("ERROR starting a shard");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < nshards; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "render.h"
+#include "trace.h"
+
+#define GRID_TOP 2          /* Column letters, then rows 0-9 below. */
+#define GRID_WIDTH 26       /* "0  . . . . . . . . . .   " */
+#define TEXT_TOP (GRID_TOP + BOARD_SIZE + 2)
+#define FRAME_MAX 8192
+
+static const char *titles[2];
+static char shown[2][NUM_SQUARES];  /* Cells on screen, valid once drawn. */
+static int tty = -1;                /* Cursor addressing, decided on the first frame. */
+static int drawn;
+static int rows;
+
+static char frame[FRAME_MAX];
+static size_t frame_len;
+
+/* Appends to the frame; a frame that would overflow is cut short. */
+static void emit(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(frame + frame_len, FRAME_MAX - frame_len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        frame_len += (size_t)n < FRAME_MAX - frame_len ? (size_t)n : FRAME_MAX - frame_len - 1;
+}
+
+/* Sends the frame in one write, after whatever stdio still holds. */
+static void flush_frame(void)
+{
+    size_t sent = 0;
+
+    fflush(stdout);
+    while (sent < frame_len) {
+        ssize_t n = write(STDOUT_FILENO, frame + sent, frame_len - sent);
+
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    frame_len = 0;
+}
+
+static char cell(const struct board *b, int sq)
+{
+    char c = board_cell(b, sq);
+
+    return c == ' ' ? '.' : c;
+}
+
+static int use_cursor(void)
+{
+    struct winsize ws;
+
+    if (!isatty(STDOUT_FILENO) || ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col < 2 * GRID_WIDTH)
+        return 0;
+    rows = ws.ws_row;
+    return rows >= TEXT_TOP + 4; /* Room left for the messages. */
+}
+
+void render_init(const char *left, const char *right)
+{
+    titles[0] = left;
+    titles[1] = right;
+    drawn = 0;
+}
+
+/* The whole frame, line by line. */
+static void emit_full(const struct board *b[2])
+{
+    int g, row, col;
+
+    for (g = 0; g < 2; g++)
+        emit("%-*s", GRID_WIDTH, titles[g]);
+    emit("\n");
+    for (g = 0; g < 2; g++)
+        emit("%-*s", GRID_WIDTH, "   A B C D E F G H I J");
+    emit("\n");
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (g = 0; g < 2; g++) {
+            emit("%d  ", row);
+            for (col = 0; col < BOARD_SIZE; col++) {
+                int sq = row * BOARD_SIZE + col;
+
+                shown[g][sq] = cell(b[g], sq);
+                emit("%c ", shown[g][sq]);
+            }
+            emit("   ");
+        }
+        emit("\n");
+    }
+}
+
+static void draw(const struct board *left, const struct board *right)
+{
+    const struct board *b[2] = { left, right };
+    int g, sq;
+
+    if (tty < 0) {
+        tty = use_cursor();
+        if (tty)
+            atexit(render_end);
+    }
+
+    if (!tty) {
+        emit_full(b);
+        flush_frame();
+        return;
+    }
+
+    if (!drawn) { /* Clear, draw everything, keep the messages below. */
+        emit("\033[2J\033[H");
+        emit_full(b);
+        emit("\033[%d;%dr\033[%d;1H", TEXT_TOP, rows, TEXT_TOP);
+        drawn = 1;
+        flush_frame();
+        return;
+    }
+
+    emit("\0337"); /* Save the message cursor. */
+    for (g = 0; g < 2; g++) {
+        for (sq = 0; sq < NUM_SQUARES; sq++) {
+            char c = cell(b[g], sq);
+
+            if (c == shown[g][sq])
+                continue;
+            shown[g][sq] = c;
+            emit("\033[%d;%dH%c", GRID_TOP + 1 + sq / BOARD_SIZE, g * GRID_WIDTH + 4 + 2 * (sq % BOARD_SIZE), c);
+        }
+    }
+    emit("\0338");
+    flush_frame();
+}
+
+void render(const struct board *left, const struct board *right)
+{
+    long start = TRACE_START();
+
+    draw(left, right);
+    TRACE(TR_DRAW, 0, -1, start);
+}
+
+void render_end(void)
+{
+    if (tty <= 0 || !drawn)
+        return;
+    emit("\033[r\033[%d;1H", rows);
+    flush_frame();
+    drawn = 0;
+}
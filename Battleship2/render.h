@@ -0,0 +1,23 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "board.h"
+
+/*
+ * Client board display: two grids side by side (our fleet and our shots,
+ * or both players for a spectator). On a terminal the grids stay pinned at
+ * the top while messages scroll below them, and every frame only rewrites
+ * the cells that changed since the previous one, with ANSI cursor moves.
+ * Anything else gets the whole frame as plain text. Either way a frame is
+ * a single write().
+ */
+
+/* Sets the grid titles. The first render() draws the full frame. */
+void render_init(const char *left, const char *right);
+
+void render(const struct board *left, const struct board *right);
+
+/* Gives the whole terminal back to scrolling text. Also runs at exit. */
+void render_end(void);
+
+#endif
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "board.h"
+#include "game.h"
+#include "journal.h"
+
+/*
+ * Replays server journals through the rule functions, without sockets, and
+ * checks that every recorded placement, shot result and winner comes out
+ * the same. Every thread reads all the (mapped) input in order but only
+ * plays the games whose id falls in its share, so a single journal is
+ * spread over the cores as well as many.
+ */
+
+enum replay_state { PLACING, FIRING, WON };
+
+struct replay_game {
+    uint32_t id;                    /* 0 marks a free table entry. */
+    uint8_t state;
+    uint8_t turn;
+    uint8_t placed[2];
+    uint8_t salvo;                  /* Salvo rules: the turn player may fire several shots in a row. */
+    uint8_t fired;                  /* Shots in the current turn. */
+    struct board board[2];
+};
+
+struct input {
+    const char *path;
+    const struct journal_rec *recs;
+    size_t n;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct replay_game *table;
+    size_t size, used;
+    long records, games, unfinished, orphans, mismatches;
+};
+
+static struct input *inputs;
+static int ninputs, nworkers;
+static _Atomic int reported;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Game Table, open addressing with backward shift deletion
+ */
+
+static size_t slot_of(const struct worker *w, uint32_t id)
+{
+    size_t i = (id * 2654435761u) & (w->size - 1);
+
+    while (w->table[i].id && w->table[i].id != id)
+        i = (i + 1) & (w->size - 1);
+    return i;
+}
+
+static struct replay_game *lookup(struct worker *w, uint32_t id)
+{
+    size_t i = slot_of(w, id);
+
+    return w->table[i].id ? &w->table[i] : NULL;
+}
+
+static struct replay_game *insert(struct worker *w, uint32_t id)
+{
+    size_t i;
+
+    if ((w->used + 1) * 2 > w->size) {
+        struct replay_game *old = w->table;
+        size_t old_size = w->size;
+
+        w->size = w->size ? w->size * 2 : 1024;
+        w->table = (struct replay_game*)calloc(w->size, sizeof(*w->table));
+        for (i = 0; i < old_size; i++)
+            if (old[i].id)
+                w->table[slot_of(w, old[i].id)] = old[i];
+        free(old);
+    }
+
+    i = slot_of(w, id);
+    if (!w->table[i].id) {
+        w->table[i].id = id;
+        w->used++;
+    }
+    return &w->table[i];
+}
+
+static void remove_game(struct worker *w, struct replay_game *g)
+{
+    size_t hole = g - w->table, i = hole;
+
+    while (1) {
+        size_t home;
+
+        i = (i + 1) & (w->size - 1);
+        if (!w->table[i].id)
+            break;
+        home = (w->table[i].id * 2654435761u) & (w->size - 1);
+        /* Move it back unless its home lies cyclically in (hole, i]. */
+        if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+            w->table[hole] = w->table[i];
+            hole = i;
+        }
+    }
+    w->table[hole].id = 0;
+    w->used--;
+}
+
+/*
+ * Checks
+ */
+
+static void mismatch(struct worker *w, const struct journal_rec *rec, const char *what)
+{
+    w->mismatches++;
+    if (atomic_fetch_add(&reported, 1) < 10)
+        fprintf(stderr, "game %u: %s (record type %d, player %d, args %d %d)\n",
+                rec->game_id, what, rec->type, rec->player, rec->arg[0], rec->arg[1]);
+}
+
+static void replay_place(struct worker *w, struct replay_game *g, const struct journal_rec *rec)
+{
+    int p = rec->player;
+
+    if (g->state != PLACING || p != g->turn || rec->arg[1] != g->placed[p]) {
+        mismatch(w, rec, "placement out of turn");
+        return;
+    }
+
+    if (!place_boat(&g->board[p], rec->arg[0], g->placed[p])) {
+        mismatch(w, rec, "recorded placement is now refused");
+        return;
+    }
+
+    if (++g->placed[p] == NUM_BOATS) {
+        if (p == 0) {
+            g->turn = 1;
+        }
+        else {
+            g->state = FIRING;
+            g->turn = 0;
+        }
+    }
+}
+
+static void replay_shot(struct worker *w, struct replay_game *g, const struct journal_rec *rec)
+{
+    int p = rec->player;
+    int other = (p + 1) % 2;
+
+    if (g->state != FIRING || (p != g->turn && !(g->salvo && g->fired))) {
+        mismatch(w, rec, "shot out of turn");
+        return;
+    }
+    if (p != g->turn) { /* The other player's salvo begins. */
+        g->turn = p;
+        g->fired = 0;
+    }
+    if (g->salvo && ++g->fired > board_afloat(&g->board[p])) {
+        mismatch(w, rec, "salvo longer than the boats afloat");
+        return;
+    }
+    if (!check_move(&g->board[other], rec->arg[0])) {
+        mismatch(w, rec, "recorded shot is now refused");
+        return;
+    }
+    if (update_board(&g->board[other], rec->arg[0]) != rec->arg[1]) /* Keep playing the engine's version. */
+        mismatch(w, rec, "shot result differs");
+
+    if (check_board(&g->board[other]))
+        g->state = WON;
+    else if (!g->salvo)
+        g->turn = other;
+}
+
+static void replay_end(struct worker *w, struct replay_game *g, const struct journal_rec *rec)
+{
+    if (rec->player >= 0 && (g->state != WON || rec->player != g->turn))
+        mismatch(w, rec, "winner differs");
+    else if (rec->player < 0 && g->state == WON)
+        mismatch(w, rec, "game was won, not abandoned");
+    w->games++;
+    remove_game(w, g);
+}
+
+static void replay_record(struct worker *w, const struct journal_rec *rec)
+{
+    struct replay_game *g;
+
+    if (rec->type == J_LAST_ID) /* Not a game's. */
+        return;
+    if (rec->type == J_START) { /* A restart (compacted copy) replaces what came before. */
+        g = insert(w, rec->game_id);
+        g->state = PLACING;
+        g->turn = 0;
+        g->placed[0] = g->placed[1] = 0;
+        g->salvo = rec->player > 0;
+        g->fired = 0;
+        board_init(&g->board[0]);
+        board_init(&g->board[1]);
+        return;
+    }
+
+    if (!(g = lookup(w, rec->game_id))) { /* Started before the oldest input. */
+        w->orphans++;
+        return;
+    }
+    if (g->state == WON && rec->type != J_END) {
+        mismatch(w, rec, "game goes on after a win");
+        return;
+    }
+
+    switch (rec->type) {
+    case J_PLACE: replay_place(w, g, rec); break;
+    case J_SHOT: replay_shot(w, g, rec); break;
+    case J_END: replay_end(w, g, rec); break;
+    case J_TOKEN: break; /* Only the server reads them back. */
+    default: mismatch(w, rec, "unknown record type");
+    }
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = (struct worker*)arg;
+    int f;
+    size_t i;
+
+    for (f = 0; f < ninputs; f++) {
+        for (i = 0; i < inputs[f].n; i++) {
+            const struct journal_rec *rec = &inputs[f].recs[i];
+
+            if (rec->game_id % nworkers != (unsigned)w->index || !journal_rec_valid(rec))
+                continue;
+            w->records++;
+            replay_record(w, rec);
+        }
+    }
+    w->unfinished = w->used;
+    return NULL;
+}
+
+/*
+ * Inputs
+ */
+
+static void add_file(const char *path)
+{
+    struct stat st;
+    void *p;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (st.st_size < (off_t)sizeof(struct journal_rec)) {
+        close(fd);
+        return;
+    }
+    if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+
+    inputs = (struct input*)realloc(inputs, (ninputs + 1) * sizeof(*inputs));
+    inputs[ninputs].path = strdup(path);
+    inputs[ninputs].recs = (const struct journal_rec*)p;
+    inputs[ninputs].n = st.st_size / sizeof(struct journal_rec);
+    ninputs++;
+}
+
+static int by_name(const struct dirent **a, const struct dirent **b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int is_segment(const struct dirent *de)
+{
+    unsigned seq;
+    char ext[4];
+
+    /* Live segments and the ones a restart archived share the numbering. */
+    return sscanf(de->d_name, "journal-%8u.%3s", &seq, ext) == 2 && (!strcmp(ext, "seg") || !strcmp(ext, "old"));
+}
+
+/* A directory stands for its segments, oldest first. */
+static void add_path(const char *path)
+{
+    struct dirent **names;
+    struct stat st;
+    char file[PATH_MAX];
+    int i, n;
+
+    if (stat(path, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        add_file(path);
+        return;
+    }
+
+    if ((n = scandir(path, &names, is_segment, by_name)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name);
+        add_file(file);
+        free(names[i]);
+    }
+    free(names);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *workers;
+    long records = 0, games = 0, unfinished = 0, orphans = 0, mismatches = 0;
+    long start, elapsed;
+    size_t bytes = 0;
+    int opt, i;
+
+    nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': nworkers = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage %s [-t threads] journal dir or segment...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage %s [-t threads] journal dir or segment...\n", argv[0]);
+        exit(1);
+    }
+    if (nworkers < 1)
+        nworkers = 1;
+
+    for (i = optind; i < argc; i++)
+        add_path(argv[i]);
+    for (i = 0; i < ninputs; i++)
+        bytes += inputs[i].n * sizeof(struct journal_rec);
+
+    workers = (struct worker*)calloc(nworkers, sizeof(struct worker));
+    start = now_ns();
+    for (i = 0; i < nworkers; i++) {
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            perror("ERROR starting a replay thread");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        records += workers[i].records;
+        games += workers[i].games;
+        unfinished += workers[i].unfinished;
+        orphans += workers[i].orphans;
+        mismatches += workers[i].mismatches;
+    }
+    elapsed = now_ns() - start;
+
+    printf("input         %d files, %.1f MB, %d threads\n", ninputs, bytes / 1e6, nworkers);
+    printf("records       %ld in %.3f s, %.0f records/s\n", records, elapsed / 1e9, records / (elapsed / 1e9));
+    printf("games         %ld replayed, %.0f games/s, %ld unfinished, %ld orphan records\n",
+           games, games / (elapsed / 1e9), unfinished, orphans);
+    printf("mismatches    %ld\n", mismatches);
+
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "game.h"
+#include "metrics.h"
+#include "pool.h"
+#include "resume.h"
+
+#define RESUME_CLOSED ((struct resume_req *)1)    /* pending once the game is closed to resumes. */
+
+struct resume_req {
+    int fd;
+    uint64_t token;
+    struct resume_req *next;
+    size_t len;
+    char rest[];    /* What the client sent after its request. */
+};
+
+int resume_grace_ms = 30000;
+
+ssize_t resume_parse(const char *buf, size_t len, unsigned *game_id, uint64_t *token)
+{
+    struct frame f;
+    ssize_t n;
+
+    if (len < FRAME_HDR_LEN || (unsigned char)buf[0] != MSG_RESUME)
+        return -1;
+    if ((n = frame_parse(buf, len, &f)) <= 0)
+        return n;
+    if (f.len != 3 * sizeof(uint32_t))
+        return -1;
+
+    *game_id = (unsigned)frame_int(&f, 0);
+    *token = (uint64_t)(uint32_t)frame_int(&f, 1) << 32 | (uint32_t)frame_int(&f, 2);
+    return n;
+}
+
+static struct game *find_game(unsigned id)
+{
+    int i;
+
+    for (i = 0; i < game_pool_capacity(); i++) {
+        struct game *g = game_pool_slot(i);
+
+        if (atomic_load_explicit(&g->resume.game_id, memory_order_acquire) == id)
+            return g;
+    }
+    return NULL;
+}
+
+int resume_request(unsigned game_id, uint64_t token, int fd, const char *rest, size_t len)
+{
+    struct resume_req *req, *head;
+    struct game *g;
+    uint64_t one = 1;
+    int efd;
+
+    if (!resume_grace_ms || !game_id || len > READER_SIZE || !(g = find_game(game_id)))
+        return -1;
+
+    if (!(req = (struct resume_req*)malloc(sizeof(*req) + len)))
+        return -1;
+    req->fd = fd;
+    req->token = token;
+    req->len = len;
+    memcpy(req->rest, rest, len);
+
+    head = atomic_load(&g->resume.pending);
+    do {
+        if (head == RESUME_CLOSED) {
+            free(req);
+            return -1;
+        }
+        req->next = head;
+    } while (!atomic_compare_exchange_weak(&g->resume.pending, &head, req));
+
+    if ((efd = atomic_load(&g->resume.wake_fd)) >= 0 && write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("ERROR waking the game's driver");
+    return 0;
+}
+
+/* Tells a client its game cannot be resumed. */
+static void reject(int fd)
+{
+    char buf[FRAME_HDR_LEN];
+    size_t n = proto_encode_raw(PROTO_FRAMED, buf, sizeof(buf), MSG_INV, "", 0);
+
+    send(fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    metrics_add(M_PLAYERS_LEFT, 1);
+}
+
+int resume_possible(const struct game *g, int player_id)
+{
+    return resume_grace_ms && g->state != GAME_OVER && g->proto[player_id] == PROTO_FRAMED;
+}
+
+void resume_open(struct game *g, int wake_fd)
+{
+    struct resume_req *closed = RESUME_CLOSED;
+
+    atomic_store(&g->resume.wake_fd, wake_fd);
+    atomic_compare_exchange_strong(&g->resume.pending, &closed, NULL);
+    atomic_store_explicit(&g->resume.game_id, g->id, memory_order_release);
+}
+
+int resume_take(struct game *g, int *player_id, struct reader *in)
+{
+    struct resume_req *req = atomic_load(&g->resume.pending);
+
+    /* The driver is the only one taking requests off, so a request seen here stays valid. */
+    while (req && req != RESUME_CLOSED) {
+        int fd, p;
+
+        if (!atomic_compare_exchange_weak(&g->resume.pending, &req, req->next))
+            continue;
+        fd = req->fd;
+        p = game_resume_seat(g, req->token);
+
+        if (p >= 0) {
+            *player_id = p;
+            reader_init(in, fd);
+            memcpy(in->buf, req->rest, req->len);
+            in->len = req->len;
+            free(req);
+            return fd;
+        }
+        free(req);
+        reject(fd);
+        req = atomic_load(&g->resume.pending);
+    }
+    return -1;
+}
+
+void resume_close(struct game *g)
+{
+    struct resume_req *req;
+
+    atomic_store(&g->resume.game_id, 0);
+    req = atomic_exchange(&g->resume.pending, RESUME_CLOSED);
+    while (req && req != RESUME_CLOSED) {
+        struct resume_req *next = req->next;
+
+        reject(req->fd);
+        free(req);
+        req = next;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Session resume. Every framed player gets a random token with SRT. When
+ * its connection drops mid game the seat stays open for resume_grace_ms:
+ * a client that connects again and sends MSG_RESUME (game id, token) in
+ * place of the hello is handed over to the game's driver, which checks the
+ * token, puts the new socket in the seat and sends a snapshot (MSG_SNAP)
+ * rather than the game's history.
+ *
+ * Whoever accepts the connection only pushes it on the game's list and
+ * never waits on the game, then wakes the driver with a write to its
+ * eventfd: the one a reactor shard waits on along with its sockets, or the
+ * one of the game's slot a game thread polls next to its player's socket.
+ */
+
+struct game;
+struct reader;
+struct resume_req;
+
+struct resume_slot {
+    _Atomic unsigned game_id;               /* Set while a seat of the game is open, 0 otherwise. */
+    _Atomic(struct resume_req *) pending;   /* Handed over by the acceptors. */
+    _Atomic int wake_fd;                    /* The driver's eventfd. */
+};
+
+extern int resume_grace_ms;     /* 0: a dropped connection ends the game. */
+
+/* Decodes a MSG_RESUME frame. Returns the bytes it used, 0 if more are needed, -1 if it is not one. */
+ssize_t resume_parse(const char *buf, size_t len, unsigned *game_id, uint64_t *token);
+
+/*
+ * Hands fd over to the game, with the len bytes the client sent after its
+ * request (its next move, say). Returns -1 if no open game has that id, fd
+ * is then still the caller's.
+ */
+int resume_request(unsigned game_id, uint64_t token, int fd, const char *rest, size_t len);
+
+/* Whether player_id may drop and come back: a framed player in a running game. */
+int resume_possible(const struct game *g, int player_id);
+
+/*
+ * A seat was left open, see game_detach(). Lets the acceptors find the game,
+ * and wake its driver through wake_fd (-1: nobody is woken).
+ */
+void resume_open(struct game *g, int wake_fd);
+
+/*
+ * A socket whose token matches an open seat of g, or -1. Sets player_id to
+ * the seat and starts in on the socket with the bytes that came with the
+ * request. Wrong tokens are answered MSG_INV and closed on the way.
+ */
+int resume_take(struct game *g, int *player_id, struct reader *in);
+
+/* No seat is open any more, or the game is over: turns every pending request away. */
+void resume_close(struct game *g);
+
+#endif
@@ -3,431 +3,680 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
-
-#define MYPORT 4321   // Port du point de connexion
-
-int player_count = 0;
-pthread_mutex_t mutexcount;
-
-void error(const char *msg)
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <time.h>
+
+#include "game.h"
+#include "journal.h"
+#include "log.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "pool.h"
+#include "rating.h"
+#include "resume.h"
+#include "server.h"
+#include "trace.h"
+
+volatile sig_atomic_t dump_stats;
+int bot_level;
+int idle_ms = 300000;
+long max_players;
+int pair_gap;
+int salvo_games;
+
+/* Per game slot eventfds of the game threads, made on first use and never closed: see spec_wake_on(). */
+static int *wake_fds;
+static pthread_once_t wake_fds_once = PTHREAD_ONCE_INIT;
+
+static void on_sigusr1(int sig)
 {
-    perror(msg);
-    pthread_exit(NULL);
-}
-
-/*
- * Socket Read Functions
- */
-
-/* Reads an int from a client socket. */
-int recv_int(int cli_sockfd)
-{
-    int msg = 0;
-    int n = recv(cli_sockfd, &msg, sizeof(int), 0);
-    
-    if (n < 0 || n != sizeof(int)) /* Not what we were expecting. Client likely disconnected. */
-        return -1;
-    
-    return msg;
-}
-
-void recv_msg(int sockfd, char * msg)
-{
-    /* All messages are 3 bytes. */
-    memset(msg, 0, 4);
-    int n = recv(sockfd, msg, 3, 0);
-    
-    if (n < 0 || n != 3) /* Not what we were expecting. Server got killed or the other client disconnected. */ 
-        perror("ERROR reading message from server socket.");
-
-    #ifdef DEBUG
-    printf("[DEBUG] Received message: %s\n", msg);
-    #endif 
+    (void)sig;
+    dump_stats = 1;
 }
 
 /*
  * Socket Send Functions
  */
 
-/* Sends a message to a client socket. */
-void send_client_msg(int cli_sockfd, char * msg)
+/* Sends a message to a client socket in the client's protocol. */
+void send_client(int cli_sockfd, int proto, int type, const int *ints, int nints)
 {
-    int n = send(cli_sockfd, msg, strlen(msg), 0);
+    char buf[64];
+    size_t len = proto_encode_ints(proto, buf, sizeof(buf), type, ints, nints);
+    int n = send(cli_sockfd, buf, len, MSG_NOSIGNAL);
     if (n < 0)
         perror("ERROR writing msg to client socket");
 }
 
-/* Sends an int to a client socket. */
-void send_client_int(int cli_sockfd, int msg)
+int server_full(void)
 {
-    int n = send(cli_sockfd, &msg, sizeof(int), 0);
-    if (n < 0)
-        perror("ERROR writing int to client socket");
+    return metrics_players() >= max_players;
 }
 
-/* Sends a message to both client sockets. */
-void send_clients_msg(int * cli_sockfd, char * msg)
+void turn_away(int cli_sockfd, int proto)
 {
-    send_client_msg(cli_sockfd[0], msg);
-    send_client_msg(cli_sockfd[1], msg);
+    /* Spread the retries, or every client turned away in a burst comes back in the same one. */
+    int retry = FULL_RETRY_MS + (int)(mm_now_ns() / 1000 % FULL_RETRY_MS);
+
+    metrics_add(M_TURNED_AWAY, 1);
+    LOG(LOG_INFO, EV_TURNED_AWAY, 0, metrics_players(), 0);
+    if (proto == PROTO_FRAMED)
+        send_client(cli_sockfd, proto, MSG_FUL, &retry, 1);
 }
 
-/* Sends an int to both client sockets. */
-void send_clients_int(int * cli_sockfd, int msg)
+/* Accepts one client from a listener that has one waiting, and queues it for the matcher. */
+static void accept_client(int lis_sockfd, int tcp, struct mm_queue *queue)
 {
-    send_client_int(cli_sockfd[0], msg);
-    send_client_int(cli_sockfd[1], msg);
-}
+    int cli_sockfd = accept(lis_sockfd, NULL, NULL);
+
+    if (cli_sockfd < 0) {
+        if (errno != EINTR)
+            perror("ERROR accepting a connection from a client.");
+        return;
+    }
+
+    /* Prompts are tiny and latency bound, don't let Nagle hold them back. */
+    int one = 1;
+    if (tcp)
+        setsockopt(cli_sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
+    /* Over capacity, it still gets its hello answered, then told to come back. */
+    int full = server_full();
+
+    /* Increment the player count. */
+    metrics_add(M_PLAYERS_JOINED, 1);
+    LOG(LOG_INFO, EV_PLAYER_COUNT, 0, metrics_players(), 0);
+
+    if (mm_push(queue, cli_sockfd, full) < 0) { /* Matcher is too far behind. */
+        close(cli_sockfd);
+        mm_note_queued();
+        mm_note_dropped();
+        metrics_add(M_PLAYERS_LEFT, 1);
+    }
+}
 
-/* Sets up the client sockets and client connections. */
-void get_clients(int lis_sockfd, int * cli_sockfd)
+/*
+ * Accepts clients from the TCP listener and the UNIX one (unless -1), and
+ * queues them for the matcher. Never blocks on a client, and keeps accepting
+ * when the server is full: the matcher turns the extra players away.
+ */
+void accept_clients(int lis_sockfd, int unix_sockfd, struct mm_queue *queue)
 {
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-
-    /* Listen for two clients. */
-    int num_conn = 0;
-    while(num_conn < 2)
-    {
-        /* Listen for clients. */
-	if((listen(lis_sockfd, 10 - player_count)) < 0)
-		perror("ERROR: listen");
-
-        clilen = sizeof(cli_addr);
-	
-	/* Accept the connection from the client. */
-        cli_sockfd[num_conn] = accept(lis_sockfd, (struct sockaddr *) &cli_addr, &clilen);
-    
-        if (cli_sockfd[num_conn] < 0)
-            perror("ERROR accepting a connection from a client."); 
-        
-        /* Send the client it's ID. */
-        send(cli_sockfd[num_conn], &num_conn, sizeof(int), 0);
-        
-        /* Increment the player count. */
-        pthread_mutex_lock(&mutexcount);
-        player_count++;
-        printf("Number of players is now %d.\n", player_count);
-        pthread_mutex_unlock(&mutexcount);
-
-        if (num_conn == 0) {
-            /* Send "HLD" to first client to let the user know the server is waiting on a second client. */
-            send_client_msg(cli_sockfd[0],"HLD"); 
-        }
+    struct pollfd pfd[2];
+    int nfds = unix_sockfd >= 0 ? 2 : 1;
+    int i;
+
+    pfd[0].fd = lis_sockfd;
+    pfd[1].fd = unix_sockfd;
+    for (i = 0; i < nfds; i++) {
+        pfd[i].events = POLLIN;
+        if (listen(pfd[i].fd, SOMAXCONN) < 0)
+            perror("ERROR: listen");
+    }
 
-        num_conn++;
+    while (1) {
+        if (poll(pfd, nfds, -1) < 0)
+            continue;
+        for (i = 0; i < nfds; i++)
+            if (pfd[i].revents & POLLIN)
+                accept_client(pfd[i].fd, i == 0, queue);
     }
 }
 
 /*
- * Game Functions
+ * Game Thread
  */
 
-/* Gets placement */
-char* get_player_placement(int cli_sockfd)
+static void alloc_wake_fds(void)
 {
-    
-    /* Tell player to make a move. */
-    send_client_msg(cli_sockfd, "PLT");
+    int i;
 
-    /* Get players move. */
-    return recv_msg(cli_sockfd);
+    if (!(wake_fds = (int*)malloc(game_pool_capacity() * sizeof(*wake_fds)))) {
+        perror("ERROR allocating game eventfds");
+        exit(1);
+    }
+    for (i = 0; i < game_pool_capacity(); i++)
+        wake_fds[i] = -1;
 }
 
-/* Gets a move from a client. */
-int get_player_move(int cli_sockfd)
+/* The eventfd of g's slot, -1 if there is none. Only the thread running the slot's game touches it. */
+static int game_wake_fd(const struct game *g)
 {
-    
-    /* Tell player to make a move. */
-    send_client_msg(cli_sockfd, "TRN");
+    int *fd;
 
-    /* Get players move. */
-    return recv_int(cli_sockfd);
+    pthread_once(&wake_fds_once, alloc_wake_fds);
+    fd = &wake_fds[game_pool_index(g)];
+    if (*fd < 0 && (*fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        perror("ERROR creating a game eventfd");
+    return *fd;
 }
 
-
-int place_boat_on_board(char board[][10], char* placement, int player_id)
+/*
+ * Waits for fd to be readable until deadline_ns (0: no deadline), or for
+ * wake_fd (-1: none) to go off. Returns 1 once fd is readable, 2 if wake_fd
+ * went off first, 0 once the deadline has passed.
+ */
+static int wait_readable(int fd, int wake_fd, long deadline_ns)
 {
-    if (( (board[(int)placement[0]-65][placement[1]-'0'] == ' ')) { /* Move is valid. */
-        return 1;
-   }
-   else { /* Move is invalid. */
-       return 0;
-   }
+    struct pollfd pfd[2];
+    uint64_t count;
+    int n;
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wake_fd;    /* poll() skips it if negative. */
+    pfd[1].events = POLLIN;
+    do {
+        long left = deadline_ns ? (deadline_ns - mm_now_ns() + 999999) / 1000000 : -1;
+
+        if (deadline_ns && left <= 0)
+            return 0;
+        n = poll(pfd, 2, left > INT_MAX ? INT_MAX : (int)left);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0 && !pfd[0].revents) {
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("ERROR reading game eventfd");
+        return 2;
+    }
+    return n;
 }
 
-
-/* Checks that a players move is valid. */
-int check_move(char board[][10], int move, int player_id)
+/*
+ * Blocks until the client has sent a whole message. Returns -1 if it went
+ * away or broke the protocol, -2 if its prompt deadline passed first, -3 if
+ * wake_fd went off first (a spectator or the other player joined): what
+ * was read so far stays in the reader.
+ */
+int recv_client_msg(struct game *g, int player_id, struct reader *in, struct client_msg *msg, int wake_fd)
 {
-    if ((move == 9) || (board[move/10][move%10] == ' ')) { /* Move is valid. */
-        
-        #ifdef DEBUG
-        printf("[DEBUG] Player %d's move was valid.\n", player_id);
-        #endif
-        
-        return 1;
-   }
-   else { /* Move is invalid. */
-       #ifdef DEBUG
-       printf("[DEBUG] Player %d's move was invalid.\n", player_id);
-       #endif
-    
-       return 0;
-   }
+    ssize_t n;
+
+    if (in->fd < 0) /* Not back since the server restarted. */
+        return -1;
+    while ((n = game_parse(g, player_id, in->buf + in->start, in->len, msg)) == 0) {
+        long deadline = game_deadline_ns(g);
+        ssize_t got;
+        int r = deadline || wake_fd >= 0 ? wait_readable(in->fd, wake_fd, deadline) : 1;
+
+        if (r == 0)
+            return -2;
+        if (r == 2)
+            return -3;
+        got = reader_fill(in);
+
+        if (got < 0) /* Client likely disconnected. */
+            return -1;
+        metrics_add(M_BYTES_IN, got);
+    }
+
+    if (n < 0)
+        return -1;
+    reader_consume(in, n);
+    return 0;
 }
 
-/* Updates the board with a new move. */
-void update_board(char board[][10], int move, int player_id)
+/* Writes everything the game queued for a client. */
+void flush_client(struct game *g, int player_id)
 {
-    board[move/10][move%10] = player_id ? 'X' : 'O';
+    struct outbuf *out = &g->out[player_id];
+    size_t sent = 0;
+
+    if (g->cli_sockfd[player_id] < 0)
+        return;
+    while (sent < out->len) {
+        int n = send(g->cli_sockfd[player_id], out->data + sent, out->len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            perror("ERROR writing to client socket");
+            break;
+        }
+        sent += n;
+    }
+    metrics_add(M_BYTES_OUT, sent);
+    out->len = 0;
 }
 
-/* Draws the game board to stdout. */
-void draw_board(char board[][10])
+/* Whether a player may still come back to its seat: both may at first in a game rebuilt from the journal. */
+static int seat_open(const struct game *g)
 {
-    printf("   A | B | C | D | E | F | G | H | I | J | \n");
-    printf("   -------------------------------------------\n");
-    printf("1 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[0][0], board[0][1], board[0][2], board[0][3], board[0][4], board[0][5], board[0][6], board[0][7], board[0][8], board[0][9]);
-    printf("   -------------------------------------------\n");
-    printf("2 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[1][0], board[1][1], board[1][2], board[1][3], board[1][4], board[1][5], board[1][6], board[1][7], board[1][8], board[1][9]);
-    printf("   -------------------------------------------\n");
-    printf("3 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[2][0], board[2][1], board[2][2], board[2][3], board[2][4], board[2][5], board[2][6], board[2][7], board[2][8], board[2][9]);
-    printf("   -------------------------------------------\n");
-    printf("4 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[3][0], board[3][1], board[3][2], board[3][3], board[3][4], board[3][5], board[3][6], board[3][7], board[3][8], board[3][9]);
-    printf("   -------------------------------------------\n");
-    printf("5 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[4][0], board[4][1], board[4][2], board[4][3], board[4][4], board[4][5], board[4][6], board[4][7], board[4][8], board[4][9]);
-    printf("   -------------------------------------------\n");
-    printf("6 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[5][0], board[5][1], board[5][2], board[5][3], board[5][4], board[5][5], board[5][6], board[5][7], board[5][8], board[5][9]);
-    printf("   -------------------------------------------\n");
-    printf("7 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[6][0], board[6][1], board[6][2], board[6][3], board[6][4], board[6][5], board[6][6], board[6][7], board[6][8], board[6][9]);
-    printf("   -------------------------------------------\n");
-    printf("8 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[7][0], board[7][1], board[7][2], board[7][3], board[7][4], board[7][5], board[7][6], board[7][7], board[7][8], board[7][9]);
-    printf("   -------------------------------------------\n");
-    printf("9 | %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[8][0], board[8][1], board[8][2], board[8][3], board[8][4], board[8][5], board[8][6], board[8][7], board[8][8], board[8][9]);
-    printf("   -------------------------------------------\n");
-    printf("10| %c | %c | %c | %c | %c | %c | %c | %c | %c | %c | \n", board[9][0], board[9][1], board[9][2], board[9][3], board[9][4], board[9][5], board[9][6], board[9][7], board[9][8], board[9][9]);
+    int p;
 
+    for (p = 0; p < 2; p++)
+        if (g->cli_sockfd[p] < 0 && !(g->bot.level && p == g->bot.seat) && resume_possible(g, p))
+            return 1;
+    return 0;
 }
 
-/* Sends a board update to both clients. */
-void send_update(int * cli_sockfd, int move, int player_id)
+/* Seats every player that came back, and closes the game to resumes once no seat is left open. */
+static void take_resumes(struct game *g, struct reader in[2])
 {
-    /* Signal an update */    
-    send_clients_msg(cli_sockfd, "UPD");
-
-    /* Send the id of the player that made the move. */
-    send_clients_int(cli_sockfd, player_id);
-    
-    /* Send the move. */
-    send_clients_int(cli_sockfd, move);
-}
+    struct reader back;
+    int fd, p;
 
-/* Sends the number of active players to a client. */
-void send_player_count(int cli_sockfd)
-{
-    send_client_msg(cli_sockfd, "CNT");
-    send_client_int(cli_sockfd, player_count);
+    while ((fd = resume_take(g, &p, &back)) >= 0) {
+        game_attach(g, p, fd);
+        in[p] = back;
+        flush_client(g, p);
+    }
+    if (!seat_open(g))
+        resume_close(g);
 }
 
-/* Checks the board to determine if there is a winner. */
-int check_board(char board[][10], int last_move)
+/*
+ * The turn player's connection dropped, or went with the previous run: keeps
+ * its seat through the grace period, taking in spectators and the other
+ * player of a rebuilt game meanwhile. Returns 1 once the turn player is
+ * back, -1 if it did not come back in time, -2 if its prompt deadline passed
+ * first.
+ */
+static int wait_resume(struct game *g, int player_id, struct reader in[2], int wake_fd)
 {
-   
-    int row = last_move/10;
-    int col = last_move%10;
+    long deadline = mm_now_ns() + resume_grace_ms * 1000000L;
+    long turn_deadline = game_deadline_ns(g);
 
-    if ( board[row][0] == board[row][1] && board[row][1] == board[row][2] ) { /* Check the row for a win. */
+    if (!resume_possible(g, player_id))
+        return -1;
 
-        return 1;
+    if (g->cli_sockfd[player_id] >= 0) {
+        close(g->cli_sockfd[player_id]);
+        game_detach(g, player_id);
+        metrics_add(M_PLAYERS_LEFT, 1);
     }
-    else if ( board[0][col] == board[1][col] && board[1][col] == board[2][col] ) { /* Check the column for a win. */
+    resume_open(g, wake_fd);
 
-        return 1;
-    }
-    else if (!(last_move % 2)) { /* If the last move was at an even numbered position we have to check the diagonal(s) as well. */
-        if ( (last_move == 0 || last_move == 4 || last_move == 8) && (board[1][1] == board[0][0] && board[1][1] == board[2][2]) ) {  /* Check backslash diagonal. */
-            #ifdef DEBUG
-            printf("[DEBUG] Win by backslash diagonal.\n");
-            #endif 
+    if (turn_deadline && turn_deadline < deadline)
+        deadline = turn_deadline;
+    while (1) {
+        take_resumes(g, in);
+        if (g->cli_sockfd[player_id] >= 0)
             return 1;
+        if (!wait_readable(-1, wake_fd, deadline))
+            return deadline == turn_deadline ? -2 : -1;
+        spec_flush(g);
+    }
+}
+
+/* Plays g to the end from wherever it is, then gives its slot back. */
+static void play_game(struct game *g, struct reader in[2], int wake_fd)
+{
+    struct client_msg msg;
+
+    while (g->state != GAME_OVER) {
+        /* Block on the turn player until its whole message is in. */
+        int player_turn = g->player_turn;
+        int r = recv_client_msg(g, player_turn, &in[player_turn], &msg, wake_fd);
+
+        if (r == -3) {
+            spec_flush(g);
+            take_resumes(g, in);
+            continue;
         }
-        if ( (last_move == 2 || last_move == 4 || last_move == 6) && (board[1][1] == board[0][2] && board[1][1] == board[2][0]) ) { /* Check frontslash diagonal. */
-            #ifdef DEBUG
-            printf("[DEBUG] Win by frontslash diagonal.\n");
-            #endif 
-            return 1;
+        if (r == -1)
+            r = wait_resume(g, player_turn, in, wake_fd);
+
+        if (r == -2)
+            game_timeout(g);
+        else if (r == -1)
+            game_abort(g, player_turn);
+        else if (r == 0)
+            game_handle_input(g, player_turn, &msg);
+
+        long flush_start = TRACE_START();
+        flush_client(g, 0);
+        flush_client(g, 1);
+        spec_flush(g);
+        TRACE(TR_FLUSH, g->id, player_turn, flush_start);
+    }
+    spec_close(g);
+    resume_close(g);
+
+    LOG(LOG_INFO, EV_GAME_OVER, g->id, 0, 0);
+
+    /* Close client sockets, free the slot, then decrement player counter so the slot is there for them. */
+    int players = 0;
+    for (int i = 0; i < 2; i++) {
+        if (g->cli_sockfd[i] >= 0) { /* Not the AI, nor a player that dropped for good. */
+            close(g->cli_sockfd[i]);
+            players++;
         }
     }
-    
-    /* No winner, yet. */
-    return 0;
+    game_pool_put(g);
+
+    metrics_add(M_PLAYERS_LEFT, players);
+    LOG(LOG_INFO, EV_PLAYER_COUNT, 0, metrics_players(), 0);
 }
 
 /* Runs a game between two clients. */
 void *run_game(void *thread_data) 
 {
-    int *cli_sockfd = (int*)thread_data; /* Client sockets. */
-    char board[10][10] = { {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, /* Game Board */ 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-			   {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, 
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '},
-                           {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '}, };
-    printf("Game on!\n");
-    
-    /* Send the start message. */
-    send_clients_msg(cli_sockfd, "SRT");
-
-    draw_board(board);
-    
-    int prev_player_turn = 1;
-    int player_turn = 0;
-    int game_over = 0;
-    int turn_count = 0;
-    while(!game_over) {
-        /* Tell other player to wait, if necessary. */
-        if (prev_player_turn != player_turn)
-            send_client_msg(cli_sockfd[(player_turn + 1) % 2], "WAT");
-
-        int valid = 0;
-        int move = 0;
-	char* placement;
-        while(!valid) { /* We need to keep asking for a move until the player's move is valid. */
-            placement = get_player_placement(cli_sockfd[player_turn]);
-            //if (move == -1) break; /* Error reading client socket. */
-
-            printf("Player %d played position %s\n", player_turn, placement);
-                
-            valid = place_boat_on_board(board, placement, player_turn);
-            if (!valid) { /* Move was invalid. */
-                printf("Move was invalid. Let's try this again...\n");
-                send_client_msg(cli_sockfd[player_turn], "INV");
-            }
+    struct game *g = (struct game*)thread_data;
+    struct reader in[2];
+    int wake_fd = game_wake_fd(g);
 
-        }
+    reader_init(&in[0], g->cli_sockfd[0]);
+    reader_init(&in[1], g->cli_sockfd[1]);
 
-	    /*if (placement == -1) { /* Error reading from client. 
-            printf("Player disconnected.\n");
-            break;*/
-        }
-      /*  else if (move == 9) { /* Send the client the number of active players. 
-            prev_player_turn = player_turn;
-            send_player_count(cli_sockfd[player_turn]);
-        }*/
-        else {
-            /* Update the board and send the update. */
-            update_board(board, placement, player_turn);
-            send_update( cli_sockfd, move, player_turn );
-                
-            /* Re-draw the board. */
-            draw_board(board);
-
-            /* Check for a winner/loser. */
-            game_over = check_board(board, move);
-            
-            if (game_over == 1) { /* We have a winner. */
-                send_client_msg(cli_sockfd[player_turn], "WIN");
-                send_client_msg(cli_sockfd[(player_turn + 1) % 2], "LSE");
-                printf("Player %d won.\n", player_turn);
-            }
-            else if (turn_count == 8) { /* There have been nine valid moves and no winner, game is a draw. */
-                printf("Draw.\n");
-                send_clients_msg(cli_sockfd, "DRW");
-                game_over = 1;
-            }
+    game_start(g);
+    spec_wake_on(g, wake_fd);
+    flush_client(g, 0);
+    flush_client(g, 1);
+    spec_flush(g);
 
-            /* Move to next player. */
-            prev_player_turn = player_turn;
-            player_turn = (player_turn + 1) % 2;
-            turn_count++;
-        }
+    play_game(g, in, wake_fd);
+    pthread_exit(NULL);
+}
+
+/* Runs a game rebuilt from the journal. Neither player is there yet, and both may come back from the start. */
+static void *run_recovered(void *thread_data)
+{
+    struct game *g = (struct game*)thread_data;
+    struct reader in[2];
+    int wake_fd = game_wake_fd(g);
+
+    reader_init(&in[0], -1);
+    reader_init(&in[1], -1);
+    resume_open(g, wake_fd);
+    spec_wake_on(g, wake_fd);
+
+    play_game(g, in, wake_fd);
+    return NULL;
+}
+
+/* Starts a new thread for a game between two ready clients, or one and the AI (sockfd1 < 0). Called by the matcher. */
+void start_game_thread(int sockfd0, int proto0, int rated0, int sockfd1, int proto1, int rated1)
+{
+    struct game *g = game_pool_get();
+    pthread_t thread;
+
+    if (!g) {
+        LOG(LOG_WARN, EV_POOL_FULL, 0, 0, 0);
+        close(sockfd0);
+        if (sockfd1 >= 0)
+            close(sockfd1);
+        metrics_add(M_PLAYERS_LEFT, sockfd1 >= 0 ? 2 : 1);
+        return;
     }
+    game_init(g, sockfd0, proto0, sockfd1, proto1);
+    if (sockfd1 < 0)
+        game_set_bot(g, 1, bot_level);
+    else
+        game_set_rated(g, rated0, rated1);
+    if (salvo_games)
+        game_set_salvo(g);
 
-    printf("Game over.\n");
+    #ifdef DEBUG
+    printf("[DEBUG] Starting new game thread...\n");
+    #endif
 
-	/* Close client sockets and decrement player counter. */
-    close(cli_sockfd[0]);
-    close(cli_sockfd[1]);
+    int result = pthread_create(&thread, NULL, run_game, (void *)g); 
 
-    pthread_mutex_lock(&mutexcount);
-    player_count--;
-    printf("Number of players is now %d.", player_count);
-    player_count--;
-    printf("Number of players is now %d.", player_count);
-    pthread_mutex_unlock(&mutexcount);
-    
-    free(cli_sockfd);
+    if (result){
+        printf("Thread creation failed with return code %d\n", result);
+        exit(-1);
+    }
+    pthread_detach(thread);
 
-    pthread_exit(NULL);
+    #ifdef DEBUG
+    printf("[DEBUG] New game thread started.\n");
+    #endif
 }
 
 /* 
  * Main Program
  */
 
-int main(int argc, char *argv[])
-{   
-
-    int sockfd;
+/* Opens a bound listener socket. With reuseport, every shard binds its own on the same port. */
+int open_listener(int portno, int reuseport)
+{
     struct sockaddr_in serv_addr;
+    int one = 1;
 
     /* Get a socket to listen on */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
         perror("ERROR opening listener socket.");
-    
+        return -1;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        perror("ERROR setting SO_REUSEPORT");
+
     /* set up the server info */
+    memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;	
     serv_addr.sin_addr.s_addr = INADDR_ANY;	
-    serv_addr.sin_port = htons(MYPORT);		
+    serv_addr.sin_port = htons(portno);		
 
     /* Bind the server info to the listener socket. */
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
         perror("ERROR binding listener socket.");
 
-    int lis_sockfd = sockfd; /* Listener socket. */
+    return sockfd;
+}
 
-    pthread_mutex_init(&mutexcount, NULL);
+/* Opens a bound AF_UNIX listener at path, replacing whatever a previous run left there. */
+int open_unix_listener(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int sockfd;
 
-    while (1) {
-        if (player_count <= 252) { /* Only launch a new game if we have room. Otherwise, just spin. */  
-            int *cli_sockfd = (int*)malloc(2*sizeof(int)); /* Client sockets */
-            
-            /* Get two clients connected. */
-            get_clients(lis_sockfd, cli_sockfd);
-            
-            #ifdef DEBUG
-            printf("[DEBUG] Starting new game thread...\n");
-            #endif
-
-            pthread_t thread;
-
-	    /* Start a new thread for this game. */
-            int result = pthread_create(&thread, NULL, run_game, (void *)cli_sockfd); 
-
-            if (result){
-                printf("Thread creation failed with return code %d\n", result);
-                exit(-1);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("ERROR opening unix listener socket.");
+        return -1;
+    }
+
+    /* Only a socket left behind by a dead server goes: nobody answers on it any more. */
+    if (lstat(path, &st) == 0) {
+        int probe = S_ISSOCK(st.st_mode) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        int live = probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+
+        if (probe >= 0)
+            close(probe);
+        if (!S_ISSOCK(st.st_mode) || live) {
+            fprintf(stderr, "ERROR %s is %s\n", path, live ? "in use by another server" : "not a socket");
+            close(sockfd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("ERROR binding unix listener socket.");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+int main(int argc, char *argv[])
+{   
+    int opt;
+    int use_reactor = 0;
+    int shards = -1;
+    int log_level = LOG_INFO, board_sample = 0;
+    int stats_port = 0;
+    int spec_port = 0;
+    int games = 0;
+    const char *journal = NULL;
+    const char *unix_path = NULL;
+    const char *trace_path = NULL;
+    const char *ratings = NULL;
+    int unix_sockfd = -1;
+    int portno = MYPORT;
+    int place_ms = 60000, turn_ms = 60000;
+
+    while ((opt = getopt(argc, argv, "evqSa:b:m:g:c:w:j:J:s:p:t:i:r:u:T:R:E:")) != -1) {
+        switch (opt) {
+        case 'e': /* Single threaded epoll reactor instead of one thread per game. */
+            use_reactor = 1;
+            break;
+        case 'v':
+            log_level = LOG_DEBUG;
+            break;
+        case 'q':
+            log_level = LOG_WARN;
+            break;
+        case 'S': /* Salvo: one shot per boat afloat each turn, fired in one message. */
+            salvo_games = 1;
+            break;
+        case 'a': /* Single player: the server plays the second seat, 1 (easy) to 3 (hard). */
+            bot_level = atoi(optarg);
+            if (bot_level < AI_EASY || bot_level >= AI_LEVELS) {
+                fprintf(stderr, "AI level must be %d to %d\n", AI_EASY, AI_LEVELS - 1);
+                exit(1);
+            }
+            break;
+        case 'b': /* Dump one board every N moves of each game. */
+            board_sample = atoi(optarg);
+            break;
+        case 'm': /* Metrics report on a local port. */
+            stats_port = atoi(optarg);
+            break;
+        case 'g': /* Games that can run at once. */
+            games = atoi(optarg);
+            break;
+        case 's': /* Spectators attach to running games on this port. */
+            spec_port = atoi(optarg);
+            break;
+        case 'p': /* Seconds to place each boat before forfeiting, 0 for no limit. */
+            place_ms = atoi(optarg) * 1000;
+            break;
+        case 't': /* Seconds to fire before forfeiting, 0 for no limit. */
+            turn_ms = atoi(optarg) * 1000;
+            break;
+        case 'i': /* Seconds a player waits for an opponent before being dropped, 0 for no limit. */
+            idle_ms = atoi(optarg) * 1000;
+            break;
+        case 'r': /* Seconds a dropped player has to come back, 0 ends the game at once. */
+            resume_grace_ms = atoi(optarg) * 1000;
+            break;
+        case 'c': /* Players admitted at once, beyond that they are told to retry later. */
+            max_players = atol(optarg);
+            break;
+        case 'T': /* Trace game phases to this file, Chrome trace-event JSON. */
+            trace_path = optarg;
+            break;
+        case 'R': /* Keep the named players' ratings in this file across runs. */
+            ratings = optarg;
+            break;
+        case 'E': /* Pair named players by rating, starting this many points apart. */
+            pair_gap = atoi(optarg);
+            break;
+        case 'u': /* Also accept players on a UNIX socket, for bots and gateways on this host. */
+            unix_path = optarg;
+            break;
+        case 'j': /* Journal games in this directory, and recover the ones a crash left. */
+            journal = optarg;
+            break;
+        case 'J': /* Journal segments (4 MB) kept on disk, the oldest go first, 0 for no limit. */
+            journal_keep_segments = atoi(optarg);
+            break;
+        case 'w': /* One reactor per core (0) or per given count, each on its own listener. */
+            shards = atoi(optarg);
+            use_reactor = 1;
+            break;
+        default:
+            fprintf(stderr, "usage %s [-e] [-v | -q] [-S] [-a ai level] [-b moves] [-m metrics port] [-g max games] [-c max players] [-w reactors] [-j journal dir] [-J segments kept] [-s spectator port] [-p place s] [-t turn s] [-i idle s] [-r resume s] [-u socket path] [-T trace file] [-R ratings file] [-E rating gap] [port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        portno = atoi(argv[optind]);
+    game_set_timeouts(place_ms, turn_ms);
+
+    if (log_init(log_level, board_sample) < 0) {
+        perror("ERROR starting the logger");
+        exit(1);
+    }
+    if (game_pool_init(games ? games : use_reactor ? MAX_REACTOR_GAMES : MAX_GAMES) < 0) {
+        perror("ERROR allocating the game slots");
+        exit(1);
+    }
+    if (!max_players) /* As many as the games can seat, one per game against the AI. */
+        max_players = (bot_level ? 1 : 2) * (long)game_pool_capacity();
+    if (journal && journal_open(journal) < 0) {
+        perror("ERROR opening the journal");
+        exit(1);
+    }
+    if (journal && !use_reactor) { /* The reactor takes them in itself. */
+        struct game **recovered;
+        pthread_t thread;
+        int i, n = journal_recovered(&recovered);
+
+        for (i = 0; i < n; i++) {
+            if (pthread_create(&thread, NULL, run_recovered, recovered[i])) {
+                perror("ERROR starting a recovered game");
+                exit(1);
             }
-            
-            #ifdef DEBUG
-            printf("[DEBUG] New game thread started.\n");
-            #endif
+            pthread_detach(thread);
         }
     }
+    if (spec_port && spectate_start(spec_port) < 0) {
+        perror("ERROR opening the spectator port");
+        exit(1);
+    }
+    if (stats_port && stats_start(stats_port) < 0) {
+        perror("ERROR starting the metrics port");
+        exit(1);
+    }
+    if (unix_path && (unix_sockfd = open_unix_listener(unix_path)) < 0)
+        exit(1);
+    if (rating_open(ratings) < 0) {
+        perror("ERROR loading the ratings");
+        exit(1);
+    }
+    if (trace_path && trace_open(trace_path, "server") < 0) {
+        perror("ERROR opening the trace file");
+        exit(1);
+    }
+
+    /* kill -USR1 prints the matchmaking counters. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (shards >= 0) {
+        run_shards(portno, shards, unix_sockfd);
+        return 0;
+    }
+
+    int lis_sockfd = open_listener(portno, 0); /* Listener socket. */
+
+    if (use_reactor) {
+        run_reactor(lis_sockfd, unix_sockfd);
+        close(lis_sockfd);
+        return 0;
+    }
+
+    static struct mm_queue queue;
+    if (mm_queue_init(&queue) < 0 || matchmaker_start(&queue, start_game_thread) < 0) {
+        perror("ERROR starting the matcher");
+        exit(1);
+    }
+
+    accept_clients(lis_sockfd, unix_sockfd, &queue);
 
     close(lis_sockfd);
 
-    pthread_mutex_destroy(&mutexcount);
     pthread_exit(NULL); 
 }
@@ -0,0 +1,52 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+
+#define MYPORT 4321       /* Port du point de connexion */
+#define MAX_GAMES 126            /* Default game slots for the thread per game mode. */
+#define MAX_REACTOR_GAMES 8192   /* Default game slots for the reactor. */
+#define FULL_RETRY_MS 1000       /* A player turned away is told to come back after this, plus up to as much jitter. */
+
+extern volatile sig_atomic_t dump_stats;  /* Set by SIGUSR1. */
+extern int bot_level;   /* With -a, every player faces the server's AI at this level (enum ai_level). */
+extern int idle_ms;     /* A player waiting this long for an opponent is dropped, 0 never. */
+extern long max_players; /* Players admitted at once, set by main(). */
+extern int salvo_games; /* With -S, games between framed players (or against the AI) use the Salvo rules. */
+extern int pair_gap;    /* With -E, named players are paired by rating, this many points apart at first. 0 pairs in arrival order. */
+
+/* Whether a player accepted now is over capacity. Read without a lock, so shards may overshoot by a few. */
+int server_full(void);
+
+/* Tells a client over capacity when to try again (framed only, legacy has no such message). The caller closes it. */
+void turn_away(int cli_sockfd, int proto);
+
+/* Sends a message to a client socket in the client's protocol. */
+void send_client(int cli_sockfd, int proto, int type, const int *ints, int nints);
+
+/* Serves the metrics report on 127.0.0.1:port from a new thread. */
+int stats_start(int port);
+
+/* Opens a bound listener socket. With reuseport, every shard binds its own on the same port. */
+int open_listener(int portno, int reuseport);
+
+/* Opens a bound AF_UNIX listener at path, replacing whatever a previous run left there. */
+int open_unix_listener(const char *path);
+
+/*
+ * Runs every game from one epoll loop on the calling thread, accepting on
+ * the TCP listener and the UNIX one unless it is -1. Never returns unless
+ * epoll fails.
+ */
+int run_reactor(int lis_sockfd, int unix_sockfd);
+
+/*
+ * Runs nshards reactors (one per online core if 0), each pinned to a core
+ * with its own SO_REUSEPORT listener: the kernel spreads connections over
+ * them and a game never leaves the shard that accepted its players. The
+ * UNIX listener, if any, is shared and wakes one shard per connection.
+ */
+int run_shards(int portno, int nshards, int unix_sockfd);
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ai.h"
+#include "board.h"
+#include "game.h"
+
+/*
+ * Self-play: plays games between two AI strategies through the server's
+ * rule functions, without sockets. The games are cut in chunks; every
+ * worker starts with an equal range of chunks and, once it runs dry, steals
+ * half of what is left to another worker. A chunk's RNG is seeded from the
+ * run seed and the chunk number, so a run gives the same totals whatever
+ * the thread count and whoever played which chunk.
+ */
+
+#define CHUNK_GAMES 256
+
+struct strategy {
+    const char *name;
+    int level;
+};
+
+static const struct strategy strategies[] = {
+    { "random", AI_EASY },
+    { "hunt", AI_MEDIUM },
+    { "density", AI_HARD },
+};
+
+/* Games won by one side, and the shots it took to win them. */
+struct tally {
+    long wins;
+    long shots;
+    long shots_sq;
+};
+
+struct worker {
+    _Alignas(64) _Atomic uint64_t range;    /* Chunks left: next in the low 32 bits, end in the high 32 bits. */
+    pthread_t thread;
+    int index;
+    long games;
+    long steals;
+    struct tally side[2];
+};
+
+static struct worker *workers;
+static int nworkers;
+static long total_games;
+static uint64_t run_seed;
+static int level[2];
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* splitmix64: spreads consecutive seeds over the whole state space. */
+static uint64_t mix(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Games
+ */
+
+static void place_fleet(struct ai *ai, struct board *board)
+{
+    uint8_t fleet[NUM_BOATS];
+
+    board_init(board);
+    ai_place_fleet(ai, fleet);
+    if (!place_fleet_on_board(board, fleet))
+        abort(); /* ai_place_fleet only returns valid fleets. */
+}
+
+/* Plays one game, player 0 first. Returns the winner and its shot count. */
+static int play(struct ai ai[2], int *shots)
+{
+    struct board board[2];
+    int fired[2] = { 0, 0 };
+    int p = 0;
+
+    place_fleet(&ai[0], &board[0]);
+    place_fleet(&ai[1], &board[1]);
+
+    while (1) {
+        int other = (p + 1) % 2;
+        int sq = ai_move(&ai[p]);
+        int result;
+
+        if (!check_move(&board[other], sq))
+            abort(); /* ai_move only returns legal shots. */
+        result = update_board(&board[other], sq);
+        ai_observe(&ai[p], sq, result, &board[other]);
+        fired[p]++;
+
+        if (result == SHOT_SUNK && check_board(&board[other])) {
+            *shots = fired[p];
+            return p;
+        }
+        p = other;
+    }
+}
+
+/* Plays one chunk. Side 0 moves first in even games, side 1 in odd ones. */
+static void play_chunk(struct worker *w, uint32_t chunk)
+{
+    uint64_t rng = run_seed ^ ((uint64_t)chunk << 32);
+    long g = (long)chunk * CHUNK_GAMES;
+    long end = g + CHUNK_GAMES < total_games ? g + CHUNK_GAMES : total_games;
+
+    for (; g < end; g++) {
+        struct ai ai[2];
+        int first = g % 2;
+        int winner, shots;
+        struct tally *t;
+
+        ai_init(&ai[0], 0, level[first], mix(&rng));
+        ai_init(&ai[1], 1, level[!first], mix(&rng));
+        winner = play(ai, &shots);
+
+        t = &w->side[winner ^ first];
+        t->wins++;
+        t->shots += shots;
+        t->shots_sq += (long)shots * shots;
+    }
+    w->games += end - (long)chunk * CHUNK_GAMES;
+}
+
+/*
+ * Scheduler
+ */
+
+static int take_chunk(struct worker *w, uint32_t *chunk)
+{
+    uint64_t range = atomic_load(&w->range);
+    uint32_t next, end;
+
+    do {
+        next = (uint32_t)range;
+        end = (uint32_t)(range >> 32);
+        if (next >= end)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&w->range, &range, (uint64_t)end << 32 | (next + 1)));
+
+    *chunk = next;
+    return 1;
+}
+
+/* Moves the back half of some other worker's chunks to w. */
+static int steal(struct worker *w)
+{
+    int i;
+
+    for (i = 1; i < nworkers; i++) {
+        struct worker *victim = &workers[(w->index + i) % nworkers];
+        uint64_t range = atomic_load(&victim->range);
+        uint32_t next, end, half;
+
+        do {
+            next = (uint32_t)range;
+            end = (uint32_t)(range >> 32);
+            if (next >= end)
+                break;
+            half = (end - next + 1) / 2;
+        } while (!atomic_compare_exchange_weak(&victim->range, &range, (uint64_t)(end - half) << 32 | next));
+
+        if (next < end) {
+            atomic_store(&w->range, (uint64_t)end << 32 | (end - half));
+            w->steals++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = (struct worker*)arg;
+    uint32_t chunk;
+
+    do {
+        while (take_chunk(w, &chunk))
+            play_chunk(w, chunk);
+    } while (steal(w));
+    return NULL;
+}
+
+/*
+ * Report
+ */
+
+static int find_strategy(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+        if (!strcmp(strategies[i].name, name))
+            return strategies[i].level;
+    fprintf(stderr, "unknown strategy %s (random, hunt or density)\n", name);
+    exit(1);
+}
+
+static const char *strategy_name(int lvl)
+{
+    return strategies[lvl - AI_EASY].name;
+}
+
+/* Win rate and mean shots to win, each with a 95% confidence interval. */
+static void print_side(const char *name, const struct tally *t, long games)
+{
+    double p = games ? (double)t->wins / games : 0;
+    double mean = t->wins ? (double)t->shots / t->wins : 0;
+    double var = t->wins > 1 ? (t->shots_sq - t->wins * mean * mean) / (t->wins - 1) : 0;
+
+    printf("%-8s  wins %6.2f%% +/- %.2f%%, shots to win %.2f +/- %.2f\n", name,
+           100 * p, games ? 100 * 1.96 * sqrt(p * (1 - p) / games) : 0.0,
+           mean, t->wins ? 1.96 * sqrt(var / t->wins) : 0.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage %s [-n games] [-t threads] [-s seed] [strategy strategy]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct tally side[2] = { { 0, 0, 0 }, { 0, 0, 0 } };
+    long games = 0, steals = 0, start, elapsed;
+    uint32_t nchunks, per;
+    int opt, i, s;
+
+    total_games = 1000000;
+    nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    run_seed = 1;
+    level[0] = AI_HARD;
+    level[1] = AI_MEDIUM;
+
+    while ((opt = getopt(argc, argv, "n:t:s:")) != -1) {
+        switch (opt) {
+        case 'n': total_games = atol(optarg); break;
+        case 't': nworkers = atoi(optarg); break;
+        case 's': run_seed = strtoull(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind == 2) {
+        level[0] = find_strategy(argv[optind]);
+        level[1] = find_strategy(argv[optind + 1]);
+    }
+    else if (argc != optind) {
+        usage(argv[0]);
+    }
+    if (nworkers < 1)
+        nworkers = 1;
+    if (total_games < 1 || total_games / CHUNK_GAMES >= UINT32_MAX)
+        usage(argv[0]);
+
+    /* Every worker starts with an equal share of the chunks. */
+    nchunks = (uint32_t)((total_games + CHUNK_GAMES - 1) / CHUNK_GAMES);
+    per = (nchunks + nworkers - 1) / nworkers;
+    workers = (struct worker*)aligned_alloc(64, sizeof(struct worker) * nworkers);
+    memset(workers, 0, sizeof(struct worker) * nworkers);
+
+    start = now_ns();
+    for (i = 0; i < nworkers; i++) {
+        uint32_t first = i * per < nchunks ? i * per : nchunks;
+        uint32_t end = first + per < nchunks ? first + per : nchunks;
+
+        workers[i].index = i;
+        atomic_init(&workers[i].range, (uint64_t)end << 32 | first);
+    }
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            perror("ERROR starting a simulation thread");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        games += workers[i].games;
+        steals += workers[i].steals;
+        for (s = 0; s < 2; s++) {
+            side[s].wins += workers[i].side[s].wins;
+            side[s].shots += workers[i].side[s].shots;
+            side[s].shots_sq += workers[i].side[s].shots_sq;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    printf("games     %ld in %.3f s, %.0f games/s, %d threads, %ld steals\n",
+           games, elapsed / 1e9, games / (elapsed / 1e9), nworkers, steals);
+    print_side(strategy_name(level[0]), &side[0], games);
+    print_side(strategy_name(level[1]), &side[1], games);
+    return 0;
+}
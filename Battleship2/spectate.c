@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "game.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "spectate.h"
+
+/*
+ * A spectator connects to the spectator port, sends the framed hello and a
+ * MSG_WATCH frame with a game id, and gets MSG_HELLO back, then the game's
+ * history and live events: SRT (game id), UPD (player, square, result),
+ * WIN (winner) or LSE (the player who left). An unknown or finished game
+ * gets MSG_INV and the socket is closed.
+ *
+ * A viewer whose socket fills up is handed to the spectator thread with
+ * what it still owes, at most SPEC_BACKLOG_LEN bytes: further behind, that
+ * is a snapshot of the game (MSG_SNAP) instead of the events it missed.
+ * The thread waits for the socket to drain and gives the viewer back.
+ */
+
+#define SPEC_CLOSED ((struct spectator *)1)  /* joining of a finished game. */
+#define SPEC_ATTACH_MS 1000                  /* Time a spectator has to say what it watches. */
+#define SPEC_BACKLOG_LEN 1024                /* What a lagging viewer may still owe, about 60 shots. */
+#define SPEC_STALL_MS 10000                  /* Time a lagging viewer has to take its backlog. */
+
+struct spectator {
+    int fd;
+    unsigned game_id;
+    size_t sent;            /* Offset in the game's history. */
+    struct spectator *next;
+    long deadline_ns;       /* Lagging: when it is given up. */
+    size_t queued;          /* Lagging: bytes of backlog, qsent of them sent. */
+    size_t qsent;
+    char backlog[SPEC_BACKLOG_LEN];
+};
+
+/* A connection that has not said yet what it watches, owned by the spectator thread. */
+struct joiner {
+    int fd;
+    long deadline_ns;
+};
+
+static int spec_sockfd;
+static int spec_enabled;
+
+static struct joiner *joiners;
+static int njoiners, cap_joiners;
+
+static _Atomic(struct spectator *) lagging;    /* Handed over by the game drivers. */
+static int lagging_efd;                         /* Wakes the spectator thread for them. */
+static struct spectator **slow;                 /* Lagging, owned by the spectator thread. */
+static int nslow, cap_slow;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void drop(struct spectator *s)
+{
+    close(s->fd);
+    free(s);
+    metrics_add(M_SPECTATORS_LEFT, 1);
+}
+
+/* Replies on a spectator socket, which always has room for one small frame. */
+static void send_frame(int fd, int type, const int *ints, int nints)
+{
+    char buf[64];
+    size_t len = proto_encode_ints(PROTO_FRAMED, buf, sizeof(buf), type, ints, nints);
+
+    send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void reject(struct spectator *s)
+{
+    send_frame(s->fd, MSG_INV, NULL, 0);
+    drop(s);
+}
+
+/*
+ * Game Side, on the game's driver thread
+ */
+
+void spec_open(struct game *g)
+{
+    struct spec_stream *st = &g->spec;
+
+    if (!spec_enabled)
+        return;
+
+    st->viewers = NULL;
+    st->len = 0;
+    st->flushed = 0;
+    atomic_store(&st->joining, NULL);
+    atomic_store(&st->wake_fd, -1);
+    atomic_store_explicit(&st->game_id, g->id, memory_order_release);
+}
+
+void spec_wake_on(struct game *g, int wake_fd)
+{
+    atomic_store(&g->spec.wake_fd, wake_fd);
+}
+
+void spec_publish(struct game *g, int type, const int *ints, int nints)
+{
+    struct spec_stream *st = &g->spec;
+    size_t n;
+
+    if (!spec_enabled)
+        return;
+
+    while (!(n = proto_encode_ints(PROTO_FRAMED, st->data + st->len, st->cap - st->len, type, ints, nints))) {
+        char *data = (char*)realloc(st->data, st->cap ? st->cap * 2 : 1024);
+
+        if (!data)
+            return;
+        st->data = data;
+        st->cap = st->cap ? st->cap * 2 : 1024;
+    }
+    st->len += n;
+}
+
+/* Moves the spectators handed over since the last call to the viewer list. Returns how many. */
+static int take_joining(struct game *g, struct spectator *mark)
+{
+    struct spec_stream *st = &g->spec;
+    struct spectator *s = atomic_exchange(&st->joining, mark);
+    struct spectator *next;
+    int joined = 0;
+
+    for (; s && s != SPEC_CLOSED; s = next) {
+        next = s->next;
+        if (s->game_id != g->id) { /* Meant for the game this slot held before. */
+            reject(s);
+            continue;
+        }
+        s->next = st->viewers;
+        st->viewers = s;
+        joined++;
+        LOG(LOG_DEBUG, EV_SPECTATOR_JOINED, g->id, 0, 0);
+    }
+    return joined;
+}
+
+/* Sends what the socket takes right now. Returns -1 if the spectator is gone. */
+static int send_viewer(const struct spec_stream *st, struct spectator *s)
+{
+    while (s->sent < st->len) {
+        ssize_t n = send(s->fd, st->data + s->sent, st->len - s->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        s->sent += n;
+        metrics_add(M_BYTES_OUT, n);
+    }
+    return 0;
+}
+
+/* The first frame of the history that starts at or after off. */
+static size_t frame_boundary(const struct spec_stream *st, size_t off)
+{
+    size_t at = 0;
+
+    while (at < off) {
+        struct frame f;
+
+        at += frame_parse(st->data + at, st->len - at, &f);
+    }
+    return at;
+}
+
+/*
+ * The viewer's socket is full: queues what it still owes, or the rest of
+ * the frame it is in and a snapshot once that is too much, and hands it to
+ * the spectator thread until the socket drains.
+ */
+static void fall_behind(const struct game *g, struct spectator *s)
+{
+    const struct spec_stream *st = &g->spec;
+    size_t owed = st->len - s->sent;
+    struct spectator *head;
+    uint64_t one = 1;
+
+    if (owed > SPEC_BACKLOG_LEN) {
+        char snap[SPEC_SNAPSHOT_LEN];
+
+        owed = frame_boundary(st, s->sent) - s->sent;
+        memcpy(s->backlog, st->data + s->sent, owed);
+        spec_snapshot_encode(snap, g->board);
+        owed += proto_encode_raw(PROTO_FRAMED, s->backlog + owed, SPEC_BACKLOG_LEN - owed, MSG_SNAP, snap, sizeof(snap));
+    }
+    else {
+        memcpy(s->backlog, st->data + s->sent, owed);
+    }
+    s->queued = owed;
+    s->qsent = 0;
+    s->sent = st->len;
+    s->deadline_ns = now_ns() + SPEC_STALL_MS * 1000000L;
+
+    head = atomic_load(&lagging);
+    do {
+        s->next = head;
+    } while (!atomic_compare_exchange_weak(&lagging, &head, s));
+    if (write(lagging_efd, &one, sizeof(one)) < 0)
+        perror("ERROR waking the spectator thread");
+}
+
+static void flush_viewers(struct game *g)
+{
+    struct spec_stream *st = &g->spec;
+    struct spectator **pp = &st->viewers;
+    struct spectator *s;
+
+    while ((s = *pp)) {
+        if (send_viewer(st, s) < 0) {
+            *pp = s->next;
+            drop(s);
+        }
+        else if (s->sent < st->len) {
+            *pp = s->next;
+            fall_behind(g, s);
+        }
+        else {
+            pp = &s->next;
+        }
+    }
+    st->flushed = st->len;
+}
+
+void spec_flush(struct game *g)
+{
+    struct spec_stream *st = &g->spec;
+    int joined = 0;
+
+    if (!spec_enabled)
+        return;
+
+    if (atomic_load_explicit(&st->joining, memory_order_relaxed))
+        joined = take_joining(g, NULL);
+    if (joined || st->len != st->flushed)
+        flush_viewers(g);
+}
+
+void spec_flush_woken(int wake_fd)
+{
+    int i;
+
+    if (!spec_enabled)
+        return;
+
+    for (i = 0; i < game_pool_capacity(); i++) {
+        struct game *g = game_pool_slot(i);
+
+        /* A slot another driver took over has its wake_fd by the time its game_id shows. */
+        if (atomic_load_explicit(&g->spec.game_id, memory_order_acquire) && atomic_load(&g->spec.wake_fd) == wake_fd
+            && atomic_load_explicit(&g->spec.joining, memory_order_relaxed))
+            spec_flush(g);
+    }
+}
+
+void spec_close(struct game *g)
+{
+    struct spec_stream *st = &g->spec;
+    struct spectator *s;
+
+    if (!spec_enabled)
+        return;
+
+    atomic_store(&st->game_id, 0);
+    take_joining(g, SPEC_CLOSED);
+    flush_viewers(g);
+
+    while ((s = st->viewers)) {
+        st->viewers = s->next;
+        drop(s);
+    }
+    st->len = 0;
+    st->flushed = 0;
+}
+
+/*
+ * Spectator Thread
+ */
+
+static struct game *find_game(unsigned id)
+{
+    int i;
+
+    for (i = 0; i < game_pool_capacity(); i++) {
+        struct game *g = game_pool_slot(i);
+
+        if (atomic_load_explicit(&g->spec.game_id, memory_order_acquire) == id)
+            return g;
+    }
+    return NULL;
+}
+
+/* Queues a spectator for the game's driver, and wakes it. Fails once the game is over. */
+static int hand_over(struct game *g, struct spectator *s)
+{
+    struct spectator *head = atomic_load(&g->spec.joining);
+    uint64_t one = 1;
+    int efd;
+
+    do {
+        if (head == SPEC_CLOSED)
+            return -1;
+        s->next = head;
+    } while (!atomic_compare_exchange_weak(&g->spec.joining, &head, s));
+
+    /* Drivers never close the eventfds they give out, so a game that just ended only gets a spurious wake up. */
+    if ((efd = atomic_load(&g->spec.wake_fd)) >= 0 && write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("ERROR waking a game's driver");
+    return 0;
+}
+
+/*
+ * Looks for the hello and the game id without waiting on the socket, and
+ * hands the spectator over once both are in. Returns 1 once the connection
+ * is settled either way, 0 to keep waiting.
+ */
+static int attach(struct joiner *j, long now)
+{
+    char buf[HELLO_LEN + FRAME_HDR_LEN + sizeof(uint32_t)];
+    struct frame f;
+    struct spectator *s;
+    struct game *g;
+    int version, id;
+    ssize_t r, n = recv(j->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        n = 0;
+    else if (n <= 0)
+        goto fail;
+
+    if (n >= HELLO_LEN && !(version = proto_check_hello(buf)))
+        goto fail;
+    if (n < HELLO_LEN || (r = frame_parse(buf + HELLO_LEN, n - HELLO_LEN, &f)) == 0) { /* The rest is on its way. */
+        if (now < j->deadline_ns)
+            return 0;
+        goto fail;
+    }
+    if (r < 0 || f.type != MSG_WATCH || (id = frame_int(&f, 0)) <= 0)
+        goto fail;
+
+    recv(j->fd, buf, HELLO_LEN + r, 0);
+    send_frame(j->fd, MSG_HELLO, &version, 1);
+
+    if (!(s = (struct spectator*)malloc(sizeof(*s))))
+        goto fail;
+    s->fd = j->fd;
+    s->game_id = (unsigned)id;
+    s->sent = 0;
+    s->queued = 0;
+
+    metrics_add(M_SPECTATORS_JOINED, 1);
+    if (!(g = find_game(s->game_id)) || hand_over(g, s) < 0)
+        reject(s);
+    return 1;
+
+fail:
+    close(j->fd);
+    return 1;
+}
+
+/* Takes every connection the listener has, each with SPEC_ATTACH_MS to say what it watches. */
+static void accept_joiners(long now)
+{
+    while (1) {
+        int one = 1;
+        int fd = accept(spec_sockfd, NULL, NULL);   /* Never read or written without MSG_DONTWAIT. */
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("ERROR accepting a spectator");
+            return;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (njoiners == cap_joiners) {
+            struct joiner *grown = (struct joiner*)realloc(joiners, (cap_joiners ? cap_joiners * 2 : 16) * sizeof(*joiners));
+
+            if (!grown) {
+                perror("ERROR allocating a spectator");
+                close(fd);
+                continue;
+            }
+            joiners = grown;
+            cap_joiners = cap_joiners ? cap_joiners * 2 : 16;
+        }
+        joiners[njoiners].fd = fd;
+        joiners[njoiners].deadline_ns = now + SPEC_ATTACH_MS * 1000000L;
+        njoiners++;
+    }
+}
+
+/* Takes the viewers the game drivers left behind since the last call. */
+static void take_lagging(void)
+{
+    struct spectator *s, *next;
+    uint64_t count;
+
+    if (read(lagging_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("ERROR reading spectator eventfd");
+
+    for (s = atomic_exchange(&lagging, NULL); s; s = next) {
+        next = s->next;
+        if (nslow == cap_slow) {
+            struct spectator **grown = (struct spectator**)realloc(slow, (cap_slow ? cap_slow * 2 : 16) * sizeof(*slow));
+
+            if (!grown) {
+                perror("ERROR allocating a lagging spectator");
+                drop(s);
+                continue;
+            }
+            slow = grown;
+            cap_slow = cap_slow ? cap_slow * 2 : 16;
+        }
+        slow[nslow++] = s;
+    }
+}
+
+/* Sends what a lagging viewer owes. Returns 1 once it is all out, 0 if the socket is full again, -1 if the viewer is gone. */
+static int send_backlog(struct spectator *s)
+{
+    while (s->qsent < s->queued) {
+        ssize_t n = send(s->fd, s->backlog + s->qsent, s->queued - s->qsent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        s->qsent += n;
+        metrics_add(M_BYTES_OUT, n);
+    }
+    return 1;
+}
+
+/* A lagging viewer caught up: back to its game, or gone with it if the game is over. */
+static void catch_up(struct spectator *s)
+{
+    struct game *g;
+
+    s->queued = 0;
+    if (!(g = find_game(s->game_id)) || hand_over(g, s) < 0)
+        drop(s);
+}
+
+/*
+ * Polls the listener, every joining spectator and every lagging viewer, so
+ * a silent or slow one holds up nobody else.
+ */
+static void *run_spectate(void *arg)
+{
+    struct pollfd *pfds = NULL;
+    int cap_pfds = 0;
+
+    (void)arg;
+
+    while (1) {
+        long now = now_ns();
+        int i, j, n, w, timeout = -1;
+
+        /* Slot 0 is the listener, slot 1 wakes us for lagging viewers, then the joiners and the lagging. */
+        if (cap_pfds < 2 + njoiners + nslow) {
+            struct pollfd *grown = (struct pollfd*)realloc(pfds, (2 + njoiners + nslow) * 2 * sizeof(*pfds));
+
+            if (!grown) { /* Come back once a joiner has gone. */
+                perror("ERROR allocating spectator poll set");
+                sleep(1);
+                continue;
+            }
+            pfds = grown;
+            cap_pfds = (2 + njoiners + nslow) * 2;
+        }
+        pfds[0].fd = spec_sockfd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = lagging_efd;
+        pfds[1].events = POLLIN;
+        for (i = 0; i < njoiners; i++) {
+            long left = (joiners[i].deadline_ns - now + 999999) / 1000000;
+
+            pfds[2 + i].fd = joiners[i].fd;
+            pfds[2 + i].events = POLLIN;
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : (int)left;
+        }
+        w = njoiners;
+        for (i = 0; i < nslow; i++) {
+            long left = (slow[i]->deadline_ns - now + 999999) / 1000000;
+
+            pfds[2 + w + i].fd = slow[i]->fd;
+            pfds[2 + w + i].events = POLLOUT;
+            if (timeout < 0 || left < timeout)
+                timeout = left < 0 ? 0 : (int)left;
+        }
+
+        n = poll(pfds, 2 + w + nslow, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("ERROR in spectator poll");
+            return NULL;
+        }
+        now = now_ns();
+
+        /* Settle the joiners heard from or out of time, keeping the others in arrival order. */
+        for (i = 0, j = 0; i < w; i++) {
+            if (!((n > 0 && pfds[2 + i].revents) || now >= joiners[i].deadline_ns) || !attach(&joiners[i], now))
+                joiners[j++] = joiners[i];
+        }
+        njoiners = j;
+
+        /* Then the lagging viewers whose socket has room, giving up on the ones stuck for too long. */
+        for (i = 0, j = 0; i < nslow; i++) {
+            struct spectator *s = slow[i];
+            int r = n > 0 && pfds[2 + w + i].revents ? send_backlog(s) : 0;
+
+            if (r < 0 || (r == 0 && now >= s->deadline_ns))
+                drop(s);
+            else if (r > 0)
+                catch_up(s);
+            else
+                slow[j++] = s;
+        }
+        nslow = j;
+
+        if (n > 0 && pfds[1].revents)
+            take_lagging();
+        if (n > 0 && pfds[0].revents)
+            accept_joiners(now);
+    }
+    return NULL;
+}
+
+int spectate_start(int port)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+
+    spec_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (spec_sockfd < 0)
+        return -1;
+    setsockopt(spec_sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(spec_sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(spec_sockfd, SOMAXCONN) < 0) {
+        close(spec_sockfd);
+        return -1;
+    }
+
+    if ((lagging_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        close(spec_sockfd);
+        return -1;
+    }
+
+    spec_enabled = 1;
+    if (pthread_create(&thread, NULL, run_spectate, NULL))
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include <stddef.h>
+
+/*
+ * Spectators. A game's public events (start, shots, end) are encoded once,
+ * framed, into a history buffer that lives as long as the game; every
+ * spectator is just an offset into it, so a thousand viewers cost a
+ * thousand send() calls on the same bytes and no extra encoding. A viewer
+ * attaching late starts at offset 0 and catches up from the same buffer.
+ *
+ * Only the game's driver writes to live spectators, never blocking. A
+ * viewer whose socket fills up goes to the spectator thread with what it
+ * owes, or a snapshot once that is too much, and comes back when its
+ * socket has drained. An error drops it, and whatever is still unsent when
+ * the game ends is lost.
+ */
+
+struct game;
+struct spectator;
+
+struct spec_stream {
+    _Atomic unsigned game_id;               /* Set while the game can be watched, 0 otherwise. */
+    _Atomic(struct spectator *) joining;    /* Handed over by the spectator thread. */
+    _Atomic int wake_fd;                    /* Written to when it hands one over, -1 if nobody listens. */
+    struct spectator *viewers;
+    char *data;                             /* Every event so far, kept across games of the slot. */
+    size_t len;
+    size_t cap;
+    size_t flushed;                         /* len at the last flush. */
+};
+
+/* Serves spectators on port from a new thread. Until then, games keep no history. */
+int spectate_start(int port);
+
+/* Opens the game to spectators. Called by game_start(). */
+void spec_open(struct game *g);
+
+/* Appends one event to the game's history. */
+void spec_publish(struct game *g, int type, const int *ints, int nints);
+
+/*
+ * Has the spectator thread write to wake_fd, an eventfd the driver waits
+ * on, whenever it hands the game a spectator: a quiet game then still
+ * flushes it at once. Call after game_start(), which clears it.
+ */
+void spec_wake_on(struct game *g, int wake_fd);
+
+/* Takes in new spectators and sends them whatever they have not seen yet. */
+void spec_flush(struct game *g);
+
+/* spec_flush() for every game woken through wake_fd that has spectators to take in. */
+void spec_flush_woken(int wake_fd);
+
+/* Last flush, then closes every spectator of a finished game. */
+void spec_close(struct game *g);
+
+#endif
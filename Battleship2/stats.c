@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "rating.h"
+#include "server.h"
+
+/*
+ * Metrics port: every connection gets one plain text report, one "name value"
+ * per line, then the socket is closed (try `nc localhost 4322`). Rates are
+ * over the time since the previous report.
+ */
+
+#define STATS_TOP 10    /* Leaderboard entries in the report. */
+
+static int stats_sockfd;
+static long started_ns;
+
+static void print_hist(FILE *out, const char *name, const struct hist *h)
+{
+    fprintf(out, "%s_count %lu\n", name, (unsigned long)h->count);
+    fprintf(out, "%s_mean %.1f\n", name, h->count ? (double)h->sum / h->count : 0.0);
+    fprintf(out, "%s_p50 %lu\n", name, (unsigned long)hist_percentile(h, 50));
+    fprintf(out, "%s_p90 %lu\n", name, (unsigned long)hist_percentile(h, 90));
+    fprintf(out, "%s_p99 %lu\n", name, (unsigned long)hist_percentile(h, 99));
+    fprintf(out, "%s_p999 %lu\n", name, (unsigned long)hist_percentile(h, 99.9));
+    fprintf(out, "%s_max %lu\n", name, (unsigned long)h->max);
+}
+
+static void report(FILE *out)
+{
+    static struct metrics m;  /* Only the stats thread reports. */
+    static uint64_t prev_moves;
+    static long prev_ns;
+    struct rating_record top[STATS_TOP];
+    struct mm_stats mm;
+    long now = mm_now_ns();
+    double secs = (now - (prev_ns ? prev_ns : started_ns)) / 1e9;
+    int i, n;
+
+    metrics_snapshot(&m);
+    mm_stats_get(&mm);
+
+    fprintf(out, "uptime_s %.3f\n", (now - started_ns) / 1e9);
+    fprintf(out, "players %lu\n", (unsigned long)(m.count[M_PLAYERS_JOINED] - m.count[M_PLAYERS_LEFT]));
+    fprintf(out, "spectators %lu\n", (unsigned long)(m.count[M_SPECTATORS_JOINED] - m.count[M_SPECTATORS_LEFT]));
+    fprintf(out, "games_active %lu\n", (unsigned long)(m.count[M_GAMES_STARTED] + m.count[M_GAMES_RECOVERED] - m.count[M_GAMES_ENDED]));
+    fprintf(out, "games_started %lu\n", (unsigned long)m.count[M_GAMES_STARTED]);
+    fprintf(out, "games_recovered %lu\n", (unsigned long)m.count[M_GAMES_RECOVERED]);
+    fprintf(out, "games_ended %lu\n", (unsigned long)m.count[M_GAMES_ENDED]);
+    fprintf(out, "games_timed_out %lu\n", (unsigned long)m.count[M_TIMEOUTS]);
+    fprintf(out, "players_resumed %lu\n", (unsigned long)m.count[M_RESUMED]);
+    fprintf(out, "queue_depth %ld\n", mm.depth);
+    fprintf(out, "queue_max_depth %ld\n", mm.max_depth);
+    fprintf(out, "queue_dropped %ld\n", mm.dropped);
+    fprintf(out, "idle_closed %lu\n", (unsigned long)m.count[M_IDLE_CLOSED]);
+    fprintf(out, "turned_away %lu\n", (unsigned long)m.count[M_TURNED_AWAY]);
+    fprintf(out, "max_players %ld\n", max_players);
+    fprintf(out, "moves %lu\n", (unsigned long)m.count[M_MOVES]);
+    fprintf(out, "moves_per_s %.1f\n", secs > 0 ? (m.count[M_MOVES] - prev_moves) / secs : 0.0);
+    fprintf(out, "bytes_in %lu\n", (unsigned long)m.count[M_BYTES_IN]);
+    fprintf(out, "bytes_out %lu\n", (unsigned long)m.count[M_BYTES_OUT]);
+    print_hist(out, "reply_plt_us", &m.reply_us[REPLY_PLT]);
+    print_hist(out, "reply_trn_us", &m.reply_us[REPLY_TRN]);
+    fprintf(out, "log_dropped %lu\n", (unsigned long)log_dropped());
+    fprintf(out, "rated_players %d\n", rating_count());
+    for (i = 0, n = rating_top(top, STATS_TOP); i < n; i++) {
+        fprintf(out, "top_%d_name %s\n", i + 1, top[i].name);
+        fprintf(out, "top_%d_rating %d\n", i + 1, top[i].rating);
+    }
+
+    prev_moves = m.count[M_MOVES];
+    prev_ns = now;
+}
+
+static void *run_stats(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        int fd = accept(stats_sockfd, NULL, NULL);
+        FILE *out;
+
+        if (fd < 0) {
+            perror("ERROR accepting a metrics connection");
+            continue;
+        }
+        if (!(out = fdopen(fd, "w"))) {
+            close(fd);
+            continue;
+        }
+        report(out);
+        fclose(out);
+    }
+    return NULL;
+}
+
+int stats_start(int port)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+
+    started_ns = mm_now_ns();
+
+    stats_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stats_sockfd < 0)
+        return -1;
+    setsockopt(stats_sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    /* Local only, the report is not meant for players. */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(stats_sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(stats_sockfd, 16) < 0) {
+        close(stats_sockfd);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, run_stats, NULL))
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
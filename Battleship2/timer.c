@@ -0,0 +1,169 @@
+#include "timer.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static void link_timer(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void unlink_timer(struct timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* Files t in the slot its deadline falls in, seen from the current tick. */
+static void place(struct timer_wheel *w, struct timer *t)
+{
+    long delta = t->expires - w->tick;
+    int level = 0, index;
+
+    if (delta < 0) {
+        t->slot = -1;
+        link_timer(&w->due, t);
+        return;
+    }
+    if (delta > MAX_DELTA) { /* Fires early rather than wrapping around. */
+        t->expires = w->tick + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    while (delta >> (WHEEL_BITS * (level + 1)))
+        level++;
+
+    index = (t->expires >> (WHEEL_BITS * level)) & SLOT_MASK;
+    t->slot = level * WHEEL_SLOTS + index;
+    link_timer(&w->slots[level][index], t);
+    w->occupied[level] |= 1ULL << index;
+}
+
+void wheel_init(struct timer_wheel *w, long now_ms)
+{
+    int level, index;
+
+    w->tick = now_ms / TIMER_TICK_MS;
+    w->due = NULL;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        w->occupied[level] = 0;
+        for (index = 0; index < WHEEL_SLOTS; index++)
+            w->slots[level][index] = NULL;
+    }
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, long expires_ms)
+{
+    timer_cancel(w, t);
+    t->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS; /* Never early. */
+    place(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+    int level = t->slot / WHEEL_SLOTS;
+    int index = t->slot & SLOT_MASK;
+
+    if (!t->pprev)
+        return;
+
+    unlink_timer(t);
+    if (t->slot >= 0 && !w->slots[level][index])
+        w->occupied[level] &= ~(1ULL << index);
+}
+
+/* The wheel below wrapped around: moves the next slot of each level above down. */
+static void cascade(struct timer_wheel *w)
+{
+    int level;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        int index = (w->tick >> (WHEEL_BITS * level)) & SLOT_MASK;
+        struct timer *list = w->slots[level][index];
+
+        w->slots[level][index] = NULL;
+        w->occupied[level] &= ~(1ULL << index);
+        while (list) {
+            struct timer *t = list;
+
+            list = t->next;
+            place(w, t);
+        }
+        if (index) /* Only a level at index 0 wrapped the one above it. */
+            break;
+    }
+}
+
+/* Runs every tick up to target, jumping over empty level 0 slots. */
+static void advance(struct timer_wheel *w, long target)
+{
+    while (w->tick <= target) {
+        int index = w->tick & SLOT_MASK;
+        uint64_t ahead;
+        struct timer *list;
+
+        if (index == 0)
+            cascade(w);
+
+        ahead = w->occupied[0] >> index;
+        if (!(ahead & 1)) {
+            long next = ahead ? w->tick + __builtin_ctzll(ahead) : (w->tick | SLOT_MASK) + 1;
+
+            w->tick = next <= target ? next : target + 1;
+            continue;
+        }
+
+        list = w->slots[0][index];
+        w->slots[0][index] = NULL;
+        w->occupied[0] &= ~(1ULL << index);
+        while (list) {
+            struct timer *t = list;
+
+            list = t->next;
+            t->slot = -1;
+            link_timer(&w->due, t);
+        }
+        w->tick++;
+    }
+}
+
+struct timer *timer_expired(struct timer_wheel *w, long now_ms)
+{
+    struct timer *t;
+
+    if (!w->due)
+        advance(w, now_ms / TIMER_TICK_MS);
+    if (!(t = w->due))
+        return NULL;
+    unlink_timer(t);
+    return t;
+}
+
+long wheel_next_ms(const struct timer_wheel *w)
+{
+    long boundary = (w->tick + SLOT_MASK) & ~(long)SLOT_MASK; /* Next cascade. */
+    uint64_t ahead = w->occupied[0] >> (w->tick & SLOT_MASK);
+    long next = -1;
+    int level;
+
+    if (w->due)
+        return 0;
+
+    if (ahead)
+        next = w->tick + __builtin_ctzll(ahead);
+    else if (w->occupied[0]) /* Only slots of the next turn around. */
+        next = boundary + __builtin_ctzll(w->occupied[0]);
+
+    /* Timers above level 0 are at least one cascade away. */
+    for (level = 1; level < WHEEL_LEVELS; level++)
+        if (w->occupied[level] && (next < 0 || boundary < next))
+            next = boundary;
+
+    return next < 0 ? -1 : next * TIMER_TICK_MS;
+}
@@ -0,0 +1,56 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel, for one thread. Level 0 has a slot per tick,
+ * every level above a slot per WHEEL_SLOTS ticks of the one below; a timer
+ * goes to the lowest level whose span reaches its deadline and moves down
+ * when the wheel below wraps around to it. Adding and cancelling are a few
+ * pointer writes, and the reactor checks for due timers once per loop.
+ */
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4      /* 2^24 ticks, over 46 hours. */
+
+/* Embedded in the object it times out, see timer_entry(). */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   /* NULL while not armed. */
+    long expires;           /* Tick. */
+    int slot;               /* level * WHEEL_SLOTS + index, -1 once due. */
+};
+
+struct timer_wheel {
+    long tick;              /* Next tick to run: every timer before it is due. */
+    uint64_t occupied[WHEEL_LEVELS];
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct timer *due;
+};
+
+#define timer_entry(t, type, member) ((type *)((char *)(t) - offsetof(type, member)))
+
+void wheel_init(struct timer_wheel *w, long now_ms);
+
+/* Arms t for expires_ms, or moves it there if already armed. */
+void timer_add(struct timer_wheel *w, struct timer *t, long expires_ms);
+
+/* Disarms t. Does nothing if it is not armed. */
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+static inline int timer_pending(const struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/* Disarms and returns one timer due by now_ms, or NULL if there is none. */
+struct timer *timer_expired(struct timer_wheel *w, long now_ms);
+
+/* When the next timer may be due, -1 if none is armed. Never later than the real deadline. */
+long wheel_next_ms(const struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096   /* Spans per thread, power of two. */
+#define TRACE_IDLE_NS 10000000 /* Writer nap when every ring is empty. */
+
+struct trace_record {
+    long start_ns;
+    long end_ns;
+    uint32_t game_id;
+    int16_t player;
+    uint8_t span;
+};
+
+/* Same scheme as the logger's rings: owned by one thread at a time, handed over on exit. */
+struct trace_ring {
+    _Alignas(64) _Atomic unsigned head;
+    _Alignas(64) _Atomic unsigned tail;
+    _Atomic int owned;
+    int tid;                                /* Track in the viewer. */
+    struct trace_ring *next;
+    struct trace_record rec[TRACE_RING_SIZE];
+};
+
+int trace_enabled;
+
+static _Atomic(struct trace_ring *) rings;
+static _Atomic int nrings;
+static _Atomic uint64_t dropped;
+static __thread struct trace_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;  /* Writer thread against trace_close(). */
+static FILE *out;
+static int pid;
+
+static const char *const span_name[TR_COUNT] = {
+    [TR_REPLY_PLT] = "reply PLT",
+    [TR_REPLY_TRN] = "reply TRN",
+    [TR_HANDLE] = "handle",
+    [TR_FLUSH] = "flush",
+    [TR_THINK] = "think",
+    [TR_WAIT] = "wait",
+    [TR_DRAW] = "draw",
+};
+
+long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void release_ring(void *arg)
+{
+    struct trace_ring *r = (struct trace_ring*)arg;
+
+    atomic_store_explicit(&r->owned, 0, memory_order_release);
+}
+
+static struct trace_ring *claim_ring(void)
+{
+    struct trace_ring *r;
+    int free_ring;
+
+    for (r = atomic_load(&rings); r; r = r->next) {
+        free_ring = 0;
+        if (atomic_compare_exchange_strong(&r->owned, &free_ring, 1))
+            break;
+    }
+
+    if (!r) {
+        if (!(r = (struct trace_ring*)calloc(1, sizeof(*r))))
+            return NULL;
+        atomic_init(&r->owned, 1);
+        r->tid = atomic_fetch_add(&nrings, 1) + 1;
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void trace_write(int span, uint32_t game_id, int player, long start_ns, long end_ns)
+{
+    struct trace_ring *r = my_ring;
+    struct trace_record *rec;
+    unsigned tail, head;
+
+    if (!r && !(r = my_ring = claim_ring())) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &r->rec[tail & (TRACE_RING_SIZE - 1)];
+    rec->start_ns = start_ns;
+    rec->end_ns = end_ns;
+    rec->game_id = game_id;
+    rec->player = (int16_t)player;
+    rec->span = (uint8_t)span;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/* One complete ("X") event, microseconds with nanosecond decimals. */
+static void print_record(const struct trace_record *rec, int tid)
+{
+    long dur = rec->end_ns - rec->start_ns;
+
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld.%03ld,\"dur\":%ld.%03ld",
+            span_name[rec->span], pid, tid, rec->start_ns / 1000, rec->start_ns % 1000, dur / 1000, dur % 1000);
+    if (rec->game_id)
+        fprintf(out, ",\"args\":{\"game\":%u,\"player\":%d}", rec->game_id, rec->player);
+    fputc('}', out);
+}
+
+/* Writes out every ring. Returns the spans written, -1 once the trace is closed. */
+static int drain(void)
+{
+    struct trace_ring *r;
+    int drained = 0;
+
+    pthread_mutex_lock(&write_lock);
+    if (!out) {
+        pthread_mutex_unlock(&write_lock);
+        return -1;
+    }
+    for (r = atomic_load(&rings); r; r = r->next) {
+        unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+        for (; head != tail; head++, drained++)
+            print_record(&r->rec[head & (TRACE_RING_SIZE - 1)], r->tid);
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    if (drained)
+        fflush(out);
+    pthread_mutex_unlock(&write_lock);
+    return drained;
+}
+
+static void *run_writer(void *arg)
+{
+    struct timespec idle = { 0, TRACE_IDLE_NS };
+    int n;
+
+    (void)arg;
+
+    while ((n = drain()) >= 0) {
+        if (!n)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+int trace_open(const char *path, const char *process)
+{
+    pthread_t thread;
+
+    if (!(out = fopen(path, "w")))
+        return -1;
+    if (pthread_key_create(&ring_key, release_ring))
+        return -1;
+    pid = (int)getpid();
+
+    /* Every later event starts with a comma: a file cut short only lacks the closing bracket, which viewers do without. */
+    fprintf(out, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, process);
+    fflush(out);
+
+    if (pthread_create(&thread, NULL, run_writer, NULL))
+        return -1;
+    pthread_detach(thread);
+    trace_enabled = 1;
+    return 0;
+}
+
+void trace_close(void)
+{
+    uint64_t lost;
+
+    if (!trace_enabled)
+        return;
+    trace_enabled = 0;
+    drain();
+
+    pthread_mutex_lock(&write_lock);
+    if ((lost = atomic_load(&dropped)))
+        fprintf(stderr, "Trace: %lu spans dropped.\n", (unsigned long)lost);
+    fputs("\n]\n", out);
+    fclose(out);
+    out = NULL;
+    pthread_mutex_unlock(&write_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Opt-in phase tracing, shared by client and server, written as Chrome
+ * trace-event JSON (open it in Perfetto or chrome://tracing). Every thread
+ * appends spans to its own single producer ring; a writer thread drains the
+ * rings to the file. Like the logger it never takes a lock and never
+ * blocks: a full ring drops the span. Turned off, a span costs one load and
+ * a branch.
+ *
+ * Timestamps come from CLOCK_MONOTONIC, shared by every process on the
+ * host: client and server traces of the same game line up.
+ */
+
+enum trace_span {
+    /* Server. */
+    TR_REPLY_PLT,       /* PLT queued to the reply parsed: network there and back, and the player. */
+    TR_REPLY_TRN,       /* Same for TRN. */
+    TR_HANDLE,          /* Reply validated and applied, the AI's answer included. */
+    TR_FLUSH,           /* Queued messages written to both players and the spectators. */
+    /* Client. */
+    TR_THINK,           /* Prompt received to reply sent: the human. */
+    TR_WAIT,            /* Reply sent to the next message: network, server and opponent. */
+    TR_DRAW,            /* One frame of the grids written out. */
+    TR_COUNT
+};
+
+extern int trace_enabled;
+
+/* Opens the trace file and starts the writer. process names this process's track. */
+int trace_open(const char *path, const char *process);
+
+/* Drains what is left and ends the JSON array. The array is still readable without it. */
+void trace_close(void);
+
+/* Monotonic nanoseconds, the clock spans are measured with. */
+long trace_now(void);
+
+void trace_write(int span, uint32_t game_id, int player, long start_ns, long end_ns);
+
+/* Records a span from start_ns to now. */
+#define TRACE(span, game_id, player, start_ns) \
+    do { if (trace_enabled) trace_write((span), (game_id), (player), (start_ns), trace_now()); } while (0)
+
+/* Start of a span, only read when tracing. */
+#define TRACE_START() (trace_enabled ? trace_now() : 0)
+
+#endif